@@ -7,11 +7,18 @@
 #include <list>
 #include <vector>
 #include <deque>
+#include <memory>
+#include <span>
+#include <variant>
+#include <cstring>
+#include <functional>
 
 /*** Generic used typedefs ***/
 typedef uint8_t byte;
 typedef std::vector<byte> bytearr;
 typedef std::deque<byte> bytedeque;
+/* Bytes borrowed from the loaded module file; see MappedFile */
+typedef std::span<const byte> bytespan;
 typedef uint32_t Opcode_t;
 /* Buffer for parsing/decoding */
 typedef struct {
@@ -28,6 +35,18 @@ using Value = std::variant<
   double            // f64  (0x7C)
 >;
 
+/* Untagged 8-byte value slot used for the operand stack, locals and globals
+ * at runtime. Instructions are typed, so the reader of a slot always knows
+ * which member is live; Value is only used at the API boundary.
+ * {raw} comes first so that value-initialisation zeroes all 8 bytes. */
+union Slot {
+  uint64_t raw;
+  int32_t i32;
+  int64_t i64;
+  float f32;
+  double f64;
+};
+
 inline float raw_to_f32(uint32_t raw) {
   float value;
   std::memcpy(&value, &raw, sizeof(value));
@@ -40,14 +59,54 @@ inline double raw_to_f64(uint64_t raw) {
   return value;
 }
 
+/* Workers for per-function parsing, validation and translation (--threads) */
 extern int g_threads;
 /*** Global trace/err/disassemble flags and macros. ***/
-#define TRACE(...) do { if(g_trace) fprintf(stderr, __VA_ARGS__); } while(0)
+/* Trace output is compiled in up to VM_TRACE_LEVEL (set by vm_lib.cmake from
+ * VM_TRACE) and printed only with --trace. Levels above the build's are
+ * discarded at compile time, arguments included, so an `off` build carries
+ * no trace code at all. Arguments are only evaluated when the line prints,
+ * so format values in place rather than into strings up front. */
+#define VM_TRACE_OFF 0
+#define VM_TRACE_CALLS 1          // loading, translation, calls and returns
+#define VM_TRACE_INSTRUCTIONS 2   // every executed instruction
+#ifndef VM_TRACE_LEVEL
+#define VM_TRACE_LEVEL VM_TRACE_INSTRUCTIONS
+#endif
+#define TRACE_ENABLED(level) (VM_TRACE_LEVEL >= (level) && g_trace)
+#define TRACE_AT(level, ...) do { \
+  if constexpr (VM_TRACE_LEVEL >= (level)) { \
+    if (g_trace) fprintf(stderr, __VA_ARGS__); \
+  } \
+} while(0)
+#define TRACE(...) TRACE_AT(VM_TRACE_CALLS, __VA_ARGS__)
+#define TRACE_INSTR(...) TRACE_AT(VM_TRACE_INSTRUCTIONS, __VA_ARGS__)
+/* printf format and argument for the raw bits of a Slot */
+#define SLOT_FMT "0x%016llx"
+#define SLOT_ARG(s) static_cast<unsigned long long>((s).raw)
 #define ERR(...) fprintf(stderr, __VA_ARGS__)
 extern int g_trace;
 /***************/
 
 extern int g_time;
+/* Run the register-based tier instead of the stack interpreter */
+extern int g_regvm;
+/* Run functions as native code from the baseline compiler (VM_JIT builds) */
+extern int g_jit;
+/* Calls plus loop back-edges after which --jit compiles a function; 0
+ * compiles every function before running */
+#define VM_JIT_THRESHOLD 1000
+extern int g_jit_threshold;
+/* Run the module as C translated ahead of time and cached (VM_AOT builds) */
+extern int g_aot;
+/* Report the hit rate of every call_indirect inline cache after the run */
+extern int g_icache_stats;
+/* Keep validated and translated modules in the on-disk cache */
+extern int g_module_cache;
+/* Validate and translate each function on its first call */
+extern int g_lazy;
+/* BoundsCheck of new instances' memories (--bounds; see memory.h) */
+extern int g_bounds;
 
 /*** Parsing macros ***/
 #define RD_U32()        read_u32leb(&buf)
@@ -56,6 +115,7 @@ extern int g_time;
 #define RD_I64()        read_i64leb(&buf)
 #define RD_NAME()       read_name(&buf)
 #define RD_BYTESTR(len) read_bytes(&buf, len)
+#define RD_BYTESPAN(len) read_span(&buf, len)
 
 #define RD_BYTE()       read_u8(&buf)
 #define RD_U32_RAW()    read_u32(&buf)
@@ -93,36 +153,55 @@ extern int g_time;
 /********************/
 
 
-/*** List macros ***/
-#define GET_LIST_ELEM(ll, idx) ({ \
-  auto it = std::next(ll.begin(), idx); \
-  &(*it);  \
-})
-
-#define GET_LIST_IDX(ll, ptr) ({  \
-  auto it = ll.begin(); \
-  uint32_t i = 0; \
-  for (it = ll.begin(); it != ll.end(); ++it, ++i) {  \
-    if (&(*it) == ptr) { break; } \
-  } \
-  i;  \
-})
-
+/*** Index space macros ***/
 #define GET_DEQUE_ELEM(deq, idx) ({ &deq[idx]; })
-#define GET_DEQUE_IDX(deq, ptr) ({ \
-    auto res = std::find_if(deq.begin(), deq.end(), [ptr](auto &i) { return ptr == &i; });  \
-    std::distance(deq.begin(), res); \
-    })
 /********************/
 
 
-/* Load a file into memory; initialize start and end.
+/* Map a file read-only into memory; initialize start and end.
 * Returns < 0 on failure. */
 ssize_t load_file(const char* path, byte** start, byte** end);
 
 /* Unload a file previously loaded into memory using {load_file}. */
 ssize_t unload_file(byte** start, byte** end);
 
+/* Directory for files cached across runs: $WASM_VM_CACHE, else wasm-vm
+ * under the user's cache directory */
+std::string cache_directory();
+
+/* Create {path} and any missing parents; false on failure */
+bool make_directories(const std::string& path);
+
+/* Run {body}(0) .. {body}(count - 1) on up to g_threads threads, in no
+ * particular order. If any of them throw, the exception of the lowest index
+ * is rethrown once all are done, as a serial loop would have thrown it. */
+void parallel_for(size_t count, const std::function<void(size_t)>& body);
+
+/* Fast non-cryptographic 64-bit hash of {size} bytes, for cache keys */
+uint64_t hash_bytes(const byte* data, size_t size);
+
+/* A file loaded with {load_file}, unloaded when the last reference goes
+ * away. Parsed modules keep one and borrow their code, data and custom
+ * section bytes from it instead of copying them. */
+class MappedFile {
+public:
+  /* Null if {path} cannot be loaded */
+  static std::shared_ptr<const MappedFile> open(const char* path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const byte* start() const { return start_; }
+  const byte* end() const { return end_; }
+  size_t size() const { return end_ - start_; }
+
+private:
+  MappedFile() = default;
+
+  byte* start_ = nullptr;
+  byte* end_ = nullptr;
+};
+
 
 /*** Decode Operations ***/
 
@@ -157,4 +236,6 @@ uint64_t read_u64(buffer_t* buf);
 std::string read_name(buffer_t* buf);
 /* Read num_bytes, advancing the {ptr} in buffer */
 bytearr read_bytes(buffer_t* buf, uint32_t num_bytes);
+/* Same as {read_bytes}, but borrowing the bytes from the buffer */
+bytespan read_span(buffer_t* buf, uint32_t num_bytes);
 
@@ -0,0 +1,20 @@
+#pragma once
+
+/* Dispatch macros shared by the interpreter loops.
+ *
+ * With VM_THREADED_DISPATCH (set by vm_lib.cmake, GCC/Clang only) every
+ * handler jumps straight to the next one through a table of label addresses;
+ * otherwise handlers return to a single switch. A loop using these declares
+ * {pc} and {ins}, a `dispatch:` label in front of its switch, and in threaded
+ * mode a `dispatch_table` indexed by {ins->op}. */
+#ifndef VM_THREADED_DISPATCH
+#define VM_THREADED_DISPATCH 0
+#endif
+
+#if VM_THREADED_DISPATCH
+#define TARGET(op) L_##op
+#define DISPATCH() do { ins = pc++; goto *dispatch_table[ins->op]; } while (0)
+#else
+#define TARGET(op) case op
+#define DISPATCH() goto dispatch
+#endif
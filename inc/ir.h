@@ -40,7 +40,7 @@ struct FuncDecl;
 
 struct SubsecBytes {
   byte id;
-  bytearr bytes;
+  bytespan bytes;
 };
 struct DebugNameAssoc {
   FuncDecl* func;
@@ -56,8 +56,9 @@ struct DebugNameDecl {
 /* Section Field Declarations */
 struct CustomDecl {
   std::string name;
-  bytearr bytes;
-  /* Only populated for 'name' section */
+  /* Section payload after the name */
+  bytespan bytes;
+  /* Only populated for 'name' section, by WasmModule::decode_names */
   DebugNameDecl debug;
 };
 
@@ -80,28 +81,38 @@ struct SigDecl {
             sig.results.begin(), sig.results.end());
     return !(parameq && resulteq);
   }
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
 struct FuncDecl {
   /* From func/import section */
   SigDecl* sig;
+  /* Canonical ID of {sig}; see WasmModule::getSigId */
+  uint32_t sig_id;
   /* From code section */
   wasm_localcsv_t pure_locals;
   uint32_t num_pure_locals;
   /* Code */ 
-  bytearr code_bytes;
+  bytespan code_bytes;
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
 struct MemoryDecl {
   wasm_limits_t limits;
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
 struct TableDecl {
   wasm_type_t reftype;
   wasm_limits_t limits;
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
@@ -109,6 +120,8 @@ struct GlobalDecl {
   wasm_type_t type;
   unsigned is_mutable : 1;
   Value init_value;
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
@@ -117,7 +130,9 @@ struct DataDecl {
   Opcode_t opcode_offset;
   uint32_t mem_offset;
   MemoryDecl *mem;
-  bytearr bytes;
+  bytespan bytes;
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
@@ -145,6 +160,8 @@ struct ImportDecl {
   std::string member_name;
   wasm_kind_t kind;
   Descriptor desc;
+  /* Position in its index space */
+  uint32_t index;
 };
 
 
@@ -156,7 +173,7 @@ struct ExportDecl {
 
 
 struct ImportSet {
-  std::list <ImportDecl> list;
+  std::deque <ImportDecl> list;
   uint32_t num_funcs;
   uint32_t num_tables;
   uint32_t num_mems;
@@ -168,27 +185,35 @@ struct ImportSet {
 };
 
 
-/* Section */
+/* Section
+ *
+ * Index spaces are deques: appending never moves an element, so pointers to
+ * declarations are stable handles while the module is decoded, and each
+ * declaration records its own index. Both directions of the index <->
+ * pointer mapping are O(1). */
 class WasmModule {
 
   private:
     uint32_t magic;
     uint32_t version;
 
-    std::list <CustomDecl>  customs;
-    std::list <SigDecl>     sigs;
+    std::deque <CustomDecl> customs;
+    std::deque <SigDecl>    sigs;
+    /* Canonical ID of each type index: structurally equal signatures
+     * share one, so signature checks are an integer compare */
+    std::vector <uint32_t>  sig_ids;
     ImportSet               imports;
     /* Func space */
     std::deque <FuncDecl>    funcs;
     /* Table space */
-    std::list <TableDecl>   tables;
+    std::deque <TableDecl>  tables;
     /* Mem space */
-    std::list <MemoryDecl>  mems;
+    std::deque <MemoryDecl> mems;
     /* Global space */
     std::deque <GlobalDecl>  globals;
-    std::list <ExportDecl>  exports;
-    std::list <ElemDecl>    elems;
-    std::list <DataDecl>    datas;
+    std::deque <ExportDecl> exports;
+    std::deque <ElemDecl>   elems;
+    std::deque <DataDecl>   datas;
 
     /* Start section */
     FuncDecl* start_fn;
@@ -201,6 +226,9 @@ class WasmModule {
     /* Custom name section debug reference */
     std::list <DebugNameAssoc> *fn_names_debug;
 
+    /* The file the module was parsed from; every bytespan points into it */
+    std::shared_ptr<const MappedFile> source;
+
     /* Decode functions */
     #define DECODE_DECL(sec,...)  \
       void decode_##sec##_section (buffer_t &buf, uint32_t len);
@@ -217,10 +245,21 @@ class WasmModule {
     DECODE_DECL(data);
     DECODE_DECL(datacount);
     DECODE_DECL(custom);
+    /* Decode the locals of {func}, whose code_bytes span its whole entry
+     * in the code section, and leave code_bytes at the instructions */
+    void decode_body (FuncDecl &func);
+
+    /* Append {decl} to {space}, recording its index; returns its handle */
+    template<typename T>
+    static T* append(std::deque<T> &space, T decl) {
+      decl.index = static_cast<uint32_t>(space.size());
+      space.push_back(std::move(decl));
+      return &space.back();
+    }
 
     /* Descriptor patching for copy/assign */
     template<typename T>
-    void DescriptorPatch (std::list<T> &list, const WasmModule &mod, std::unordered_map<void*, void*> &reassign_cache);
+    void DescriptorPatch (std::deque<T> &list, const WasmModule &mod, std::unordered_map<void*, void*> &reassign_cache);
     /* Function patching for copy/assign */
     void FunctionPatch (const WasmModule &mod, std::unordered_map<void*, void*> &reassign_cache);
     /* Custom section patching for copy/assign */
@@ -232,22 +271,30 @@ class WasmModule {
   public:
     WasmModule () = default;
     WasmModule (const WasmModule &mod);
+    /* Moving keeps every declaration where it is, so nothing is patched */
+    WasmModule (WasmModule &&mod) = default;
     ~WasmModule() = default;
 
     WasmModule& operator=(const WasmModule &mod);
+    WasmModule& operator=(WasmModule &&mod) = default;
 
     /* Field Accessors */
-    inline SigDecl* getSig(uint32_t idx)        { return GET_LIST_ELEM(this->sigs, idx); }
+    inline SigDecl* getSig(uint32_t idx)        { return GET_DEQUE_ELEM(this->sigs, idx); }
     inline FuncDecl* getFunc(uint32_t idx)      { return GET_DEQUE_ELEM(this->funcs, idx); }
     inline GlobalDecl* getGlobal(uint32_t idx)  { return GET_DEQUE_ELEM(this->globals, idx); }
-    inline TableDecl* getTable(uint32_t idx)    { return GET_LIST_ELEM(this->tables, idx); }
-    inline MemoryDecl* getMemory(uint32_t idx)  { return GET_LIST_ELEM(this->mems, idx); }
-    inline DataDecl* getData(uint32_t idx)      { return GET_LIST_ELEM(this->datas, idx); }
-    inline ImportDecl* getImport(uint32_t idx)  { return GET_LIST_ELEM(this->imports.list, idx); }
+    inline TableDecl* getTable(uint32_t idx)    { return GET_DEQUE_ELEM(this->tables, idx); }
+    inline MemoryDecl* getMemory(uint32_t idx)  { return GET_DEQUE_ELEM(this->mems, idx); }
+    inline DataDecl* getData(uint32_t idx)      { return GET_DEQUE_ELEM(this->datas, idx); }
+    inline ImportDecl* getImport(uint32_t idx)  { return GET_DEQUE_ELEM(this->imports.list, idx); }
     
     /* Const versions */
-    inline const TableDecl* getTable(uint32_t idx) const    { return GET_LIST_ELEM(this->tables, idx); }
-    inline const MemoryDecl* getMemory(uint32_t idx) const  { return GET_LIST_ELEM(this->mems, idx); }
+    inline const SigDecl* getSig(uint32_t idx) const        { return GET_DEQUE_ELEM(this->sigs, idx); }
+    inline const FuncDecl* getFunc(uint32_t idx) const      { return GET_DEQUE_ELEM(this->funcs, idx); }
+    inline const GlobalDecl* getGlobal(uint32_t idx) const  { return GET_DEQUE_ELEM(this->globals, idx); }
+    inline const TableDecl* getTable(uint32_t idx) const    { return GET_DEQUE_ELEM(this->tables, idx); }
+    inline const MemoryDecl* getMemory(uint32_t idx) const  { return GET_DEQUE_ELEM(this->mems, idx); }
+    inline uint32_t getSigId(uint32_t idx) const  { return this->sig_ids[idx]; }
+    inline uint32_t get_num_sigs() const        { return static_cast<uint32_t>(this->sigs.size()); }
     inline uint32_t get_num_mems() const        { return static_cast<uint32_t>(this->mems.size()); }
     inline uint32_t get_num_imported_mems() const { return this->imports.num_mems; }
     inline uint32_t get_num_tables() const      { return static_cast<uint32_t>(this->tables.size()); }
@@ -256,35 +303,45 @@ class WasmModule {
     inline uint32_t get_num_imported_globals() const { return this->imports.num_globals; }
 
     /* Index Accessors */
-    inline uint32_t getSigIdx(SigDecl *sig)           const { return GET_LIST_IDX(this->sigs, sig); }
-    inline uint32_t getFuncIdx(FuncDecl *func)        const { return GET_DEQUE_IDX(this->funcs, func); }
-    inline uint32_t getGlobalIdx(GlobalDecl *global)  const { return GET_DEQUE_IDX(this->globals, global); }
-    inline uint32_t getTableIdx(TableDecl *table)     const { return GET_LIST_IDX(this->tables, table); }
-    inline uint32_t getMemoryIdx(MemoryDecl *mem)     const { return GET_LIST_IDX(this->mems, mem); }
-    inline uint32_t getDataIdx(DataDecl *data)        const { return GET_LIST_IDX(this->datas, data); }
-    inline uint32_t getImportIdx(ImportDecl *import)  const { return GET_LIST_IDX(this->imports.list, import); }
+    inline uint32_t getSigIdx(const SigDecl *sig)           const { return sig->index; }
+    inline uint32_t getFuncIdx(const FuncDecl *func)        const { return func->index; }
+    inline uint32_t getGlobalIdx(const GlobalDecl *global)  const { return global->index; }
+    inline uint32_t getTableIdx(const TableDecl *table)     const { return table->index; }
+    inline uint32_t getMemoryIdx(const MemoryDecl *mem)     const { return mem->index; }
+    inline uint32_t getDataIdx(const DataDecl *data)        const { return data->index; }
+    inline uint32_t getImportIdx(const ImportDecl *import)  const { return import->index; }
 
     /* Import accessors */
-    inline bool isImport(FuncDecl *func)      { return getFuncIdx(func)     < this->imports.num_funcs; }
-    inline bool isImport(GlobalDecl *global)  { return getGlobalIdx(global) < this->imports.num_globals; }
-    inline bool isImport(TableDecl *table)    { return getTableIdx(table)   < this->imports.num_tables; }
-    inline bool isImport(MemoryDecl *mem)     { return getMemoryIdx(mem)    < this->imports.num_mems; }
+    inline bool isImport(const FuncDecl *func)      const { return getFuncIdx(func)     < this->imports.num_funcs; }
+    inline bool isImport(const GlobalDecl *global)  const { return getGlobalIdx(global) < this->imports.num_globals; }
+    inline bool isImport(const TableDecl *table)    const { return getTableIdx(table)   < this->imports.num_tables; }
+    inline bool isImport(const MemoryDecl *mem)     const { return getMemoryIdx(mem)    < this->imports.num_mems; }
 
     /* Section Accessors */
     inline std::deque <FuncDecl> &Funcs() { return this->funcs; }
     inline std::deque <GlobalDecl> &Globals() { return this->globals; }
-    inline std::list  <ExportDecl> &Exports() { return this->exports; }
-    inline std::list  <ElemDecl> &Elems() { return this->elems; }
-    inline std::list  <DataDecl> &Datas() { return this->datas; }
+    inline std::deque <ExportDecl> &Exports() { return this->exports; }
+    inline std::deque <ElemDecl> &Elems() { return this->elems; }
+    inline std::deque <DataDecl> &Datas() { return this->datas; }
     
     /* Const Section Accessors */
+    inline const std::deque <FuncDecl> &Funcs() const { return this->funcs; }
     inline const std::deque <GlobalDecl> &Globals() const { return this->globals; }
-    inline const std::list  <ExportDecl> &Exports() const { return this->exports; }
+    inline const std::deque <ExportDecl> &Exports() const { return this->exports; }
+    inline const std::deque <ElemDecl> &Elems() const { return this->elems; }
+    inline const std::deque <DataDecl> &Datas() const { return this->datas; }
 
     inline FuncDecl* get_start_fn() { return this->start_fn; }
     inline uint32_t get_num_customs() { return this->customs.size(); }
 
     /* Decode wasm file from buffer */
     void decode_buffer (buffer_t &buf);
+    /* Keep {file} mapped for as long as the module borrows from it */
+    inline void retain_source(std::shared_ptr<const MappedFile> file) { this->source = std::move(file); }
+    inline const MappedFile* get_source() const { return this->source.get(); }
+
+    /* Decode the function names of the 'name' section, which parsing only
+     * records; returns null if there is none */
+    std::list <DebugNameAssoc>* decode_names ();
 
 };
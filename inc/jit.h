@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+/* Set by the build (VM_JIT and VM_AOT options) where the compilers are
+ * available; either one runs functions through native entry points */
+#ifndef VM_JIT
+#define VM_JIT 0
+#endif
+#ifndef VM_AOT
+#define VM_AOT 0
+#endif
+#define VM_NATIVE (VM_JIT || VM_AOT)
+
+class WasmVM;
+struct FuncInst;
+struct NativeRuntime;
+
+/* Runtime ABI between native code and the VM (see src/jit.cpp and
+ * src/aot.cpp). Compiled code keeps a pointer to it in a callee-saved
+ * register and reads the fields at fixed offsets, and --aot modules mirror
+ * it in C, so it must stay standard-layout. */
+struct JitContext {
+  WasmVM* vm;
+  byte* mem;
+  uint64_t mem_bound;     // LinearMemory::bound()
+  Slot* globals;
+  Slot* stack_end;        // one past the last slot of the value stack
+  uint32_t depth;         // frames entered by either tier, against VM_MAX_CALL_DEPTH
+  const NativeRuntime* rt;
+};
+
+/* Entry point of a function: its compiled code, or a helper that runs it in
+ * the interpreter. {frame} holds the params followed by room for the
+ * declared locals, laid out like a stack-tier frame; the results are left
+ * at frame[0..]. Returns a Trap code, 0 if the call completed. */
+typedef uint32_t (*JitFn)(JitContext* ctx, Slot* frame, FuncInst* f);
+
+/* Calls into the VM for native code that has no addresses built in: --aot
+ * modules are cached across runs. Each returns a Trap code like a JitFn. */
+struct NativeRuntime {
+  uint32_t (*trap)(JitContext* ctx, uint32_t trap, const char* detail);
+  /* Call function {func_index} of the module through its entry */
+  uint32_t (*call)(JitContext* ctx, Slot* args, uint32_t func_index);
+  /* call_indirect site {site} of function {func_index}, through its
+   * inline cache */
+  uint32_t (*call_indirect)(JitContext* ctx, Slot* args, uint32_t func_index,
+                            uint32_t site, int32_t elem_index);
+};
+
+/* A loop header where an interpreted frame of the function can continue in
+ * compiled code. The entry takes the interpreter's frame as it is at the
+ * header, with the operands in their slots, and runs the function to its
+ * end, so it is called exactly like the function's own entry. */
+struct OsrEntry {
+  uint32_t pc;            // index of the header in FuncInst::code
+  JitFn fn;
+};
+
+/* Executable memory for compiled code. Each install() maps a new region,
+ * which stays until the ExecMemory goes away. */
+class ExecMemory {
+public:
+  ExecMemory() = default;
+  ~ExecMemory();
+  ExecMemory(const ExecMemory&) = delete;
+  ExecMemory& operator=(const ExecMemory&) = delete;
+
+  /* Copy {size} bytes of code into a new read-execute mapping */
+  byte* install(const byte* code, size_t size);
+
+private:
+  std::vector<std::pair<byte*, size_t>> regions_;
+};
+
+/* A dlopen()ed shared object, closed when it goes away */
+class SharedLibrary {
+public:
+  SharedLibrary() = default;
+  ~SharedLibrary();
+  SharedLibrary(const SharedLibrary&) = delete;
+  SharedLibrary& operator=(const SharedLibrary&) = delete;
+
+  /* Replace any open library with {path}; false with {error} set if it
+   * cannot be loaded */
+  bool open(const std::string& path, std::string& error);
+  /* Close the open library, if any; its symbols are gone */
+  void close();
+  void* symbol(const char* name) const;
+
+private:
+  void* handle_ = nullptr;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include "common.h"
+
+/* How loads and stores keep inside the linear memory (--bounds). Each
+ * WasmVM picks one for its memory, and every tier compiles its accesses
+ * for that one:
+ *   Explicit    compare every access against the size and trap
+ *   GuardPages  reserve the whole 33-bit range an i32 address plus offset
+ *               can reach, with only the memory itself accessible; an
+ *               out-of-bounds access faults and the fault becomes a trap
+ *   Mask        and every address with a power-of-two mask covering the
+ *               memory. Accesses never leave the reservation but are not
+ *               checked against the size: out-of-bounds ones wrap or reach
+ *               the slack past the end instead of trapping */
+enum class BoundsCheck : uint8_t {
+  Explicit,
+  GuardPages,
+  Mask,
+};
+
+const char* bounds_check_name(BoundsCheck bounds);
+/* False if {name} names no strategy */
+bool parse_bounds_check(const char* name, BoundsCheck& bounds);
+
+/* Linear memory of one instance, mapped with mmap so that it can be laid
+ * out for its BoundsCheck. Its contents start at data() and never move
+ * while a function runs. */
+class LinearMemory {
+public:
+  /* Falls back to explicit checks if the guard reservation cannot be made */
+  explicit LinearMemory(BoundsCheck bounds);
+  ~LinearMemory();
+  LinearMemory(const LinearMemory&) = delete;
+  LinearMemory& operator=(const LinearMemory&) = delete;
+
+  /* Replace the contents with {pages} zeroed pages */
+  void reset(uint32_t pages);
+
+  byte* data() const { return base_; }
+  uint64_t size() const { return size_; }
+  BoundsCheck strategy() const { return strategy_; }
+  /* What accesses are checked against: the size with explicit checks, the
+   * address mask when masking, unused with guard pages */
+  uint64_t bound() const { return strategy_ == BoundsCheck::Mask ? mask_ : size_; }
+  /* Whether {addr} is in the range reserved for the memory */
+  bool reserves(const void* addr) const {
+    return addr >= base_ && addr < base_ + mapped_;
+  }
+
+private:
+  void unmap();
+
+  BoundsCheck strategy_;
+  byte* base_ = nullptr;
+  uint64_t size_ = 0;
+  uint64_t mapped_ = 0;
+  uint64_t mask_ = 0;
+};
+
+/* Address of the {size}-byte access at {effective_addr} in the memory at
+ * {mem}, as the interpreters make it under {B}: null if explicit checks
+ * find it out of bounds of {bound} (LinearMemory::bound). Guard pages leave
+ * the check to the fault, and masking keeps the address in the reservation */
+template <BoundsCheck B>
+inline byte* linear_address(byte* mem, uint64_t bound, uint64_t effective_addr, uint32_t size) {
+  if constexpr (B == BoundsCheck::Explicit) {
+    return effective_addr + size > bound ? nullptr : mem + effective_addr;
+  } else if constexpr (B == BoundsCheck::GuardPages) {
+    return mem + effective_addr;
+  } else {
+    return mem + (effective_addr & bound);
+  }
+}
+
+/* Run {body} on this thread, turning a fault on an address that {memory}
+ * reserves into a false return; true if {body} completed. Only guard pages
+ * need it, and for other memories {body} simply runs. The thread is given
+ * an alternate signal stack for the fault handler if it has none. A fault
+ * leaves every frame {body} entered with siglongjmp, so none of them may
+ * own anything that needs destroying: that holds for the interpreter loops
+ * and for native code. */
+bool run_guarded(const LinearMemory& memory, const std::function<void()>& body);
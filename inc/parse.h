@@ -3,4 +3,8 @@
 #include "common.h"
 #include "ir.h"
 
+/* Parse the module in [start, end). Code, data and custom section bytes are
+ * borrowed, so the range must outlive the module; see parse_file */
 WasmModule parse_bytecode(const byte* start, const byte* end);
+/* Parse {file}; the module keeps it mapped */
+WasmModule parse_file(std::shared_ptr<const MappedFile> file);
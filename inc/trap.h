@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+/* Reasons a running function traps. The interpreter loops stop and return
+ * one of these instead of throwing, so a trap costs no unwinding and no
+ * allocation; its message is only put together when it is reported. */
+enum class Trap : uint8_t {
+  None,
+  Unreachable,
+  MemoryOutOfBounds,
+  TableOutOfBounds,       // call_indirect past the end of its table
+  NullTableEntry,         // call_indirect of an uninitialised element
+  SignatureMismatch,      // call_indirect of a function of another type
+  StackOverflow,          // the value stack cannot hold the callee's frame
+  CallStackExhausted,     // VM_MAX_CALL_DEPTH reached
+  UnsupportedOpcode,      // detail: the mnemonic
+  Unsupported,            // a construct the interpreter does not implement
+  FunctionError,          // the callee could not be prepared; detail: why
+  CheckFailed,            // VM_CHECKED builds: an invariant did not hold
+};
+
+inline const char* trap_string(Trap trap) {
+  switch (trap) {
+    case Trap::None: return "no trap";
+    case Trap::Unreachable: return "unreachable executed";
+    case Trap::MemoryOutOfBounds: return "out of bounds memory access";
+    case Trap::TableOutOfBounds: return "undefined table element";
+    case Trap::NullTableEntry: return "uninitialized table element";
+    case Trap::SignatureMismatch: return "indirect call signature mismatch";
+    case Trap::StackOverflow: return "operand stack overflow";
+    case Trap::CallStackExhausted: return "call stack exhausted";
+    case Trap::UnsupportedOpcode: return "unsupported opcode";
+    case Trap::Unsupported: return "unsupported";
+    case Trap::FunctionError: return "function cannot be called";
+    case Trap::CheckFailed: return "runtime check failed";
+  }
+  return "unknown trap";
+}
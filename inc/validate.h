@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include "common.h"
+#include "ir.h"
+
+/* A function body that breaks the validation rules of the spec; the module
+ * must be rejected before anything runs */
+class ValidationError : public std::runtime_error {
+public:
+  explicit ValidationError(const std::string& what) : std::runtime_error(what) {}
+};
+
+/* Type-check the body of {f} with an operand type stack and typed labels.
+ * Returns the maximum operand stack height the body can reach. Throws
+ * ValidationError if the body is invalid or malformed, and
+ * std::runtime_error if it uses a valid instruction the VM does not run. */
+uint32_t validate_function(const WasmModule& module, const FuncDecl* f);
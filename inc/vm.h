@@ -2,11 +2,17 @@
 
 #include "common.h"
 #include "ir.h"
+#include "trap.h"
+#include "jit.h"
+#include "memory.h"
 
 #include <cstdint>
 #include <stdexcept>
+#include <type_traits>
 #include <variant>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
 /* Create a Value from a string and type */
@@ -25,87 +31,494 @@ inline Value make_from(const std::string &s, wasm_type_t type) {
   }
 }
 
-// Runtime structures
+/* Convert a tagged Value into an untagged Slot */
+inline Slot to_slot(const Value& v) {
+  Slot s{};
+  std::visit([&s](auto&& arg) {
+    using T = std::decay_t<decltype(arg)>;
+    if constexpr (std::is_same_v<T, std::int32_t>) s.i32 = arg;
+    else if constexpr (std::is_same_v<T, std::int64_t>) s.i64 = arg;
+    else if constexpr (std::is_same_v<T, float>) s.f32 = arg;
+    else s.f64 = arg;
+  }, v);
+  return s;
+}
+
+/* Re-tag a Slot whose static type is {type} */
+inline Value from_slot(Slot s, wasm_type_t type) {
+  switch (type) {
+    case WASM_TYPE_I32:
+      return s.i32;
+    case WASM_TYPE_I64:
+      return s.i64;
+    case WASM_TYPE_F32:
+      return s.f32;
+    case WASM_TYPE_F64:
+      return s.f64;
+    default:
+      throw std::runtime_error("Unsupported type for from_slot");
+  }
+}
+
+/* Kind of a structured control construct; the function body is the
+ * implicit outermost one */
 struct Label {
   enum Kind { Implicit, Block, Loop, If } kind;
-  const byte* pc_target;  // Loop: begin; Block/If: after end 
-  const byte* pc_else;    // Only for If，otherwise nullptr
-  size_t stack_height;    // operand stack height at entry
 };
 
+/* Static shape of one block/loop/if; all positions are byte offsets into
+ * the function's code_bytes */
 struct CtrlMeta {
   Label::Kind kind;
-  // const byte* begin;   // address of the first instruction inside the block/loop/if
-  const byte* else_pc; // only for if, else nullptr
-  const byte* end;     // address of next instruction after end
+  uint32_t header;     // offset of the block/loop/if opcode
+  uint32_t else_pc;    // only for if: first opcode of the else arm, 0 if none
+  uint32_t end;        // offset of the matching end opcode
+};
+
+/* Control side table of a function, built once at instantiation. Entries are
+ * in order of their headers, so the n-th block/loop/if met while walking the
+ * body is entry n: lookups are a cursor bump instead of a hash probe */
+typedef std::vector<CtrlMeta> CtrlTable;
+
+/* Pre-decoded instruction executed by WasmVM::execute.
+ * Every instruction is the same width; immediates are decoded once at
+ * translation time and branch targets are absolute indices into the
+ * owning FuncCode::code.
+ *
+ *   local.* / global.*        a = index
+ *   call, return_call         a = function index
+ *   call_indirect,            a = type index, imm.call.table = table index,
+ *   return_call_indirect      imm.call.site = the site's index in
+ *                             FuncCode::sites and FuncInst::icaches
+ *   loads / stores            a = offset,     imm.b = align
+ *   if                        a = first instr of the else arm (or the end)
+ *   else                      a = matching end
+ *   br / br_if                a = label depth, imm.br.target = branch target,
+ *                             imm.br.height = operand stack height of the
+ *                             target label, relative to the frame
+ *   *.const                   imm.{i32,i64,f32,f64}
+ */
+struct Instr {
+  Opcode_t op;
+  uint32_t a;
+  union {
+    int32_t i32;
+    int64_t i64;
+    float f32;
+    double f64;
+    uint32_t b;
+    struct {
+      uint32_t target;
+      uint32_t height;
+    } br;
+    struct {
+      uint32_t table;
+      uint32_t site;
+    } call;
+  } imm;
+};
+
+/* Internal opcodes of translated code, above the single-byte wasm range so
+ * that every Instr::op indexes a dense dispatch table */
+enum : Opcode_t {
+  VM_OP_UNSUPPORTED = 0x100,  // a = original (multi-byte) opcode; traps
+  VM_OP_RETURN_IF,            // br_if to the function label
+  /* Superinstructions formed by fuse_superinstructions() */
+  VM_OP_LOCAL_GET2_I32_ADD,       // local.get a; local.get imm.b; i32.add
+  VM_OP_LOCAL_GET_I32_CONST_ADD,  // local.get a; i32.const imm.i32; i32.add
+  VM_OP_LOCAL_GET_I32_LOAD,       // local.get a; i32.load offset=imm.b
+  VM_OP_I32_LT_S_BR_IF,           // i32.lt_s; br_if (operands as br_if)
+  VM_OP_I32_EQZ_BR_IF,            // i32.eqz; br_if (operands as br_if)
+  VM_OP_COUNT
+};
+
+/* Register-tier instruction set (see src/regvm.cpp). Registers are slots of
+ * the frame's register file: the function's locals first, then one register
+ * per static operand stack height. `_I` forms take their right operand from
+ * imm instead of a register. The one list gives both the enum and the
+ * interpreter's dispatch table. */
+#define VM_REG_OPS(X) \
+  X(R_UNREACHABLE) \
+  X(R_UNSUPPORTED)          /* a = original opcode; traps */ \
+  X(R_MOV)                  /* d <- a */ \
+  X(R_CONST)                /* d <- imm.raw */ \
+  X(R_JMP)                  /* pc <- imm.target */ \
+  X(R_BR_IF)                /* if a != 0: pc <- imm.target */ \
+  X(R_BR_UNLESS)            /* if a == 0: pc <- imm.target */ \
+  X(R_RET)                  /* results are a .. a + arity - 1 */ \
+  X(R_CALL)                 /* a = function index; arguments start at d */ \
+  X(R_CALL_INDIRECT)        /* a = inline cache, imm.reg = element index; args at d */ \
+  X(R_RETURN_CALL)          /* as R_CALL, replacing the current frame */ \
+  X(R_RETURN_CALL_INDIRECT) /* as R_CALL_INDIRECT, replacing the current frame */ \
+  X(R_SELECT)               /* d <- imm.reg ? a : b */ \
+  X(R_GLOBAL_GET)           /* d <- global[a] */ \
+  X(R_GLOBAL_SET)           /* global[b] <- a */ \
+  X(R_I32_LOAD)             /* d <- mem[a + imm.u32] */ \
+  X(R_I32_STORE)            /* mem[a + imm.u32] <- b */ \
+  X(R_I32_EQZ) \
+  X(R_I32_EQ) \
+  X(R_I32_EQ_I) \
+  X(R_I32_LT_S) \
+  X(R_I32_LT_S_I) \
+  X(R_I32_ADD) \
+  X(R_I32_ADD_I) \
+  X(R_I32_SUB) \
+  X(R_I32_SUB_I) \
+  X(R_F64_ADD)
+
+enum RegOp : Opcode_t {
+#define REG_OP_ENUM(op) op,
+  VM_REG_OPS(REG_OP_ENUM)
+#undef REG_OP_ENUM
+  R_OP_COUNT
+};
+
+/* Three-address instruction of the register tier; branch targets are
+ * indices into the owning FuncCode::rcode */
+struct RegInstr {
+  Opcode_t op;
+  uint32_t d;
+  uint32_t a;
+  uint32_t b;
+  union {
+    int32_t i32;
+    uint32_t u32;
+    uint64_t raw;
+    uint32_t target;
+    uint32_t reg;
+  } imm;
+};
+
+/* Value stack capacity in slots, and maximum call depth */
+#define VM_STACK_SLOTS (1u << 20)
+#define VM_MAX_CALL_DEPTH 100000
+/* Machine stack for native code, which takes a frame per wasm call */
+#define VM_NATIVE_STACK_SIZE (256u << 20)
+
+/* Targets remembered by one call_indirect inline cache */
+#define VM_ICACHE_WAYS 4
+
+/* Inline cache of a call_indirect or return_call_indirect site: the table
+ * slots it last resolved and the functions they held, which passed every
+ * check the site makes. The entries are only valid for the table epoch they
+ * were filled in; writing a table slot starts a new one. A site that uses
+ * one way is monomorphic; one that keeps missing once all ways are in use
+ * is megamorphic. */
+struct IndirectCache {
+  uint32_t type_index;
+  uint32_t table_index;
+  uint64_t epoch = 0;
+  uint32_t used = 0;
+  uint32_t next = 0;      // way replaced on the next miss once all are used
+  uint32_t slots[VM_ICACHE_WAYS];
+  FuncInst* targets[VM_ICACHE_WAYS];
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+/* Static operands of a call_indirect or return_call_indirect */
+struct IndirectSite {
+  uint32_t type_index;
+  uint32_t table_index;
+};
+
+/* A function of the module with its validated and translated body. Part of
+ * a CompiledModule, so it never changes once built */
+struct FuncCode {
+  const FuncDecl* decl;
+  CtrlTable ctrl;
+  std::vector<Instr> code;
+  /* Signature shape: {nlocals} counts the params and the declared locals */
+  uint32_t nparams = 0;
+  uint32_t nlocals = 0;
+  uint32_t nresults = 0;
+  /* Maximum operand stack height, from validation */
+  uint32_t max_stack = 0;
+  /* Register-tier body, only built under --regvm; {nregs} is the size of
+   * its register file (locals + maximum operand stack height) */
+  std::vector<RegInstr> rcode;
+  uint32_t nregs = 0;
+  /* One per call_indirect/return_call_indirect, numbered by translation */
+  std::vector<IndirectSite> sites;
+  /* Set when the body could not be translated; calling it traps */
+  std::string error;
+};
+
+/* A function in one WasmVM: its shared body plus the state the instance
+ * keeps for it. What calls need from the body is copied in, so entering a
+ * function reads nothing but its FuncInst. */
+struct FuncInst {
+  const FuncCode* body;
+  const FuncDecl* decl;
+  const Instr* code = nullptr;
+  const RegInstr* rcode = nullptr;
+  uint32_t nparams = 0;
+  uint32_t nlocals = 0;
+  uint32_t nresults = 0;
+  uint32_t max_stack = 0;
+  uint32_t nregs = 0;
+  /* FuncCode::error, or null if the function can run. Under --lazy it is
+   * WasmVM::kUnprepared until the first call prepares the function, so the
+   * check every call already makes is the stub */
+  const char* error = nullptr;
+  /* How calls enter the function in VM_JIT builds: its compiled code, or
+   * WasmVM::jit_interp_entry while it is interpreted; see JitFn */
+  JitFn entry = nullptr;
+  std::vector<OsrEntry> osr_entries;
+  /* One per FuncCode::sites */
+  std::vector<IndirectCache> icaches;
+  /* Calls and loop back-edges counted while interpreted; reaching the
+   * VM's tier-up threshold compiles the function */
+  uint32_t hotness = 0;
+};
+
+/* What a CompiledModule is prepared for, fixed when it is compiled: the
+ * tier its bodies are translated for (the register tier or the stack tier,
+ * which the native tiers also start from), whether bodies wait for their
+ * first call, and whether the on-disk cache is used. The defaults are the
+ * command line's. */
+struct CompileOptions {
+  bool regvm = g_regvm != 0;
+  bool lazy = g_lazy != 0;
+  bool module_cache = g_module_cache != 0;
+};
+
+/* A parsed module after validation and translation. It is immutable, so any
+ * number of WasmVMs can run it at once and share it through a shared_ptr;
+ * instantiating one only builds the instance's own state.
+ *
+ * Under --lazy, function bodies are left out until prepare() is first
+ * called for them, which is safe from any number of threads. Nothing
+ * prepared ever changes again, and bodies are only invalid for the calls
+ * that reach them rather than for the whole module. */
+class CompiledModule {
+public:
+  /* Validate and translate {module}, which is moved in rather than copied */
+  static std::shared_ptr<const CompiledModule> compile(WasmModule module,
+                                                       CompileOptions options = CompileOptions());
+
+  const WasmModule& module() const { return module_; }
+  /* Whether the bodies are register code rather than stack code; every
+   * WasmVM runs the module on the tier it was compiled for */
+  bool regvm() const { return options_.regvm; }
+  /* Only the shape of each function until it is prepared; see lazy() */
+  const std::vector<FuncCode>& funcs() const { return funcs_; }
+  /* Whether bodies still have to go through prepare() */
+  bool lazy() const { return lazy_; }
+  /* Function {index}, validated and translated */
+  const FuncCode& prepare(uint32_t index) const;
+  /* The exported "main", or null */
+  const FuncDecl* main() const { return main_; }
+  /* Why the module was rejected, empty if it is valid */
+  const std::string& invalid() const { return invalid_; }
+  uint32_t initial_memory_pages() const { return initial_memory_pages_; }
+  /* Initial sizes of the tables the module defines, after the imported ones */
+  const std::vector<uint32_t>& local_table_sizes() const { return local_table_sizes_; }
+
+  CtrlTable pre_indexing(const FuncDecl* f) const;
+
+private:
+  CompiledModule(WasmModule&& module, const CompileOptions& options);
+
+  void cache_layout();
+  void prepare_functions();
+  /* Validate and translate {fc}; returns why it is invalid, or an empty
+   * string */
+  std::string prepare_function(FuncCode& fc) const;
+  static void skip_immediate(Opcode_t opcode, buffer_t &buf);
+  void translate_function(FuncCode& fc) const;
+  void lower_structured_control(FuncCode& fc) const;
+  void fuse_superinstructions(FuncCode& fc) const;
+  void translate_function_reg(FuncCode& fc) const;
+
+  /* On-disk cache of funcs_ and invalid_ (--module-cache, src/cache.cpp),
+   * keyed by {hash}, the hash_bytes() of the module file */
+  std::string cache_path(uint64_t hash) const;
+  bool load_cache(const std::string& path, uint64_t hash);
+  void store_cache(const std::string& path, uint64_t hash) const;
+
+  WasmModule module_;
+  const CompileOptions options_;
+  /* Mutable for prepare() alone, which fills each body once under --lazy */
+  mutable std::vector<FuncCode> funcs_;
+  const FuncDecl* main_ = nullptr;
+  std::string invalid_;
+  uint32_t initial_memory_pages_ = 0;
+  std::vector<uint32_t> local_table_sizes_;
+  bool lazy_ = false;
+  /* One per function under --lazy, guarding its preparation */
+  std::unique_ptr<std::once_flag[]> prepared_;
 };
 
+/* A funcref table slot. It carries its function's canonical signature ID
+ * so that call_indirect checks the type without touching the function */
+struct TableEntry {
+  FuncInst* func;
+  uint32_t sig_id;
+};
 
-struct Frame {
-  FuncDecl* func;
-  buffer_t pc;
-  std::vector<Value> locals;
-  std::vector<Label> labels;
-  std::unordered_map<const byte*, CtrlMeta> ctrl_map;
-  // to restore on return
-  size_t stack_height_on_entry;
+/* Stack-tier frames live in the value stack itself:
+ *
+ *   [ params | declared locals | FrameHeader | operands ... ]
+ *
+ * The params are the arguments the caller left on top of its operands, so a
+ * call copies nothing; on return the results are moved down to where the
+ * params started. The header is a fixed-size record, and the operand stack
+ * of the frame starts right after it. */
+struct FrameHeader {
+  FuncInst* func;
+  const Instr* ret_pc;    // where the caller resumes; null for the entry frame
+  FrameHeader* caller;
+  Slot spill;             // top-of-stack cache spill slot of an empty frame
+};
+static_assert(sizeof(FrameHeader) % sizeof(Slot) == 0, "FrameHeader must be slot-aligned");
+#define VM_FRAME_SLOTS (sizeof(FrameHeader) / sizeof(Slot))
+
+/* Register-tier frame; {regs} points into the operand stack, and the
+ * callee's register file starts at the caller's first argument register */
+struct RegFrame {
+  FuncInst* func;
+  const RegInstr* pc;
+  Slot* regs;
 };
 
 class WasmVM {
 public:
-  WasmVM(const WasmModule& module);
+  /* An instance of {compiled}: memory, tables, globals and stacks of its
+   * own, everything else shared. {bounds} lays out its memory */
+  explicit WasmVM(std::shared_ptr<const CompiledModule> compiled,
+                  BoundsCheck bounds = static_cast<BoundsCheck>(g_bounds));
   // default destructor is fine
   ~WasmVM() = default;
 
+  /* call_main(), then print the results or the trap to stdout */
   void run(std::vector<std::string> mainargs);
-  std::unordered_map<const byte*, CtrlMeta>  pre_indexing(FuncDecl* f);
+  /* Run main with {mainargs} without printing anything. False if it could
+   * not be called or trapped (see trap_message()); otherwise its results
+   * are in results() */
+  bool call_main(const std::vector<std::string>& mainargs);
+  const std::vector<Value>& results() const { return results_; }
+  std::string trap_message() const;
+
+  /* Runtime entry points that native code calls */
+  static uint32_t jit_interp_entry(JitContext* ctx, Slot* frame, FuncInst* f);
+
+  /* FuncInst::error of functions not prepared yet */
+  static const char kUnprepared[];
+  static FuncInst* jit_resolve_indirect(JitContext* ctx, IndirectCache* cache, int32_t elem_index);
+  static uint32_t jit_trap(JitContext* ctx, uint32_t trap, const char* detail);
+  static uint32_t jit_pending_trap(JitContext* ctx);
+  static uint32_t native_call(JitContext* ctx, Slot* args, uint32_t func_index);
+  static uint32_t native_call_indirect(JitContext* ctx, Slot* args, uint32_t func_index,
+                                       uint32_t site, int32_t elem_index);
 
 private:
-  void initialize_runtime_environment();
-  void cache_linear_memory_layout();
-  void cache_table_layout();
-  void resolve_main_entrypoint();
   void prepare_globals_storage();
   void prepare_data_segments();
   void prepare_function_instances();
+  /* Copy what calls need from {fi.body}, once it is prepared */
+  void bind_body(FuncInst& fi);
+  /* Slow path of a call to {f} with its error set: prepares it if it is
+   * still a lazy stub. True if it can be called now */
+  bool prepare_on_call(FuncInst* f);
   void prepare_element_segments();
   void reset_runtime_state();
   bool validate_main_signature(size_t argc) const;
   void push_main_arguments(const std::vector<std::string>& mainargs);
-  void skip_immediate(Opcode_t opcode, buffer_t &buf);
+  FuncInst* instance_of(const FuncDecl* f);
 
-  bool invoke(FuncDecl* f);
-  void run_op();
-  void add_frame(FuncDecl* f);
+  /* Returns false if the call trapped; see trap_message() */
+  bool invoke(FuncInst* f);
+  Trap execute(FrameHeader* entry);
+  /* execute() for the memory's BoundsCheck; only with {Tiering} do calls
+   * and back-edges count towards compiling or enter native code */
+  template <BoundsCheck B, bool Tiering> Trap execute_bounded(FrameHeader* entry);
+  FrameHeader* push_frame(FuncInst* f, Slot* args, FrameHeader* caller, const Instr* ret_pc);
+  FuncInst* resolve_indirect(uint32_t type_index, uint32_t table_index, int32_t elem_index);
+  FuncInst* resolve_cached(IndirectCache& cache, int32_t elem_index);
+  void collect_results();
   void print_final_results();
-  std::vector<Value> build_locals_for(const FuncDecl* f);
+  void print_icache_stats() const;
 
-  inline void push(Value v) { operand_stack_.push_back(v); }
-  inline Value top() {
-    if (operand_stack_.empty()) {
+  /* Record a trap; returns {trap} so that handlers can `return set_trap(...)`.
+   * {detail} must outlive the run (a literal, a mnemonic or FuncInst::error) */
+  inline Trap set_trap(Trap trap, const char* detail = nullptr) {
+    trap_ = trap;
+    trap_detail_ = detail;
+    return trap;
+  }
+
+  /* Register tier */
+  bool enter_reg_frame(FuncInst* f, Slot* regs);
+  Trap execute_reg();
+  template <BoundsCheck B> Trap execute_reg_bounded();
+
+  /* Baseline compiler (src/jit.cpp, VM_JIT builds). compile_jit() compiles
+   * {funcs} and points their entries at the code; tier_up() does so for a
+   * function that became hot and reports whether it now has code */
+  void compile_jit(const std::vector<FuncInst*>& funcs);
+  bool tier_up(FuncInst* f);
+  JitFn osr_entry(FuncInst* f, const Instr* header);
+  /* --aot (src/aot.cpp, VM_AOT builds): translate the module to C, build
+   * it or find it in the cache, and point the entries at it. False if
+   * that failed and the module is to be interpreted */
+  bool load_aot();
+  bool invoke_native(FuncInst* f, Slot* args);
+
+  /* Stack helpers for use outside execute(), which keeps its own copy of
+   * the stack pointer and sets {stack_top_} when the entry frame returns */
+  inline Slot* stack_base() { return operand_stack_.data() + 1; }
+  inline size_t stack_capacity() const { return operand_stack_.size() - 1; }
+  inline void push(Slot v) {
+    if (stack_top_ >= stack_capacity()) {
+      throw std::runtime_error("operand stack overflow");
+    }
+    stack_base()[stack_top_++] = v;
+  }
+  inline Slot top() {
+    if (stack_top_ == 0) {
       throw std::runtime_error("operand stack underflow");
     }
-    return operand_stack_.back();
+    return stack_base()[stack_top_ - 1];
   }
-  inline Value pop() {
-    if (operand_stack_.empty()) {
+  inline Slot pop() {
+    if (stack_top_ == 0) {
       throw std::runtime_error("operand stack underflow");
     }
-    Value v = operand_stack_.back();
-    operand_stack_.pop_back();
-    return v;
+    return stack_base()[--stack_top_];
   }
-  inline void pop_to(size_t h) { operand_stack_.resize(h); }
-  inline size_t sp() const { return operand_stack_.size(); }
+  inline void pop_to(size_t h) { stack_top_ = h; }
+  inline size_t sp() const { return stack_top_; }
 
-  WasmModule module_;
-  std::vector<byte> linear_memory_;
-  std::vector<std::vector<FuncDecl*>> table_instances_;
-  std::vector<FuncDecl*> function_instances_;
-  std::vector<Value> global_values_;
-  std::vector<Value> operand_stack_;
-  std::vector<Frame> call_stack_;
-  std::vector<uint32_t> local_table_initial_sizes_;
-  uint32_t initial_linear_memory_pages_ = 0;
-  FuncDecl* main_ = nullptr;
+  std::shared_ptr<const CompiledModule> compiled_;
+  const WasmModule& module_;
+  LinearMemory memory_;
+  std::vector<std::vector<TableEntry>> table_instances_;
+  /* Bumped whenever a table slot is written, which invalidates every
+   * IndirectCache filled before */
+  uint64_t table_epoch_ = 0;
+  std::vector<FuncInst> function_instances_;
+  std::vector<Slot> global_values_;
+  /* Value stack holding the operands, locals and frame headers of both tiers.
+   * Fixed-capacity so execute() can hold raw pointers into it. Slot 0 is a
+   * guard below the bottom of the stack for the top-of-stack cache */
+  std::vector<Slot> operand_stack_;
+  size_t stack_top_ = 0;
+  std::vector<RegFrame> reg_call_stack_;
+  /* Its depth also counts the stack tier's frames, so a recursion that
+   * alternates between tiers is held to one VM_MAX_CALL_DEPTH */
+  JitContext jit_ctx_{};
+  ExecMemory jit_memory_;
+  SharedLibrary aot_library_;
+  /* Whether native code may run, under --jit or --aot; the plain
+   * interpreter then skips the entry checks and hotness counting */
+  bool tiering_ = false;
+  /* Hotness at which an interpreted function is compiled; never under the
+   * plain interpreter */
+  uint32_t tier_threshold_ = UINT32_MAX;
+  std::vector<Value> results_;
+  /* Why the last invoke() trapped */
+  Trap trap_ = Trap::None;
+  const char* trap_detail_ = nullptr;
+  const FuncDecl* main_ = nullptr;
 };
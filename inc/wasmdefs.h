@@ -127,3 +127,5 @@ typedef struct {
 
 /* Defined in C file so we can use designated initializers */
 extern opcode_entry_t opcode_table[];
+/* Number of entries, so opcodes from outside the parser can be range-checked */
+extern const uint32_t opcode_table_size;
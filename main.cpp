@@ -11,6 +11,15 @@
 
 static struct option long_options[] = {
   {"trace", no_argument,  &g_trace, 1},
+  {"regvm", no_argument,  &g_regvm, 1},
+  {"jit", no_argument,  &g_jit, 1},
+  {"jit-threshold", required_argument, NULL, 't'},
+  {"aot", no_argument,  &g_aot, 1},
+  {"icache-stats", no_argument,  &g_icache_stats, 1},
+  {"module-cache", no_argument,  &g_module_cache, 1},
+  {"threads", required_argument, NULL, 'n'},
+  {"lazy", no_argument,  &g_lazy, 1},
+  {"bounds", required_argument, NULL, 'b'},
   {"args", optional_argument, NULL, 'a'},
   {"help", no_argument, NULL, 'h'}
 };
@@ -33,9 +42,32 @@ args_t parse_args(int argc, char* argv[]) {
           args.mainargs.push_back(argv[optind++]);
         }
         break;
+      case 't':
+        g_jit_threshold = atoi(optarg);
+        if (g_jit_threshold < 0) {
+          ERR("--jit-threshold must be 0 or more\n");
+          exit(1);
+        }
+        break;
+      case 'n':
+        g_threads = atoi(optarg);
+        if (g_threads < 1) {
+          ERR("--threads must be 1 or more\n");
+          exit(1);
+        }
+        break;
+      case 'b': {
+        BoundsCheck bounds;
+        if (!parse_bounds_check(optarg, bounds)) {
+          ERR("--bounds must be explicit, guard or mask\n");
+          exit(1);
+        }
+        g_bounds = static_cast<int>(bounds);
+        break;
+      }
       case 'h':
       default:
-        ERR("Usage: %s [--trace (optional)] [-a <space-separated args>] <input-file>\n", argv[0]);
+        ERR("Usage: %s [--trace (optional)] [--regvm (optional)] [--jit (optional)] [--jit-threshold <n>] [--aot (optional)] [--icache-stats (optional)] [--module-cache (optional)] [--threads <n>] [--lazy (optional)] [--bounds explicit|guard|mask] [-a <space-separated args>] <input-file>\n", argv[0]);
         exit(opt != 'h');
     }
   }
@@ -45,32 +77,65 @@ args_t parse_args(int argc, char* argv[]) {
     exit(1);
   }
 
+  if (g_trace && VM_TRACE_LEVEL == VM_TRACE_OFF) {
+    ERR("--trace has no effect: this build has tracing compiled out (VM_TRACE=off)\n");
+  }
+
+  if (g_jit + g_regvm + g_aot > 1) {
+    ERR("--jit, --regvm and --aot select different tiers; pass only one\n");
+    exit(1);
+  }
+  if (g_jit && !VM_JIT) {
+    ERR("--jit has no effect: this build has no compiler (VM_JIT=OFF); interpreting\n");
+    g_jit = 0;
+  }
+  if (g_aot && !VM_AOT) {
+    ERR("--aot has no effect: this build cannot load native code (VM_AOT=OFF); interpreting\n");
+    g_aot = 0;
+  }
+
   args.infile = std::string(argv[optind]);
   return args;
 }
 
 // Main function.
 // Parses arguments and either runs a file with arguments.
-//  --trace: enable tracing to stderr
+//  --trace: enable tracing to stderr, up to the level the build has
+//           compiled in (VM_TRACE)
+//  --regvm: execute through the register-based tier
+//  --jit:   compile functions to native code once they get hot (VM_JIT)
+//  --jit-threshold <n>: calls plus loop back-edges that make a function
+//           hot; 0 compiles everything before running
+//  --aot:   run the module as C compiled by the system compiler, cached
+//           across runs under $WASM_VM_CACHE or ~/.cache/wasm-vm (VM_AOT).
+//           $CC (default cc) is split into words by the shell, as make
+//           does, so CC="ccache gcc" or CC="gcc -m64" work
+//  --icache-stats: report calls and inline cache hits of every
+//           call_indirect site to stderr after the run
+//  --module-cache: reuse the validated and translated functions of the
+//           module from an earlier run, cached in the same place as --aot
+//  --threads <n>: decode, validate and translate functions on n threads;
+//           the result does not depend on n, only the order of traces
+//  --lazy:  validate and translate each function on its first call; an
+//           invalid body traps when called instead of rejecting the module
+//  --bounds explicit|guard|mask: how loads and stores stay inside linear
+//           memory: a check on every access (the default), guard pages
+//           whose faults become traps, or masking, which never traps
 int main(int argc, char *argv[]) {
   args_t args = parse_args(argc, argv);
     
-  byte* start = NULL;
-  byte* end = NULL;
-
   const char *infile = args.infile.c_str();
-  ssize_t r = load_file(infile, &start, &end);
-  if (r < 0) {
+  auto file = MappedFile::open(infile);
+  if (!file) {
     ERR("failed to load: %s\n", infile);
     return 1;
   }
 
-  TRACE("loaded %s: %ld bytes\n", infile, r);
-  WasmModule module = parse_bytecode(start, end);
-  unload_file(&start, &end);
+  TRACE("loaded %s: %ld bytes\n", infile, (long)file->size());
+  auto compiled = CompiledModule::compile(parse_file(std::move(file)));
   
   /* Interpreter here */
-  WasmVM vm(module);
+  WasmVM vm(compiled);
   vm.run(args.mainargs);
 
   return 0;
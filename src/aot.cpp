@@ -0,0 +1,662 @@
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+#if VM_AOT
+#include <dlfcn.h>
+#include <unistd.h>
+#endif
+
+/* Ahead-of-time translation to C (--aot).
+ *
+ * Every function with a body becomes one C function over its lowered,
+ * validated Instr stream: locals and operands are C variables named by
+ * their static stack height, branches are gotos, and memory goes through
+ * bounds-checked helpers, so the C compiler does the register allocation.
+ * The functions follow the JitFn convention and are installed as the
+ * FuncInst entries, which is how the VM, the interpreter and the module's
+ * own call_indirect reach them. Calls between translated functions are
+ * direct C calls. Like compiled code, a function keeps the stack tier's
+ * frame layout: the arguments of a call go to the operand slots of {frame}
+ * in the value stack, so no local has its address taken and a tail call is
+ * a C call in tail position, which the compiler turns into a jump.
+ *
+ * The source is compiled with the system C compiler ($CC, default cc, split
+ * into words by the shell as make does, so it may carry a launcher or
+ * flags) into a shared object. The object is cached under a hash of the
+ * module file, the bounds check, the command and the VM's ABI (see
+ * abi_fingerprint), so later runs of the same module dlopen() it without
+ * generating any C; an object whose ABI does not match is rebuilt.
+ * The object contains no addresses of this process: everything it needs
+ * from the VM comes through JitContext and its NativeRuntime table. */
+
+SharedLibrary::~SharedLibrary() {
+  close();
+}
+
+void SharedLibrary::close() {
+#if VM_AOT
+  if (handle_ != nullptr) {
+    dlclose(handle_);
+  }
+  handle_ = nullptr;
+#endif
+}
+
+#if VM_AOT
+
+bool SharedLibrary::open(const std::string& path, std::string& error) {
+  void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    error = dlerror();
+    return false;
+  }
+  if (handle_ != nullptr) {
+    dlclose(handle_);
+  }
+  handle_ = handle;
+  return true;
+}
+
+void* SharedLibrary::symbol(const char* name) const {
+  return dlsym(handle_, name);
+}
+
+namespace {
+
+/* Bump when the generated code changes meaning, to leave old objects in the
+ * cache unused */
+#define VM_AOT_FORMAT 4
+
+const char* const kPrelude = R"(#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef union { uint64_t raw; int32_t i32; int64_t i64; float f32; double f64; } Slot;
+typedef struct JitContext JitContext;
+typedef struct {
+  uint32_t (*trap)(JitContext* ctx, uint32_t trap, const char* detail);
+  uint32_t (*call)(JitContext* ctx, Slot* args, uint32_t func_index);
+  uint32_t (*call_indirect)(JitContext* ctx, Slot* args, uint32_t func_index,
+                            uint32_t site, int32_t elem_index);
+} NativeRuntime;
+struct JitContext {
+  void* vm;
+  uint8_t* mem;
+  uint64_t mem_bound;
+  Slot* globals;
+  Slot* stack_end;
+  uint32_t depth;
+  const NativeRuntime* rt;
+};
+
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#endif
+
+#define TRAP(code, detail) do { rc = ctx->rt->trap(ctx, (code), (detail)); goto out; } while (0)
+
+static inline uint64_t effective(int32_t addr, uint32_t offset) {
+  return (uint64_t)(uint32_t)addr + offset;
+}
+static inline int in_bounds(int32_t addr, uint32_t offset, uint32_t size, uint64_t mem_bound) {
+  return effective(addr, offset) + size <= mem_bound;
+}
+static inline int32_t load_i32(const uint8_t* mem, uint64_t at) {
+  int32_t value;
+  memcpy(&value, mem + at, sizeof(value));
+  return value;
+}
+static inline void store_i32(uint8_t* mem, uint64_t at, int32_t value) {
+  memcpy(mem + at, &value, sizeof(value));
+}
+)";
+
+class CWriter {
+public:
+  std::string out;
+
+  __attribute__((format(printf, 2, 3)))
+  void line(const char* fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    out += buf;
+    out += '\n';
+  }
+};
+
+unsigned trap_code(Trap trap) {
+  return static_cast<unsigned>(trap);
+}
+
+bool is_translated(const FuncInst& fi) {
+  return fi.error == nullptr && !fi.body->code.empty();
+}
+
+constexpr uint32_t kNoHeight = UINT32_MAX;
+
+/* Emits one function; {h} is the static operand stack height */
+class FunctionTranslator {
+public:
+  FunctionTranslator(CWriter& w, const FuncInst& fi, uint32_t index,
+                     const std::vector<FuncInst>& funcs, const WasmModule& module, BoundsCheck bounds)
+      : w_(w), fi_(fi), index_(index), funcs_(funcs), module_(module), bounds_(bounds) {}
+
+  void translate();
+
+private:
+  void record_target(uint32_t target, uint32_t height) {
+    if (target_height_[target] == kNoHeight) {
+      target_height_[target] = height;
+    }
+  }
+  void emit_return();
+  void emit_call(uint32_t nparams, uint32_t nresults, const char* call);
+  void emit_tail_call(uint32_t nparams, const char* call);
+  std::string emit_address(const char* addr, uint32_t offset);
+  void translate_instr(const Instr& ins);
+
+  CWriter& w_;
+  const FuncInst& fi_;
+  const uint32_t index_;
+  const std::vector<FuncInst>& funcs_;
+  const WasmModule& module_;
+  const BoundsCheck bounds_;
+  uint32_t h_ = 0;
+  bool reachable_ = true;
+  std::vector<uint32_t> target_height_;
+};
+
+void FunctionTranslator::translate() {
+  const auto& code = fi_.body->code;
+  std::vector<bool> is_target(code.size() + 1, false);
+  target_height_.assign(code.size() + 1, kNoHeight);
+  for (const auto& ins : code) {
+    switch (ins.op) {
+      case WASM_OP_IF:
+      case WASM_OP_ELSE:
+        is_target[ins.a] = true;
+        break;
+      case WASM_OP_BR:
+      case WASM_OP_BR_IF:
+      case VM_OP_I32_LT_S_BR_IF:
+      case VM_OP_I32_EQZ_BR_IF:
+        is_target[ins.imm.br.target] = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  w_.line("uint32_t wasm_f%u(JitContext* ctx, Slot* frame, void* self) {", index_);
+  w_.line("  uint32_t rc = 0;");
+  w_.line("  uint8_t* const mem = ctx->mem;");
+  w_.line("  const uint64_t mem_bound = ctx->mem_bound;");
+  w_.line("  Slot* const globals = ctx->globals;");
+  for (uint32_t i = 0; i < fi_.nlocals; ++i) {
+    if (i < fi_.nparams) {
+      w_.line("  Slot l%u = frame[%u];", i, i);
+    } else {
+      w_.line("  Slot l%u = {0};", i);
+    }
+  }
+  for (uint32_t i = 0; i < fi_.max_stack; ++i) {
+    w_.line("  Slot s%u;", i);
+  }
+  w_.line("  (void)self;");
+  w_.line("  if (++ctx->depth > %u) TRAP(%u, 0);", VM_MAX_CALL_DEPTH,
+          trap_code(Trap::CallStackExhausted));
+  w_.line("  if (frame + %u > ctx->stack_end) TRAP(%u, 0);",
+          fi_.nlocals + static_cast<uint32_t>(VM_FRAME_SLOTS) + fi_.max_stack,
+          trap_code(Trap::StackOverflow));
+  for (size_t i = 0; i < code.size(); ++i) {
+    if (is_target[i]) {
+      w_.line("L%zu:;", i);
+      if (!reachable_ && target_height_[i] != kNoHeight) {
+        h_ = target_height_[i];
+        reachable_ = true;
+      }
+    }
+    if (reachable_) {
+      translate_instr(code[i]);
+    }
+  }
+  w_.line("out:");
+  w_.line("  --ctx->depth;");
+  w_.line("  return rc;");
+  w_.line("}");
+  w_.line("%s", "");
+}
+
+void FunctionTranslator::emit_return() {
+  for (uint32_t i = 0; i < fi_.nresults; ++i) {
+    w_.line("  frame[%u] = s%u;", i, h_ - fi_.nresults + i);
+  }
+  w_.line("  goto out;");
+}
+
+/* The arguments are the top {nparams} operands; {call} is the call
+ * expression, which sees them as {a}, their operand slots in the frame */
+void FunctionTranslator::emit_call(uint32_t nparams, uint32_t nresults, const char* call) {
+  const uint32_t base = h_ - nparams;
+  w_.line("  {");
+  w_.line("    Slot* a = frame + %u;", fi_.nlocals + static_cast<uint32_t>(VM_FRAME_SLOTS) + base);
+  for (uint32_t i = 0; i < nparams; ++i) {
+    w_.line("    a[%u] = s%u;", i, base + i);
+  }
+  w_.line("    rc = %s;", call);
+  w_.line("    if (rc != 0) goto out;");
+  for (uint32_t i = 0; i < nresults; ++i) {
+    w_.line("    s%u = a[%u];", base + i, i);
+  }
+  w_.line("  }");
+  h_ = base + nresults;
+}
+
+/* The arguments take the place of the params in {frame}, and {call}
+ * leaves the callee's results there for this function's caller */
+void FunctionTranslator::emit_tail_call(uint32_t nparams, const char* call) {
+  const uint32_t base = h_ - nparams;
+  for (uint32_t i = 0; i < nparams; ++i) {
+    w_.line("  frame[%u] = s%u;", i, base + i);
+  }
+  w_.line("  --ctx->depth;");
+  w_.line("  %s;", call);
+}
+
+/* Where the 4-byte access at {addr} (a C operand) plus {offset} goes,
+ * after emitting the check the memory's BoundsCheck needs: a trap under
+ * explicit checks, nothing with guard pages, and a mask when masking */
+std::string FunctionTranslator::emit_address(const char* addr, uint32_t offset) {
+  char at[64];
+  if (bounds_ == BoundsCheck::Mask) {
+    snprintf(at, sizeof(at), "effective(%s.i32, %uu) & mem_bound", addr, offset);
+    return at;
+  }
+  if (bounds_ == BoundsCheck::Explicit) {
+    w_.line("  if (!in_bounds(%s.i32, %uu, 4, mem_bound)) TRAP(%u, 0);", addr, offset,
+            trap_code(Trap::MemoryOutOfBounds));
+  }
+  snprintf(at, sizeof(at), "effective(%s.i32, %uu)", addr, offset);
+  return at;
+}
+
+void FunctionTranslator::translate_instr(const Instr& ins) {
+  const uint32_t h = h_;
+  switch (ins.op) {
+    case WASM_OP_NOP:
+      break;
+    case WASM_OP_UNREACHABLE:
+      w_.line("  TRAP(%u, 0);", trap_code(Trap::Unreachable));
+      reachable_ = false;
+      break;
+    case WASM_OP_I32_CONST:
+    case WASM_OP_I64_CONST:
+    case WASM_OP_F32_CONST:
+    case WASM_OP_F64_CONST: {
+      Slot s{};
+      switch (ins.op) {
+        case WASM_OP_I32_CONST: s.i32 = ins.imm.i32; break;
+        case WASM_OP_I64_CONST: s.i64 = ins.imm.i64; break;
+        case WASM_OP_F32_CONST: s.f32 = ins.imm.f32; break;
+        default: s.f64 = ins.imm.f64; break;
+      }
+      w_.line("  s%u.raw = 0x%016llxull;", h, static_cast<unsigned long long>(s.raw));
+      h_ = h + 1;
+      break;
+    }
+    case WASM_OP_LOCAL_GET:
+      w_.line("  s%u = l%u;", h, ins.a);
+      h_ = h + 1;
+      break;
+    case WASM_OP_LOCAL_SET:
+      w_.line("  l%u = s%u;", ins.a, h - 1);
+      h_ = h - 1;
+      break;
+    case WASM_OP_LOCAL_TEE:
+      w_.line("  l%u = s%u;", ins.a, h - 1);
+      break;
+    case WASM_OP_GLOBAL_GET:
+      w_.line("  s%u = globals[%u];", h, ins.a);
+      h_ = h + 1;
+      break;
+    case WASM_OP_GLOBAL_SET:
+      w_.line("  globals[%u] = s%u;", ins.a, h - 1);
+      h_ = h - 1;
+      break;
+    case WASM_OP_DROP:
+      h_ = h - 1;
+      break;
+    case WASM_OP_SELECT:
+      w_.line("  s%u = s%u.i32 ? s%u : s%u;", h - 3, h - 1, h - 3, h - 2);
+      h_ = h - 2;
+      break;
+    case WASM_OP_I32_EQZ:
+      w_.line("  s%u.i32 = s%u.i32 == 0;", h - 1, h - 1);
+      break;
+    case WASM_OP_I32_EQ:
+      w_.line("  s%u.i32 = s%u.i32 == s%u.i32;", h - 2, h - 2, h - 1);
+      h_ = h - 1;
+      break;
+    case WASM_OP_I32_LT_S:
+      w_.line("  s%u.i32 = s%u.i32 < s%u.i32;", h - 2, h - 2, h - 1);
+      h_ = h - 1;
+      break;
+    case WASM_OP_I32_ADD:
+    case WASM_OP_I32_SUB:
+      w_.line("  s%u.i32 = (int32_t)((uint32_t)s%u.i32 %c (uint32_t)s%u.i32);", h - 2, h - 2,
+              ins.op == WASM_OP_I32_ADD ? '+' : '-', h - 1);
+      h_ = h - 1;
+      break;
+    case WASM_OP_F64_ADD:
+      w_.line("  s%u.f64 = s%u.f64 + s%u.f64;", h - 2, h - 2, h - 1);
+      h_ = h - 1;
+      break;
+    case VM_OP_LOCAL_GET2_I32_ADD:
+      w_.line("  s%u.i32 = (int32_t)((uint32_t)l%u.i32 + (uint32_t)l%u.i32);", h, ins.a, ins.imm.b);
+      h_ = h + 1;
+      break;
+    case VM_OP_LOCAL_GET_I32_CONST_ADD:
+      w_.line("  s%u.i32 = (int32_t)((uint32_t)l%u.i32 + %uu);", h, ins.a,
+              static_cast<uint32_t>(ins.imm.i32));
+      h_ = h + 1;
+      break;
+    case WASM_OP_I32_LOAD: {
+      std::string at = emit_address(("s" + std::to_string(h - 1)).c_str(), ins.a);
+      w_.line("  s%u.i32 = load_i32(mem, %s);", h - 1, at.c_str());
+      break;
+    }
+    case VM_OP_LOCAL_GET_I32_LOAD: {
+      std::string at = emit_address(("l" + std::to_string(ins.a)).c_str(), ins.imm.b);
+      w_.line("  s%u.i32 = load_i32(mem, %s);", h, at.c_str());
+      h_ = h + 1;
+      break;
+    }
+    case WASM_OP_I32_STORE: {
+      std::string at = emit_address(("s" + std::to_string(h - 2)).c_str(), ins.a);
+      w_.line("  store_i32(mem, %s, s%u.i32);", at.c_str(), h - 1);
+      h_ = h - 2;
+      break;
+    }
+    case WASM_OP_IF:
+      w_.line("  if (s%u.i32 == 0) goto L%u;", h - 1, ins.a);
+      h_ = h - 1;
+      record_target(ins.a, h_);
+      break;
+    case WASM_OP_ELSE:
+      w_.line("  goto L%u;", ins.a);
+      record_target(ins.a, h);
+      reachable_ = false;
+      break;
+    case WASM_OP_BR:
+      w_.line("  goto L%u;", ins.imm.br.target);
+      record_target(ins.imm.br.target, ins.imm.br.height);
+      reachable_ = false;
+      break;
+    case WASM_OP_BR_IF:
+      w_.line("  if (s%u.i32 != 0) goto L%u;", h - 1, ins.imm.br.target);
+      record_target(ins.imm.br.target, ins.imm.br.height);
+      h_ = h - 1;
+      break;
+    case VM_OP_I32_EQZ_BR_IF:
+      w_.line("  if (s%u.i32 == 0) goto L%u;", h - 1, ins.imm.br.target);
+      record_target(ins.imm.br.target, ins.imm.br.height);
+      h_ = h - 1;
+      break;
+    case VM_OP_I32_LT_S_BR_IF:
+      w_.line("  if (s%u.i32 < s%u.i32) goto L%u;", h - 2, h - 1, ins.imm.br.target);
+      record_target(ins.imm.br.target, ins.imm.br.height);
+      h_ = h - 2;
+      break;
+    case WASM_OP_RETURN:
+    case WASM_OP_END:
+      emit_return();
+      reachable_ = false;
+      break;
+    case VM_OP_RETURN_IF:
+      h_ = h - 1;
+      w_.line("  if (s%u.i32 != 0) {", h - 1);
+      emit_return();
+      w_.line("  }");
+      break;
+    case WASM_OP_CALL: {
+      const FuncInst& callee = funcs_[ins.a];
+      char call[96];
+      if (is_translated(callee)) {
+        snprintf(call, sizeof(call), "wasm_f%u(ctx, a, 0)", ins.a);
+      } else {
+        // Not translated: the VM's entry for it reports why it cannot run
+        snprintf(call, sizeof(call), "ctx->rt->call(ctx, a, %u)", ins.a);
+      }
+      emit_call(callee.nparams, callee.nresults, call);
+      break;
+    }
+    case WASM_OP_CALL_INDIRECT: {
+      const SigDecl* sig = module_.getSig(ins.a);
+      char call[128];
+      snprintf(call, sizeof(call), "ctx->rt->call_indirect(ctx, a, %u, %u, s%u.i32)", index_,
+               ins.imm.call.site, h - 1);
+      h_ = h - 1;
+      emit_call(static_cast<uint32_t>(sig->params.size()), static_cast<uint32_t>(sig->results.size()),
+                call);
+      break;
+    }
+    case WASM_OP_RETURN_CALL: {
+      const FuncInst& callee = funcs_[ins.a];
+      char call[96];
+      if (is_translated(callee)) {
+        snprintf(call, sizeof(call), "MUSTTAIL return wasm_f%u(ctx, frame, 0)", ins.a);
+      } else {
+        snprintf(call, sizeof(call), "return ctx->rt->call(ctx, frame, %u)", ins.a);
+      }
+      emit_tail_call(callee.nparams, call);
+      reachable_ = false;
+      break;
+    }
+    case WASM_OP_RETURN_CALL_INDIRECT: {
+      const SigDecl* sig = module_.getSig(ins.a);
+      char call[128];
+      snprintf(call, sizeof(call), "return ctx->rt->call_indirect(ctx, frame, %u, %u, s%u.i32)",
+               index_, ins.imm.call.site, h - 1);
+      h_ = h - 1;
+      emit_tail_call(static_cast<uint32_t>(sig->params.size()), call);
+      reachable_ = false;
+      break;
+    }
+    default: {
+      Opcode_t opcode = (ins.op == VM_OP_UNSUPPORTED) ? ins.a : ins.op;
+      w_.line("  TRAP(%u, \"%s\");", trap_code(Trap::UnsupportedOpcode), opcode_table[opcode].mnemonic);
+      reachable_ = false;
+      break;
+    }
+  }
+}
+
+uint64_t fnv1a(const std::string& data) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : data) {
+    hash = (hash ^ c) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+/* What an object depends on in the VM that built it: the layouts its code
+ * reads and the build of the translator, which __DATE__ and __TIME__ tell
+ * apart since this file is rebuilt whenever it or a header it includes
+ * changes. It is part of the cache key and is compiled into the object as
+ * wasm_abi, which load_aot() compares before any of the object's code is
+ * installed. */
+std::string abi_fingerprint() {
+  char abi[256];
+  snprintf(abi, sizeof(abi),
+           "format %d slot %zu ctx %zu %zu %zu %zu %zu %zu %zu %zu rt %zu %zu %zu %zu frame %zu build %s %s",
+           VM_AOT_FORMAT, sizeof(Slot), sizeof(JitContext), offsetof(JitContext, vm),
+           offsetof(JitContext, mem), offsetof(JitContext, mem_bound), offsetof(JitContext, globals),
+           offsetof(JitContext, stack_end), offsetof(JitContext, depth), offsetof(JitContext, rt),
+           sizeof(NativeRuntime), offsetof(NativeRuntime, trap), offsetof(NativeRuntime, call),
+           offsetof(NativeRuntime, call_indirect), VM_FRAME_SLOTS, __DATE__, __TIME__);
+  return abi;
+}
+
+std::string shell_quote(const std::string& s) {
+  std::string quoted = "'";
+  for (char c : s) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+} // namespace
+
+bool WasmVM::load_aot() {
+  const std::string abi = abi_fingerprint();
+  auto generate = [this, &abi] {
+    CWriter w;
+    w.out = kPrelude;
+    w.line("_Static_assert(sizeof(Slot) == %zu && offsetof(JitContext, stack_end) == %zu &&", sizeof(Slot),
+           offsetof(JitContext, stack_end));
+    w.line("               offsetof(JitContext, depth) == %zu &&", offsetof(JitContext, depth));
+    w.line("               offsetof(JitContext, rt) == %zu, \"VM ABI mismatch\");",
+           offsetof(JitContext, rt));
+    w.line("const char wasm_abi[] = \"%s\";", abi.c_str());
+    w.line("%s", "");
+    for (uint32_t i = 0; i < function_instances_.size(); ++i) {
+      if (is_translated(function_instances_[i])) {
+        w.line("uint32_t wasm_f%u(JitContext* ctx, Slot* frame, void* self);", i);
+      }
+    }
+    w.line("%s", "");
+    for (uint32_t i = 0; i < function_instances_.size(); ++i) {
+      if (is_translated(function_instances_[i])) {
+        FunctionTranslator(w, function_instances_[i], i, function_instances_, module_, memory_.strategy())
+            .translate();
+      }
+    }
+    return w.out;
+  };
+
+  // The C follows from the module file and how memory is checked, so those
+  // name the object and the C is only generated when it has to be built.
+  // A module parsed from memory has no file to hash and is named by its C
+  // instead.
+  std::string code;
+  std::string identity;
+  if (module_.get_source() != nullptr) {
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(
+             hash_bytes(module_.get_source()->start(), module_.get_source()->size())));
+    identity = std::string("module ") + hash + ' ' + bounds_check_name(memory_.strategy());
+  } else {
+    code = generate();
+    identity = code;
+  }
+  const char* cc = getenv("CC");
+  const std::string compiler = (cc != nullptr && *cc != '\0') ? cc : "cc";
+  const std::string flags = "-O2 -fPIC -shared -w";
+  char key[32];
+  snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(
+           fnv1a(identity + '\n' + compiler + ' ' + flags + '\n' + abi)));
+
+  const std::string dir = cache_directory();
+  const std::string object = dir + "/" + key + ".so";
+  auto build = [&] {
+    if (!make_directories(dir)) {
+      TRACE("AOT: cannot create cache directory %s\n", dir.c_str());
+      return false;
+    }
+    // Build under names of our own and rename into place, so concurrent
+    // runs never see a partial object
+    const std::string stem = dir + "/" + key + "." + std::to_string(getpid());
+    const std::string source = stem + ".c";
+    if (code.empty()) {
+      code = generate();
+    }
+    FILE* file = fopen(source.c_str(), "w");
+    if (file == nullptr) {
+      return false;
+    }
+    bool written = fwrite(code.data(), 1, code.size(), file) == code.size();
+    written = (fclose(file) == 0) && written;
+    // $CC goes to the shell unquoted, as make passes it
+    const std::string command = compiler + " " + flags + " -o " + shell_quote(stem + ".so") +
+                                " " + shell_quote(source) + " > " + shell_quote(dir + "/" + key + ".log") +
+                                " 2>&1";
+    TRACE("AOT: %s\n", command.c_str());
+    const bool built = written && system(command.c_str()) == 0 &&
+                       rename((stem + ".so").c_str(), object.c_str()) == 0;
+    unlink(source.c_str());
+    if (built) {
+      unlink((dir + "/" + key + ".log").c_str());
+    } else {
+      unlink((stem + ".so").c_str());
+      ERR("--aot: compiling the module with %s failed; see %s/%s.log\n", compiler.c_str(), dir.c_str(), key);
+    }
+    return built;
+  };
+  // Nothing of an object is used before its wasm_abi matches this VM
+  auto open = [&] {
+    std::string error;
+    if (!aot_library_.open(object, error)) {
+      TRACE("AOT: %s\n", error.c_str());
+      return false;
+    }
+    const char* built_for = static_cast<const char*>(aot_library_.symbol("wasm_abi"));
+    if (built_for == nullptr || abi != built_for) {
+      TRACE("AOT: %s was built for another VM\n", object.c_str());
+      // dlopen() would hand the same library back for its path
+      aot_library_.close();
+      return false;
+    }
+    return true;
+  };
+
+  if (access(object.c_str(), R_OK) == 0) {
+    TRACE("AOT: using cached %s\n", object.c_str());
+    if (!open()) {
+      // Stale or damaged: replace it
+      unlink(object.c_str());
+      if (!build() || !open()) {
+        return false;
+      }
+    }
+  } else if (!build() || !open()) {
+    return false;
+  }
+  std::vector<JitFn> entries(function_instances_.size(), nullptr);
+  for (uint32_t i = 0; i < function_instances_.size(); ++i) {
+    if (!is_translated(function_instances_[i])) {
+      continue;
+    }
+    const std::string name = "wasm_f" + std::to_string(i);
+    entries[i] = reinterpret_cast<JitFn>(aot_library_.symbol(name.c_str()));
+    if (entries[i] == nullptr) {
+      TRACE("AOT: %s is missing from %s\n", name.c_str(), object.c_str());
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < function_instances_.size(); ++i) {
+    if (entries[i] != nullptr) {
+      function_instances_[i].entry = entries[i];
+    }
+  }
+  return true;
+}
+
+#endif // VM_AOT
@@ -0,0 +1,589 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+#include "vm.h"
+
+/* On-disk module cache (--module-cache).
+ *
+ * Validating and translating every function is most of the startup time of
+ * a large module, and its outcome only depends on the module's bytes and on
+ * the tier being translated for. It is stored in one file per module and
+ * tier under cache_directory(), named by hash_bytes() of the .wasm file.
+ * The parsed module itself is not stored: parsing borrows its bytes from
+ * the mapped file and costs next to nothing beside translation.
+ *
+ * A file holds a CacheHeader, the reason the module is invalid (if it is),
+ * then for every function a FuncRecord followed by its control table, stack
+ * code, register code, indirect call sites and error string. Every part is
+ * padded to 8 bytes. All of it is plain data with indices but no addresses,
+ * so a warm start maps the file, checks the header against the module,
+ * copies the arrays out and verifies them against the module (see
+ * CodeVerifier) before any of it is used. */
+
+namespace {
+
+/* Bump whenever Instr, RegInstr, CtrlMeta or what translation emits changes
+ * meaning, to leave old files unused */
+#define VM_CACHE_FORMAT 1
+
+const char kCacheMagic[8] = {'w', 'v', 'm', 'c', 'a', 'c', 'h', 'e'};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t format;
+  uint32_t regvm;
+  uint32_t instr_size;
+  uint32_t reg_instr_size;
+  uint64_t source_size;
+  uint64_t source_hash;
+  uint64_t file_size;
+  uint32_t num_funcs;
+  uint32_t invalid_len;
+};
+
+struct FuncRecord {
+  uint32_t max_stack;
+  uint32_t nregs;
+  uint32_t num_ctrl;
+  uint32_t num_code;
+  uint32_t num_rcode;
+  uint32_t num_sites;
+  uint32_t error_len;
+  uint32_t pad;
+};
+
+static_assert(std::is_trivially_copyable_v<CtrlMeta> && std::is_trivially_copyable_v<Instr> &&
+              std::is_trivially_copyable_v<RegInstr> && std::is_trivially_copyable_v<IndirectSite>,
+              "cached code must be plain data");
+
+inline size_t padded(size_t n) {
+  return (n + 7) & ~size_t(7);
+}
+
+class CacheWriter {
+public:
+  template<typename T>
+  void put(const T* data, size_t count) {
+    const size_t size = sizeof(T) * count;
+    out_.append(reinterpret_cast<const char*>(data), size);
+    out_.append(padded(size) - size, '\0');
+  }
+  std::string& out() { return out_; }
+
+private:
+  std::string out_;
+};
+
+/* Bounds-checked cursor over a cache file */
+class CacheReader {
+public:
+  CacheReader(const byte* start, const byte* end) : ptr_(start), end_(end) {}
+
+  /* Copy {count} values into {into}; false if the file is too short */
+  template<typename T>
+  bool get(T* into, size_t count) {
+    const size_t size = sizeof(T) * count;
+    if (count > static_cast<size_t>(end_ - ptr_) / sizeof(T) ||
+        padded(size) > static_cast<size_t>(end_ - ptr_)) {
+      return false;
+    }
+    if (size != 0) {
+      memcpy(into, ptr_, size);
+    }
+    ptr_ += padded(size);
+    return true;
+  }
+  template<typename T>
+  bool get(std::vector<T>& into, size_t count) {
+    if (count > static_cast<size_t>(end_ - ptr_) / sizeof(T)) {
+      return false;
+    }
+    into.resize(count);
+    return get(into.data(), count);
+  }
+  bool get(std::string& into, size_t count) {
+    if (count > static_cast<size_t>(end_ - ptr_)) {
+      return false;
+    }
+    into.resize(count);
+    return get(into.data(), count);
+  }
+  bool done() const { return ptr_ == end_; }
+
+private:
+  const byte* ptr_;
+  const byte* end_;
+};
+
+constexpr uint32_t kNoHeight = UINT32_MAX;
+
+/* Checks a function body read from a cache file against the module before
+ * any tier runs it. The tiers trust translated code: every index is in
+ * range, every target is an instruction, and the operand stack stays
+ * between the frame's locals and max_stack. Translation guarantees that for
+ * what it emits; a damaged or tampered file has to be shown to uphold it.
+ * Stack code is walked the way the JIT and AOT compilers walk it, so a body
+ * that passes has one height at each instruction they compile. Types are
+ * not checked: a wrong one reads the wrong member of a slot, nothing more. */
+class CodeVerifier {
+public:
+  CodeVerifier(const WasmModule& module, const std::vector<FuncCode>& funcs, const FuncCode& fc,
+               bool regvm)
+      : module_(module), funcs_(funcs), fc_(fc), regvm_(regvm) {}
+
+  bool verify() {
+    if (!fc_.error.empty()) {
+      // Every call traps before it looks at the body
+      return true;
+    }
+    if (module_.isImport(fc_.decl) ||
+        fc_.nlocals + VM_FRAME_SLOTS + static_cast<uint64_t>(fc_.max_stack) > VM_STACK_SLOTS) {
+      return false;
+    }
+    const size_t code_size = fc_.decl->code_bytes.size();
+    for (const CtrlMeta& meta : fc_.ctrl) {
+      if (meta.header >= code_size || meta.else_pc >= code_size || meta.end >= code_size) {
+        return false;
+      }
+    }
+    for (const IndirectSite& site : fc_.sites) {
+      if (site.type_index >= module_.get_num_sigs() || site.table_index >= module_.get_num_tables()) {
+        return false;
+      }
+    }
+    return regvm_ ? verify_reg_code() : verify_code();
+  }
+
+private:
+  bool verify_code();
+  bool verify_reg_code();
+
+  /* A branch to {target} leaves {height} operands */
+  bool branch(uint32_t at, uint32_t target, uint32_t height) {
+    if (target > at) {
+      if (heights_[target] == kNoHeight) {
+        heights_[target] = height;
+      }
+      return heights_[target] == height;
+    }
+    // A back-edge: the target has been passed with the same height
+    return heights_[target] == height && height != kNoHeight;
+  }
+  /* Pop {pops} operands, then push {pushes} */
+  bool effect(uint32_t pops, uint32_t pushes) {
+    if (h_ < pops || static_cast<uint64_t>(h_) - pops + pushes > fc_.max_stack) {
+      return false;
+    }
+    h_ = h_ - pops + pushes;
+    return true;
+  }
+  bool local(uint32_t idx) const { return idx < fc_.nlocals; }
+  bool global(uint32_t idx, bool set) const {
+    return idx < module_.Globals().size() && (!set || module_.getGlobal(idx)->is_mutable);
+  }
+  bool memory() const { return module_.get_num_mems() > 0; }
+  const SigDecl* site_sig(uint32_t site, uint32_t type_index, uint32_t table_index) const {
+    if (site >= fc_.sites.size() || fc_.sites[site].type_index != type_index ||
+        fc_.sites[site].table_index != table_index) {
+      return nullptr;
+    }
+    return module_.getSig(type_index);
+  }
+  bool reg(uint32_t r) const { return r < fc_.nregs; }
+  /* A register-tier call: arguments from {base}, results back at {base} */
+  bool reg_call(uint32_t base, const SigDecl* sig) const {
+    const uint64_t n = std::max(sig->params.size(), sig->results.size());
+    return base + n <= fc_.nregs;
+  }
+
+  const WasmModule& module_;
+  const std::vector<FuncCode>& funcs_;
+  const FuncCode& fc_;
+  const bool regvm_;
+  std::vector<uint32_t> heights_;
+  uint32_t h_ = 0;
+};
+
+bool CodeVerifier::verify_code() {
+  const auto& code = fc_.code;
+  const uint32_t n = static_cast<uint32_t>(code.size());
+  std::vector<bool> is_target(n, false);
+  for (const Instr& ins : code) {
+    uint32_t target = kNoHeight;
+    if (ins.op == WASM_OP_IF || ins.op == WASM_OP_ELSE) {
+      target = ins.a;
+    } else if (ins.op == WASM_OP_BR || ins.op == WASM_OP_BR_IF ||
+               ins.op == VM_OP_I32_LT_S_BR_IF || ins.op == VM_OP_I32_EQZ_BR_IF) {
+      target = ins.imm.br.target;
+    } else {
+      continue;
+    }
+    if (target >= n) {
+      return false;
+    }
+    is_target[target] = true;
+  }
+
+  heights_.assign(n, kNoHeight);
+  h_ = 0;
+  bool reachable = true;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (is_target[i]) {
+      if (reachable && heights_[i] == kNoHeight) {
+        heights_[i] = h_;
+      } else if (reachable && heights_[i] != h_) {
+        return false;
+      } else if (!reachable && heights_[i] != kNoHeight) {
+        h_ = heights_[i];
+        reachable = true;
+      }
+    }
+    if (!reachable) {
+      continue;
+    }
+    const Instr& ins = code[i];
+    bool ok = true;
+    switch (ins.op) {
+      case WASM_OP_NOP:
+        break;
+      case WASM_OP_I32_CONST:
+      case WASM_OP_I64_CONST:
+      case WASM_OP_F32_CONST:
+      case WASM_OP_F64_CONST:
+        ok = effect(0, 1);
+        break;
+      case WASM_OP_DROP:
+        ok = effect(1, 0);
+        break;
+      case WASM_OP_SELECT:
+        ok = effect(3, 1);
+        break;
+      case WASM_OP_I32_EQZ:
+        ok = effect(1, 1);
+        break;
+      case WASM_OP_I32_EQ:
+      case WASM_OP_I32_LT_S:
+      case WASM_OP_I32_ADD:
+      case WASM_OP_I32_SUB:
+      case WASM_OP_F64_ADD:
+        ok = effect(2, 1);
+        break;
+      case WASM_OP_LOCAL_GET:
+        ok = local(ins.a) && effect(0, 1);
+        break;
+      case WASM_OP_LOCAL_SET:
+        ok = local(ins.a) && effect(1, 0);
+        break;
+      case WASM_OP_LOCAL_TEE:
+        ok = local(ins.a) && effect(1, 1);
+        break;
+      case WASM_OP_GLOBAL_GET:
+        ok = global(ins.a, false) && effect(0, 1);
+        break;
+      case WASM_OP_GLOBAL_SET:
+        ok = global(ins.a, true) && effect(1, 0);
+        break;
+      case WASM_OP_I32_LOAD:
+        ok = memory() && effect(1, 1);
+        break;
+      case WASM_OP_I32_STORE:
+        ok = memory() && effect(2, 0);
+        break;
+      case VM_OP_LOCAL_GET2_I32_ADD:
+        ok = local(ins.a) && local(ins.imm.b) && effect(0, 1);
+        break;
+      case VM_OP_LOCAL_GET_I32_CONST_ADD:
+        ok = local(ins.a) && effect(0, 1);
+        break;
+      case VM_OP_LOCAL_GET_I32_LOAD:
+        ok = local(ins.a) && memory() && effect(0, 1);
+        break;
+      case WASM_OP_IF:
+        ok = effect(1, 0) && branch(i, ins.a, h_);
+        break;
+      case WASM_OP_ELSE:
+        ok = branch(i, ins.a, h_);
+        reachable = false;
+        break;
+      case WASM_OP_BR:
+        ok = ins.imm.br.height <= h_ && branch(i, ins.imm.br.target, ins.imm.br.height);
+        reachable = false;
+        break;
+      case WASM_OP_BR_IF:
+      case VM_OP_I32_EQZ_BR_IF:
+      case VM_OP_I32_LT_S_BR_IF:
+        ok = effect(ins.op == VM_OP_I32_LT_S_BR_IF ? 2 : 1, 0) && ins.imm.br.height <= h_ &&
+             branch(i, ins.imm.br.target, ins.imm.br.height);
+        break;
+      case WASM_OP_END:
+        // Only the function's own end survives lowering
+        ok = i + 1 == n && h_ >= fc_.nresults;
+        reachable = false;
+        break;
+      case WASM_OP_RETURN:
+        ok = h_ >= fc_.nresults;
+        reachable = false;
+        break;
+      case VM_OP_RETURN_IF:
+        ok = effect(1, 0) && h_ >= fc_.nresults;
+        break;
+      case WASM_OP_CALL:
+      case WASM_OP_RETURN_CALL: {
+        if (ins.a >= funcs_.size()) {
+          return false;
+        }
+        const FuncCode& callee = funcs_[ins.a];
+        if (ins.op == WASM_OP_CALL) {
+          ok = effect(callee.nparams, callee.nresults);
+        } else {
+          ok = callee.nresults == fc_.nresults && effect(callee.nparams, 0);
+          reachable = false;
+        }
+        break;
+      }
+      case WASM_OP_CALL_INDIRECT:
+      case WASM_OP_RETURN_CALL_INDIRECT: {
+        const SigDecl* sig = site_sig(ins.imm.call.site, ins.a, ins.imm.call.table);
+        if (sig == nullptr) {
+          return false;
+        }
+        const uint32_t nparams = static_cast<uint32_t>(sig->params.size());
+        const uint32_t nresults = static_cast<uint32_t>(sig->results.size());
+        if (ins.op == WASM_OP_CALL_INDIRECT) {
+          ok = effect(nparams + 1, nresults);
+        } else {
+          ok = nresults == fc_.nresults && effect(nparams + 1, 0);
+          reachable = false;
+        }
+        break;
+      }
+      case VM_OP_UNSUPPORTED:
+        ok = ins.a < opcode_table_size;
+        reachable = false;
+        break;
+      default:
+        // Any other wasm opcode traps in every tier
+        ok = ins.op < VM_OP_COUNT;
+        reachable = false;
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  // Nothing runs off the end of the body
+  return !reachable;
+}
+
+bool CodeVerifier::verify_reg_code() {
+  const auto& rcode = fc_.rcode;
+  const size_t n = rcode.size();
+  if (fc_.nregs < fc_.nlocals || fc_.nregs > VM_STACK_SLOTS) {
+    return false;
+  }
+  bool falls_through = true;
+  for (const RegInstr& ins : rcode) {
+    bool ok = true;
+    falls_through = true;
+    switch (ins.op) {
+      case R_UNREACHABLE:
+        falls_through = false;
+        break;
+      case R_UNSUPPORTED:
+        ok = ins.a < opcode_table_size;
+        falls_through = false;
+        break;
+      case R_MOV:
+      case R_I32_EQZ:
+      case R_I32_EQ_I:
+      case R_I32_LT_S_I:
+      case R_I32_ADD_I:
+      case R_I32_SUB_I:
+        ok = reg(ins.d) && reg(ins.a);
+        break;
+      case R_CONST:
+        ok = reg(ins.d);
+        break;
+      case R_JMP:
+        ok = ins.imm.target < n;
+        falls_through = false;
+        break;
+      case R_BR_IF:
+      case R_BR_UNLESS:
+        ok = reg(ins.a) && ins.imm.target < n;
+        break;
+      case R_RET:
+        ok = ins.b == fc_.nresults && static_cast<uint64_t>(ins.a) + ins.b <= fc_.nregs;
+        falls_through = false;
+        break;
+      case R_CALL:
+      case R_RETURN_CALL:
+        ok = ins.a < funcs_.size() && reg_call(ins.d, funcs_[ins.a].decl->sig) &&
+             (ins.op == R_CALL || funcs_[ins.a].nresults == fc_.nresults);
+        falls_through = ins.op == R_CALL;
+        break;
+      case R_CALL_INDIRECT:
+      case R_RETURN_CALL_INDIRECT: {
+        const IndirectSite* site = ins.a < fc_.sites.size() ? &fc_.sites[ins.a] : nullptr;
+        const SigDecl* sig = site ? module_.getSig(site->type_index) : nullptr;
+        ok = sig != nullptr && reg(ins.imm.reg) && reg_call(ins.d, sig) &&
+             (ins.op == R_CALL_INDIRECT || sig->results.size() == fc_.nresults);
+        falls_through = ins.op == R_CALL_INDIRECT;
+        break;
+      }
+      case R_SELECT:
+        ok = reg(ins.d) && reg(ins.a) && reg(ins.b) && reg(ins.imm.reg);
+        break;
+      case R_GLOBAL_GET:
+        ok = reg(ins.d) && global(ins.a, false);
+        break;
+      case R_GLOBAL_SET:
+        ok = reg(ins.a) && global(ins.b, true);
+        break;
+      case R_I32_LOAD:
+        ok = reg(ins.d) && reg(ins.a) && memory();
+        break;
+      case R_I32_STORE:
+        ok = reg(ins.a) && reg(ins.b) && memory();
+        break;
+      case R_I32_EQ:
+      case R_I32_LT_S:
+      case R_I32_ADD:
+      case R_I32_SUB:
+      case R_F64_ADD:
+        ok = reg(ins.d) && reg(ins.a) && reg(ins.b);
+        break;
+      default:
+        ok = false;
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return !falls_through;
+}
+
+CacheHeader expected_header(const MappedFile& source, uint64_t hash, size_t num_funcs, bool regvm) {
+  CacheHeader h{};
+  memcpy(h.magic, kCacheMagic, sizeof(h.magic));
+  h.format = VM_CACHE_FORMAT;
+  h.regvm = regvm ? 1 : 0;
+  h.instr_size = sizeof(Instr);
+  h.reg_instr_size = sizeof(RegInstr);
+  h.source_size = source.size();
+  h.source_hash = hash;
+  h.num_funcs = static_cast<uint32_t>(num_funcs);
+  return h;
+}
+
+} // namespace
+
+std::string CompiledModule::cache_path(uint64_t hash) const {
+  char name[48];
+  snprintf(name, sizeof(name), "%016llx.%s.wmc", static_cast<unsigned long long>(hash),
+           regvm() ? "reg" : "stack");
+  return cache_directory() + "/" + name;
+}
+
+bool CompiledModule::load_cache(const std::string& path, uint64_t hash) {
+  auto file = MappedFile::open(path.c_str());
+  if (!file) {
+    return false;
+  }
+  CacheReader in(file->start(), file->end());
+  CacheHeader header;
+  CacheHeader expected = expected_header(*module_.get_source(), hash, funcs_.size(), regvm());
+  expected.file_size = file->size();
+  if (!in.get(&header, 1) || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.format != expected.format || header.regvm != expected.regvm ||
+      header.instr_size != expected.instr_size || header.reg_instr_size != expected.reg_instr_size ||
+      header.source_size != expected.source_size || header.source_hash != expected.source_hash ||
+      header.file_size != expected.file_size || header.num_funcs != expected.num_funcs) {
+    TRACE("module cache: %s is stale\n", path.c_str());
+    return false;
+  }
+
+  std::string invalid;
+  // Bodies are read into a copy of the functions' shapes, which only
+  // replaces them once all of the file has been checked
+  std::vector<FuncCode> funcs = funcs_;
+  bool ok = in.get(invalid, header.invalid_len);
+  for (size_t i = 0; ok && i < funcs.size(); ++i) {
+    FuncRecord rec;
+    FuncCode& fc = funcs[i];
+    ok = in.get(&rec, 1) && in.get(fc.ctrl, rec.num_ctrl) && in.get(fc.code, rec.num_code) &&
+         in.get(fc.rcode, rec.num_rcode) && in.get(fc.sites, rec.num_sites) &&
+         in.get(fc.error, rec.error_len);
+    fc.max_stack = rec.max_stack;
+    fc.nregs = rec.nregs;
+  }
+  if (!ok || !in.done()) {
+    TRACE("module cache: %s is malformed\n", path.c_str());
+    return false;
+  }
+  // An invalid module never runs, so only the reason is used
+  for (size_t i = 0; invalid.empty() && i < funcs.size(); ++i) {
+    if (!CodeVerifier(module_, funcs, funcs[i], regvm()).verify()) {
+      TRACE("module cache: %s has bad code for function %zu\n", path.c_str(), i);
+      return false;
+    }
+  }
+
+  invalid_ = std::move(invalid);
+  funcs_ = std::move(funcs);
+  return true;
+}
+
+void CompiledModule::store_cache(const std::string& path, uint64_t hash) const {
+  CacheWriter out;
+  CacheHeader header = expected_header(*module_.get_source(), hash, funcs_.size(), regvm());
+  header.invalid_len = static_cast<uint32_t>(invalid_.size());
+  out.put(&header, 1);
+  out.put(invalid_.data(), invalid_.size());
+  for (const FuncCode& fc : funcs_) {
+    FuncRecord rec{};
+    rec.max_stack = fc.max_stack;
+    rec.nregs = fc.nregs;
+    rec.num_ctrl = static_cast<uint32_t>(fc.ctrl.size());
+    rec.num_code = static_cast<uint32_t>(fc.code.size());
+    rec.num_rcode = static_cast<uint32_t>(fc.rcode.size());
+    rec.num_sites = static_cast<uint32_t>(fc.sites.size());
+    rec.error_len = static_cast<uint32_t>(fc.error.size());
+    out.put(&rec, 1);
+    out.put(fc.ctrl.data(), fc.ctrl.size());
+    out.put(fc.code.data(), fc.code.size());
+    out.put(fc.rcode.data(), fc.rcode.size());
+    out.put(fc.sites.data(), fc.sites.size());
+    out.put(fc.error.data(), fc.error.size());
+  }
+  // The size goes in last, once it is known
+  const uint64_t file_size = out.out().size();
+  memcpy(&out.out()[offsetof(CacheHeader, file_size)], &file_size, sizeof(file_size));
+
+  const std::string dir = cache_directory();
+  if (!make_directories(dir)) {
+    TRACE("module cache: cannot create cache directory %s\n", dir.c_str());
+    return;
+  }
+  // Write under a name of our own and rename into place, so concurrent runs
+  // never see a partial file
+  const std::string temp = path + "." + std::to_string(getpid());
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (file == nullptr) {
+    return;
+  }
+  bool written = fwrite(out.out().data(), 1, out.out().size(), file) == out.out().size();
+  written = (fclose(file) == 0) && written;
+  if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+    unlink(temp.c_str());
+    TRACE("module cache: cannot write %s\n", path.c_str());
+  }
+}
@@ -1,9 +1,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
 
 #include "common.h"
 
@@ -11,6 +18,14 @@
 int g_trace = 0;
 int g_time = 0;
 int g_threads = 0;
+int g_regvm = 0;
+int g_jit = 0;
+int g_jit_threshold = VM_JIT_THRESHOLD;
+int g_aot = 0;
+int g_icache_stats = 0;
+int g_module_cache = 0;
+int g_lazy = 0;
+int g_bounds = 0;
 
 ssize_t load_file(const char* path, uint8_t** start, uint8_t** end) {
   // Open the file for reading.
@@ -32,32 +47,138 @@ ssize_t load_file(const char* path, uint8_t** start, uint8_t** end) {
     return -1;
   }
   
-  // Allocate memory to store the bytes.
-  *start = (uint8_t*)malloc(size);
-  *end = *start + size;
-  off_t remain = size;
-  // Read the bytes from the file until done.
-  for (uint8_t* p = *start; remain > 0; ) {
-    r = read(fd, p, remain);
-    if (r < 0) { // reading failed.
-      close(fd);
-      return -2;
-    }
-    remain -= r;
-    p += r;
+  // Nothing to map; an empty range.
+  if (size == 0) {
+    close(fd);
+    *start = NULL;
+    *end = NULL;
+    return 0;
+  }
+
+  // Map the bytes; pages are read in as the parser touches them, and the
+  // mapping stays valid after the descriptor is closed.
+  void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) { // mapping failed.
+    return -2;
   }
+  *start = (uint8_t*)p;
+  *end = *start + size;
   return (ssize_t)size;
 }
 
 
 ssize_t unload_file(uint8_t** start, uint8_t** end) {
-  free(*start);
+  if (*start != NULL) {
+    munmap(*start, *end - *start);
+  }
   *start = NULL;
   *end = NULL;
   return 0;
 }
 
 
+std::shared_ptr<const MappedFile> MappedFile::open(const char* path) {
+  std::shared_ptr<MappedFile> file(new MappedFile());
+  if (load_file(path, &file->start_, &file->end_) < 0) {
+    return nullptr;
+  }
+  return file;
+}
+
+MappedFile::~MappedFile() {
+  unload_file(&start_, &end_);
+}
+
+
+std::string cache_directory() {
+  if (const char* dir = getenv("WASM_VM_CACHE"); dir != nullptr && *dir != '\0') {
+    return dir;
+  }
+  if (const char* xdg = getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0') {
+    return std::string(xdg) + "/wasm-vm";
+  }
+  if (const char* home = getenv("HOME"); home != nullptr && *home != '\0') {
+    return std::string(home) + "/.cache/wasm-vm";
+  }
+  return "/tmp/wasm-vm-cache";
+}
+
+
+bool make_directories(const std::string& path) {
+  for (size_t pos = 1; pos <= path.size(); ++pos) {
+    if (pos == path.size() || path[pos] == '/') {
+      std::string prefix = path.substr(0, pos);
+      if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+void parallel_for(size_t count, const std::function<void(size_t)>& body) {
+  const size_t workers = std::min(static_cast<size_t>(std::max(g_threads, 1)), count);
+  if (workers <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      body(i);
+    }
+    return;
+  }
+
+  // Indices are handed out one at a time: bodies vary widely in cost, and
+  // each one is far more work than the atomic increment
+  std::atomic<size_t> next{0};
+  std::vector<std::exception_ptr> errors(count);
+  auto work = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      try {
+        body(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  pool.reserve(workers - 1);
+  for (size_t t = 1; t < workers; ++t) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  for (auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+
+// FNV-1a over 8-byte words, then over the tail, with a final avalanche so
+// that every input bit reaches the high bits of the key
+uint64_t hash_bytes(const byte* data, size_t size) {
+  const uint64_t prime = 0x100000001b3ull;
+  uint64_t hash = 0xcbf29ce484222325ull ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * prime;
+    hash ^= hash >> 29;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ data[i]) * prime;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+
 /*** Decode Operations ***/
 
 #define MORE(b) (((b) & 0x80) != 0)
@@ -218,6 +339,16 @@ bytearr read_bytes(buffer_t* buf, uint32_t num_bytes) {
   return bytes;
 }
 
+bytespan read_span(buffer_t* buf, uint32_t num_bytes) {
+  if (buf->ptr + num_bytes > buf->end) {
+    ERR("bytes read out of bounds\n");
+    return bytespan();
+  }
+  bytespan bytes(buf->ptr, num_bytes);
+  buf->ptr += num_bytes;
+  return bytes;
+}
+
 
 
 
@@ -74,7 +74,10 @@ WasmModule& WasmModule::deepcopy(const WasmModule &mod, const char* log_str) {
 
   //
   this->customs = mod.customs;
+  this->source = mod.source;
+  this->fn_names_debug = NULL;
   this->sigs = mod.sigs;
+  this->sig_ids = mod.sig_ids;
 
   this->imports = mod.imports;
 
@@ -119,7 +122,7 @@ WasmModule& WasmModule::deepcopy(const WasmModule &mod, const char* log_str) {
 
 /* Descriptor patching for copy constructor */
 template<typename T>
-void WasmModule::DescriptorPatch (std::list<T> &list, const WasmModule &mod, std::unordered_map<void*, void*> &reassign_cache) {
+void WasmModule::DescriptorPatch (std::deque<T> &list, const WasmModule &mod, std::unordered_map<void*, void*> &reassign_cache) {
   for (auto &v : list) {
     switch (v.kind) {
       case KIND_FUNC: v.desc.func = REASSIGN(v.desc.func, Func, FuncDecl); break;
@@ -143,7 +146,7 @@ void WasmModule::FunctionPatch (const WasmModule &mod, std::unordered_map<void*,
 
 void WasmModule::CustomPatch (const WasmModule &mod, std::unordered_map<void*, void*> &reassign_cache) {
   for (auto &custom : this->customs) {
-    if (custom.name == "name") {
+    if (custom.name == "name" && mod.fn_names_debug) {
       DebugNameDecl &debug = custom.debug;
       if (!debug.func_assoc.empty()) {
         for (auto &name_asc : debug.func_assoc) {
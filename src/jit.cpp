@@ -0,0 +1,1009 @@
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "vm.h"
+
+#if VM_JIT
+#include <sys/mman.h>
+#endif
+
+/* Baseline x86-64 compiler for the stack tier's translated code.
+ *
+ * Each function is compiled in one forward pass over its lowered Instr
+ * stream. A compiled function keeps the stack tier's frame layout in the
+ * value stack ([ locals | header | operands ]), and every operand has a
+ * fixed slot there because validation made its height static. Operands are
+ * tracked by a compile-time value stack whose entries may still be a
+ * register, a constant or an unread local; they are written to their slots
+ * ("flushed") at calls and at control-flow joins, where every entry lives
+ * in memory.
+ *
+ * Register use in compiled code (System V ABI):
+ *   rbx  frame (locals[0])       r12  linear memory base
+ *   r13  linear memory size      r14  JitContext*
+ *   r15  globals                 r11  scratch
+ *   rax rcx rdx rsi rdi r8-r10   value stack entries
+ *
+ * Calls go through the callee's FuncInst::entry, so compiled code, the
+ * interpreter (jit_interp_entry) and the runtime helpers all share the
+ * JitFn convention; a tail call pops its own machine frame and jumps
+ * there. A trap is recorded through jit_trap and its code is returned up
+ * the chain of compiled frames.
+ *
+ * Functions are compiled when they get hot (see WasmVM::tier_up), or all
+ * up front with --jit-threshold 0. A compiled function also gets an entry
+ * at each loop header, through which the interpreter moves a frame that is
+ * still running a hot loop into the compiled code (on-stack replacement). */
+
+ExecMemory::~ExecMemory() {
+#if VM_JIT
+  for (auto& [base, size] : regions_) {
+    munmap(base, size);
+  }
+#endif
+}
+
+#if VM_JIT
+
+byte* ExecMemory::install(const byte* code, size_t size) {
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw std::runtime_error("cannot map memory for compiled code");
+  }
+  byte* base = static_cast<byte*>(p);
+  std::memcpy(base, code, size);
+  if (mprotect(base, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(base, size);
+    throw std::runtime_error("cannot make compiled code executable");
+  }
+  regions_.emplace_back(base, size);
+  return base;
+}
+
+namespace {
+
+enum Reg : uint8_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+enum Xmm : uint8_t { XMM0, XMM1 };
+
+enum Cond : uint8_t {
+  CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+  CC_S = 0x8, CC_L = 0xC, CC_GE = 0xD
+};
+
+/* [base + index + disp]; index is optional */
+struct Mem {
+  Reg base;
+  int32_t disp;
+  int index = -1;
+};
+
+/* Two-operand integer ALU op in its three encodings */
+struct AluOp {
+  uint8_t mr;     // op r/m, reg
+  uint8_t rm;     // op reg, r/m
+  uint8_t ext;    // op r/m, imm32 (0x81 /ext)
+};
+constexpr AluOp ALU_ADD{0x01, 0x03, 0};
+constexpr AluOp ALU_SUB{0x29, 0x2B, 5};
+constexpr AluOp ALU_CMP{0x39, 0x3B, 7};
+constexpr AluOp ALU_AND{0x21, 0x23, 4};
+
+bool fits_i32(int64_t v) {
+  return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+/* Just enough of an x86-64 encoder for the compiler below */
+class Assembler {
+public:
+  std::vector<byte> code;
+
+  size_t pos() const { return code.size(); }
+  void u8(uint8_t b) { code.push_back(b); }
+  void u32(uint32_t v) {
+    for (int i = 0; i < 4; ++i) u8(static_cast<uint8_t>(v >> (8 * i)));
+  }
+  void u64(uint64_t v) {
+    for (int i = 0; i < 8; ++i) u8(static_cast<uint8_t>(v >> (8 * i)));
+  }
+  void patch32(size_t at, uint32_t v) {
+    for (int i = 0; i < 4; ++i) code[at + i] = static_cast<byte>(v >> (8 * i));
+  }
+
+  /* Register-direct ModRM form. {byte_regs} forces a REX prefix so that
+   * registers 4-7 name spl..dil rather than ah..bh */
+  void rr(uint8_t prefix, bool w, std::initializer_list<uint8_t> op, int reg, int rm,
+          bool byte_regs = false) {
+    if (prefix) u8(prefix);
+    uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40 || (byte_regs && (reg >= 4 || rm >= 4))) u8(rex);
+    for (uint8_t b : op) u8(b);
+    u8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  /* Memory ModRM form */
+  void rm(uint8_t prefix, bool w, std::initializer_list<uint8_t> op, int reg, Mem m) {
+    if (prefix) u8(prefix);
+    uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) |
+                  ((m.index >= 0 && (m.index & 8)) ? 2 : 0) | ((m.base & 8) ? 1 : 0);
+    if (rex != 0x40) u8(rex);
+    for (uint8_t b : op) u8(b);
+    int mod = (m.disp == 0 && (m.base & 7) != RBP) ? 0 : (m.disp >= -128 && m.disp <= 127) ? 1 : 2;
+    if (m.index >= 0 || (m.base & 7) == RSP) {
+      int index = m.index >= 0 ? m.index : RSP;  // rsp as index means none
+      u8((mod << 6) | ((reg & 7) << 3) | 4);
+      u8(((index & 7) << 3) | (m.base & 7));
+    } else {
+      u8((mod << 6) | ((reg & 7) << 3) | (m.base & 7));
+    }
+    if (mod == 1) u8(static_cast<uint8_t>(m.disp));
+    if (mod == 2) u32(static_cast<uint32_t>(m.disp));
+  }
+
+  void mov64(Reg d, Reg s) { rr(0, true, {0x89}, s, d); }
+  void mov32(Reg d, Reg s) { rr(0, false, {0x89}, s, d); }
+  void load64(Reg d, Mem m) { rm(0, true, {0x8B}, d, m); }
+  void store64(Mem m, Reg s) { rm(0, true, {0x89}, s, m); }
+  void load32(Reg d, Mem m) { rm(0, false, {0x8B}, d, m); }
+  void store32(Mem m, Reg s) { rm(0, false, {0x89}, s, m); }
+  void store64_imm(Mem m, int32_t v) { rm(0, true, {0xC7}, 0, m); u32(v); }
+  void store32_imm(Mem m, int32_t v) { rm(0, false, {0xC7}, 0, m); u32(v); }
+  void lea(Reg d, Mem m) { rm(0, true, {0x8D}, d, m); }
+  void mov_imm(Reg d, int64_t v) {
+    if (v >= 0 && v <= UINT32_MAX) {
+      // mov r32, imm32 zero-extends
+      if (d & 8) u8(0x41);
+      u8(0xB8 + (d & 7));
+      u32(static_cast<uint32_t>(v));
+    } else if (fits_i32(v)) {
+      rr(0, true, {0xC7}, 0, d);
+      u32(static_cast<uint32_t>(v));
+    } else {
+      u8(0x48 | ((d & 8) ? 1 : 0));
+      u8(0xB8 + (d & 7));
+      u64(static_cast<uint64_t>(v));
+    }
+  }
+  void alu32(AluOp op, Reg d, Reg s) { rr(0, false, {op.mr}, s, d); }
+  void alu32(AluOp op, Reg d, Mem m) { rm(0, false, {op.rm}, d, m); }
+  void alu32(AluOp op, Reg d, int32_t v) { alu_imm(false, op, d, v); }
+  void alu64(AluOp op, Reg d, Reg s) { rr(0, true, {op.mr}, s, d); }
+  void alu64(AluOp op, Reg d, Mem m) { rm(0, true, {op.rm}, d, m); }
+  void alu64(AluOp op, Reg d, int32_t v) { alu_imm(true, op, d, v); }
+  void test32(Reg a, Reg b) { rr(0, false, {0x85}, b, a); }
+  void setcc(Cond cc, Reg d) { rr(0, false, {0x0F, static_cast<uint8_t>(0x90 | cc)}, 0, d, true); }
+  void movzx8(Reg d, Reg s) { rr(0, false, {0x0F, 0xB6}, d, s, true); }
+  void cmov64(Cond cc, Reg d, Reg s) { rr(0, true, {0x0F, static_cast<uint8_t>(0x40 | cc)}, d, s); }
+  void movq_to_xmm(Xmm x, Reg r) { rr(0x66, true, {0x0F, 0x6E}, x, r); }
+  void movq_from_xmm(Reg r, Xmm x) { rr(0x66, true, {0x0F, 0x7E}, x, r); }
+  void addsd(Xmm d, Xmm s) { rr(0xF2, false, {0x0F, 0x58}, d, s); }
+  void inc32(Mem m) { rm(0, false, {0xFF}, 0, m); }
+  void dec32(Mem m) { rm(0, false, {0xFF}, 1, m); }
+  void call(Reg r) { rr(0, false, {0xFF}, 2, r); }
+  void call(Mem m) { rm(0, false, {0xFF}, 2, m); }
+  void jmp(Mem m) { rm(0, false, {0xFF}, 4, m); }
+  void push(Reg r) { if (r & 8) u8(0x41); u8(0x50 + (r & 7)); }
+  void pop(Reg r) { if (r & 8) u8(0x41); u8(0x58 + (r & 7)); }
+  void ret() { u8(0xC3); }
+  void rep_stosq() { u8(0xF3); u8(0x48); u8(0xAB); }
+
+  /* Jumps with a rel32 to be patched; return the position of the rel32 */
+  size_t jmp() { u8(0xE9); u32(0); return pos() - 4; }
+  size_t jcc(Cond cc) { u8(0x0F); u8(0x80 | cc); u32(0); return pos() - 4; }
+  void bind(size_t rel32_at, size_t target) {
+    patch32(rel32_at, static_cast<uint32_t>(target - (rel32_at + 4)));
+  }
+
+private:
+  void alu_imm(bool w, AluOp op, Reg d, int32_t v) {
+    if (v >= -128 && v <= 127) {
+      rr(0, w, {0x83}, op.ext, d);
+      u8(static_cast<uint8_t>(v));
+    } else {
+      rr(0, w, {0x81}, op.ext, d);
+      u32(static_cast<uint32_t>(v));
+    }
+  }
+};
+
+/* A code position that jumps may refer to before it is known */
+struct Label {
+  size_t pos = SIZE_MAX;
+  std::vector<size_t> uses;
+
+  void jump_here(Assembler& as, size_t rel32_at) {
+    if (pos != SIZE_MAX) {
+      as.bind(rel32_at, pos);
+    } else {
+      uses.push_back(rel32_at);
+    }
+  }
+  void bind(Assembler& as) {
+    pos = as.pos();
+    for (size_t at : uses) as.bind(at, pos);
+    uses.clear();
+  }
+};
+
+constexpr Reg kPool[] = {RAX, RCX, RDX, RSI, RDI, R8, R9, R10};
+constexpr uint32_t kNoHeight = UINT32_MAX;
+
+template <typename T>
+int64_t fn_addr(T* fn) {
+  return static_cast<int64_t>(reinterpret_cast<uintptr_t>(fn));
+}
+
+class FunctionCompiler {
+public:
+  FunctionCompiler(Assembler& as, FuncInst& fi, std::vector<FuncInst>& funcs, const WasmModule& module,
+                   BoundsCheck bounds, std::vector<std::pair<uint32_t, size_t>>& osr)
+      : as_(as), fi_(fi), funcs_(funcs), module_(module), bounds_(bounds), osr_(osr),
+        operand_base_(fi.nlocals + VM_FRAME_SLOTS),
+        entry_offset_(static_cast<int32_t>(reinterpret_cast<byte*>(&fi.entry) -
+                                           reinterpret_cast<byte*>(&fi))) {}
+
+  void compile();
+
+private:
+  /* A compile-time operand: where its value is right now */
+  struct Val {
+    enum Kind : uint8_t { Stack, Register, Const, Local } kind;
+    Reg reg;
+    uint32_t local;
+    int64_t imm;      // raw slot bits of a Const
+    uint32_t pos;     // stack position, filled in by pop()
+  };
+
+  Mem slot(uint32_t pos) const { return Mem{RBX, static_cast<int32_t>(8 * (operand_base_ + pos))}; }
+  Mem local(uint32_t idx) const { return Mem{RBX, static_cast<int32_t>(8 * idx)}; }
+  Mem global(uint32_t idx) const { return Mem{R15, static_cast<int32_t>(8 * idx)}; }
+  Mem ctx_field(size_t offset) const { return Mem{R14, static_cast<int32_t>(offset)}; }
+
+  void push(Val v) { stack_.push_back(v); }
+  void push_reg(Reg r) { push(Val{Val::Register, r, 0, 0, 0}); }
+  void push_const(int64_t raw) { push(Val{Val::Const, RAX, 0, raw, 0}); }
+  Val pop() {
+    Val v = stack_.back();
+    stack_.pop_back();
+    v.pos = static_cast<uint32_t>(stack_.size());
+    return v;
+  }
+
+  Reg alloc();
+  void release(const Val& v) {
+    if (v.kind == Val::Register) free_ |= 1u << v.reg;
+  }
+  void store_const(Mem m, int64_t raw);
+  void spill(uint32_t pos);
+  void flush();
+  Reg own(const Val& v);
+  void flush_local(uint32_t idx);
+  void alu32(AluOp op, Reg d, const Val& rhs);
+
+  void enter();
+  void load_context();
+  void prologue();
+  void epilogue();
+  void osr_entry(uint32_t header);
+  void branch_to(uint32_t target, uint32_t height, size_t rel32_at);
+  void emit_return();
+  void tail_call(uint32_t base, uint32_t nparams, Mem entry);
+  void trap(Trap code, const char* detail = nullptr);
+  void trap_if(Cond cc, Label& label) { label.jump_here(as_, as_.jcc(cc)); }
+  void check_address(Reg addr, uint32_t offset);
+  void compare(Cond cc);
+  void compile_instr(const Instr& ins);
+
+  Assembler& as_;
+  FuncInst& fi_;
+  std::vector<FuncInst>& funcs_;
+  const WasmModule& module_;
+  const BoundsCheck bounds_;
+  std::vector<std::pair<uint32_t, size_t>>& osr_;
+  const uint32_t operand_base_;
+  std::vector<Val> stack_;
+  uint32_t free_ = 0;
+  bool reachable_ = true;
+  std::vector<Label> labels_;
+  std::vector<uint32_t> target_height_;
+  std::vector<bool> is_target_;
+  std::vector<bool> is_loop_header_;
+  Label epilogue_;
+  Label trap_memory_;
+  Label trap_unreachable_;
+  Label trap_stack_;
+  Label trap_depth_;
+  Label trap_pending_;
+  int32_t entry_offset_;
+};
+
+Reg FunctionCompiler::alloc() {
+  if (free_ == 0) {
+    // Spill the deepest register entry; it is the least likely to be used next
+    for (uint32_t pos = 0; pos < stack_.size(); ++pos) {
+      if (stack_[pos].kind == Val::Register) {
+        spill(pos);
+        break;
+      }
+    }
+  }
+  for (Reg r : kPool) {
+    if (free_ & (1u << r)) {
+      free_ &= ~(1u << r);
+      return r;
+    }
+  }
+  throw std::runtime_error("jit: out of registers");
+}
+
+void FunctionCompiler::store_const(Mem m, int64_t raw) {
+  if (fits_i32(raw)) {
+    as_.store64_imm(m, static_cast<int32_t>(raw));
+  } else {
+    as_.mov_imm(R11, raw);
+    as_.store64(m, R11);
+  }
+}
+
+/* Write stack entry {pos} to its slot */
+void FunctionCompiler::spill(uint32_t pos) {
+  Val& v = stack_[pos];
+  switch (v.kind) {
+    case Val::Stack:
+      return;
+    case Val::Register:
+      as_.store64(slot(pos), v.reg);
+      release(v);
+      break;
+    case Val::Const:
+      store_const(slot(pos), v.imm);
+      break;
+    case Val::Local:
+      as_.load64(R11, local(v.local));
+      as_.store64(slot(pos), R11);
+      break;
+  }
+  v.kind = Val::Stack;
+}
+
+void FunctionCompiler::flush() {
+  for (uint32_t pos = 0; pos < stack_.size(); ++pos) {
+    spill(pos);
+  }
+}
+
+/* A register holding {v} that the caller may overwrite */
+Reg FunctionCompiler::own(const Val& v) {
+  if (v.kind == Val::Register) {
+    return v.reg;
+  }
+  Reg r = alloc();
+  switch (v.kind) {
+    case Val::Const: as_.mov_imm(r, v.imm); break;
+    case Val::Local: as_.load64(r, local(v.local)); break;
+    default: as_.load64(r, slot(v.pos)); break;
+  }
+  return r;
+}
+
+/* Entries that still refer to local {idx} must be read before it changes */
+void FunctionCompiler::flush_local(uint32_t idx) {
+  for (uint32_t pos = 0; pos < stack_.size(); ++pos) {
+    if (stack_[pos].kind == Val::Local && stack_[pos].local == idx) {
+      spill(pos);
+    }
+  }
+}
+
+void FunctionCompiler::alu32(AluOp op, Reg d, const Val& rhs) {
+  switch (rhs.kind) {
+    case Val::Const: as_.alu32(op, d, static_cast<int32_t>(rhs.imm)); break;
+    case Val::Register: as_.alu32(op, d, rhs.reg); break;
+    case Val::Local: as_.alu32(op, d, local(rhs.local)); break;
+    case Val::Stack: as_.alu32(op, d, slot(rhs.pos)); break;
+  }
+}
+
+/* Save the callee-saved registers and take the arguments; shared by the
+ * function entry and its OSR entries */
+void FunctionCompiler::enter() {
+  // Five pushes on top of the return address keep rsp 16-byte aligned
+  as_.push(RBX);
+  as_.push(R12);
+  as_.push(R13);
+  as_.push(R14);
+  as_.push(R15);
+  as_.mov64(R14, RDI);
+  as_.mov64(RBX, RSI);
+
+  // The epilogue undoes the increment, so the checks leave through it
+  as_.inc32(ctx_field(offsetof(JitContext, depth)));
+  as_.load32(RAX, ctx_field(offsetof(JitContext, depth)));
+  as_.alu32(ALU_CMP, RAX, static_cast<int32_t>(VM_MAX_CALL_DEPTH));
+  trap_if(CC_A, trap_depth_);
+}
+
+void FunctionCompiler::load_context() {
+  as_.load64(R12, ctx_field(offsetof(JitContext, mem)));
+  as_.load64(R13, ctx_field(offsetof(JitContext, mem_bound)));
+  as_.load64(R15, ctx_field(offsetof(JitContext, globals)));
+}
+
+void FunctionCompiler::prologue() {
+  enter();
+  as_.lea(RAX, slot(fi_.max_stack));
+  as_.alu64(ALU_CMP, RAX, ctx_field(offsetof(JitContext, stack_end)));
+  trap_if(CC_A, trap_stack_);
+
+  // Declared locals start at zero
+  const uint32_t declared = fi_.nlocals - fi_.nparams;
+  if (declared > 0) {
+    as_.rr(0, false, {0x31}, RAX, RAX);  // xor eax, eax
+    if (declared <= 8) {
+      for (uint32_t i = fi_.nparams; i < fi_.nlocals; ++i) {
+        as_.store64(local(i), RAX);
+      }
+    } else {
+      as_.lea(RDI, local(fi_.nparams));
+      as_.mov_imm(RCX, declared);
+      as_.rep_stosq();
+    }
+  }
+  load_context();
+}
+
+/* Entry at a loop header for a frame the interpreter has been running. The
+ * interpreter already reserved the frame and set the locals, and at a
+ * header every operand is in its slot, which is what the compiled code
+ * expects there too. */
+void FunctionCompiler::osr_entry(uint32_t header) {
+  osr_.emplace_back(header, as_.pos());
+  enter();
+  load_context();
+  as_.bind(as_.jmp(), labels_[header].pos);
+}
+
+/* Shared exits: the trap stubs record the trap and fall into the epilogue,
+ * which returns eax */
+void FunctionCompiler::epilogue() {
+  Label trap_common;
+  auto stub = [&](Label& label, Trap code) {
+    if (label.uses.empty()) return;
+    label.bind(as_);
+    as_.mov_imm(RSI, static_cast<int64_t>(code));
+    as_.rr(0, false, {0x31}, RDX, RDX);  // no detail
+    trap_common.jump_here(as_, as_.jmp());
+  };
+  stub(trap_memory_, Trap::MemoryOutOfBounds);
+  stub(trap_unreachable_, Trap::Unreachable);
+  stub(trap_stack_, Trap::StackOverflow);
+  stub(trap_depth_, Trap::CallStackExhausted);
+  if (!trap_common.uses.empty()) {
+    trap_common.bind(as_);
+    as_.mov64(RDI, R14);
+    as_.mov_imm(RAX, fn_addr(&WasmVM::jit_trap));
+    as_.call(RAX);
+    epilogue_.jump_here(as_, as_.jmp());
+  }
+  if (!trap_pending_.uses.empty()) {
+    // The runtime has recorded the trap already
+    trap_pending_.bind(as_);
+    as_.mov64(RDI, R14);
+    as_.mov_imm(RAX, fn_addr(&WasmVM::jit_pending_trap));
+    as_.call(RAX);
+  }
+
+  epilogue_.bind(as_);
+  as_.dec32(ctx_field(offsetof(JitContext, depth)));
+  as_.pop(R15);
+  as_.pop(R14);
+  as_.pop(R13);
+  as_.pop(R12);
+  as_.pop(RBX);
+  as_.ret();
+}
+
+/* Control-flow joins see every operand in its slot */
+void FunctionCompiler::branch_to(uint32_t target, uint32_t height, size_t rel32_at) {
+  labels_[target].jump_here(as_, rel32_at);
+  if (target_height_[target] == kNoHeight) {
+    target_height_[target] = height;
+  }
+}
+
+/* Move the results to frame[0..] and leave; the stack must be flushed */
+void FunctionCompiler::emit_return() {
+  const uint32_t height = static_cast<uint32_t>(stack_.size());
+  for (uint32_t i = 0; i < fi_.nresults; ++i) {
+    as_.load64(R11, slot(height - fi_.nresults + i));
+    as_.store64(local(i), R11);
+  }
+  as_.rr(0, false, {0x31}, RAX, RAX);
+  epilogue_.jump_here(as_, as_.jmp());
+}
+
+/* Leave for the entry at {entry}, with the function in rdx, as if it had
+ * been called by this function's caller: the arguments at slot {base} move
+ * down to frame[0..] and this function's machine frame is popped first.
+ * The stack must be flushed. */
+void FunctionCompiler::tail_call(uint32_t base, uint32_t nparams, Mem entry) {
+  for (uint32_t i = 0; i < nparams; ++i) {
+    as_.load64(R11, slot(base + i));
+    as_.store64(local(i), R11);
+  }
+  as_.mov64(RDI, R14);
+  as_.mov64(RSI, RBX);
+  as_.dec32(ctx_field(offsetof(JitContext, depth)));
+  as_.pop(R15);
+  as_.pop(R14);
+  as_.pop(R13);
+  as_.pop(R12);
+  as_.pop(RBX);
+  as_.jmp(entry);
+}
+
+void FunctionCompiler::trap(Trap code, const char* detail) {
+  if (code == Trap::Unreachable && detail == nullptr) {
+    trap_unreachable_.jump_here(as_, as_.jmp());
+    return;
+  }
+  as_.mov64(RDI, R14);
+  as_.mov_imm(RSI, static_cast<int64_t>(code));
+  as_.mov_imm(RDX, fn_addr(detail));
+  as_.mov_imm(RAX, fn_addr(&WasmVM::jit_trap));
+  as_.call(RAX);
+  epilogue_.jump_here(as_, as_.jmp());
+}
+
+/* Turn the i32 address in {addr} into the end of a 4-byte access at
+ * {offset}, kept in bounds the way the memory's BoundsCheck says: compared
+ * against the size in R13, left to the guard pages, or masked with R13 */
+void FunctionCompiler::check_address(Reg addr, uint32_t offset) {
+  as_.mov32(addr, addr);  // zero-extend
+  const int64_t end = (bounds_ == BoundsCheck::Mask) ? offset : static_cast<int64_t>(offset) + 4;
+  if (fits_i32(end)) {
+    as_.alu64(ALU_ADD, addr, static_cast<int32_t>(end));
+  } else {
+    as_.mov_imm(R11, end);
+    as_.alu64(ALU_ADD, addr, R11);
+  }
+  if (bounds_ == BoundsCheck::Explicit) {
+    as_.alu64(ALU_CMP, addr, R13);
+    trap_if(CC_A, trap_memory_);
+  } else if (bounds_ == BoundsCheck::Mask) {
+    as_.alu64(ALU_AND, addr, R13);
+    as_.alu64(ALU_ADD, addr, 4);
+  }
+}
+
+void FunctionCompiler::compare(Cond cc) {
+  Val rhs = pop();
+  Val lhs = pop();
+  Reg r = own(lhs);
+  alu32(ALU_CMP, r, rhs);
+  release(rhs);
+  as_.setcc(cc, r);
+  as_.movzx8(r, r);
+  push_reg(r);
+}
+
+void FunctionCompiler::compile() {
+  const auto& code = fi_.body->code;
+  const size_t n = code.size();
+  labels_.resize(n + 1);
+  target_height_.assign(n + 1, kNoHeight);
+  is_target_.assign(n + 1, false);
+  is_loop_header_.assign(n + 1, false);
+  for (size_t i = 0; i < n; ++i) {
+    const Instr& ins = code[i];
+    switch (ins.op) {
+      case WASM_OP_IF:
+      case WASM_OP_ELSE:
+        is_target_[ins.a] = true;
+        break;
+      case WASM_OP_BR:
+      case WASM_OP_BR_IF:
+      case VM_OP_I32_LT_S_BR_IF:
+      case VM_OP_I32_EQZ_BR_IF:
+        is_target_[ins.imm.br.target] = true;
+        if (ins.imm.br.target <= i) {
+          is_loop_header_[ins.imm.br.target] = true;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  for (Reg r : kPool) free_ |= 1u << r;
+
+  prologue();
+  for (size_t i = 0; i < n; ++i) {
+    if (is_target_[i]) {
+      if (reachable_) {
+        flush();
+      } else if (target_height_[i] != kNoHeight) {
+        // Only reached by branches: every operand is in its slot
+        stack_.assign(target_height_[i], Val{Val::Stack, RAX, 0, 0, 0});
+        reachable_ = true;
+      }
+      labels_[i].bind(as_);
+    }
+    if (reachable_) {
+      compile_instr(code[i]);
+    }
+  }
+  epilogue();
+  for (uint32_t i = 0; i < n; ++i) {
+    if (is_loop_header_[i] && labels_[i].pos != SIZE_MAX) {
+      osr_entry(i);
+    }
+  }
+}
+
+void FunctionCompiler::compile_instr(const Instr& ins) {
+  switch (ins.op) {
+    case WASM_OP_NOP:
+      break;
+    case WASM_OP_UNREACHABLE:
+      trap(Trap::Unreachable);
+      reachable_ = false;
+      break;
+    case WASM_OP_I32_CONST:
+      push_const(ins.imm.i32);
+      break;
+    case WASM_OP_I64_CONST:
+      push_const(ins.imm.i64);
+      break;
+    case WASM_OP_F32_CONST: {
+      Slot s{};
+      s.f32 = ins.imm.f32;
+      push_const(static_cast<int64_t>(s.raw));
+      break;
+    }
+    case WASM_OP_F64_CONST: {
+      Slot s{};
+      s.f64 = ins.imm.f64;
+      push_const(static_cast<int64_t>(s.raw));
+      break;
+    }
+    case WASM_OP_LOCAL_GET:
+      push(Val{Val::Local, RAX, ins.a, 0, 0});
+      break;
+    case WASM_OP_LOCAL_SET:
+    case WASM_OP_LOCAL_TEE: {
+      flush_local(ins.a);
+      Val v = pop();
+      if (v.kind == Val::Const) {
+        store_const(local(ins.a), v.imm);
+        if (ins.op == WASM_OP_LOCAL_TEE) push(v);
+        break;
+      }
+      Reg r = own(v);
+      as_.store64(local(ins.a), r);
+      if (ins.op == WASM_OP_LOCAL_TEE) {
+        push_reg(r);
+      } else {
+        free_ |= 1u << r;
+      }
+      break;
+    }
+    case WASM_OP_GLOBAL_GET: {
+      Reg r = alloc();
+      as_.load64(r, global(ins.a));
+      push_reg(r);
+      break;
+    }
+    case WASM_OP_GLOBAL_SET: {
+      Val v = pop();
+      if (v.kind == Val::Const) {
+        store_const(global(ins.a), v.imm);
+        break;
+      }
+      Reg r = own(v);
+      as_.store64(global(ins.a), r);
+      free_ |= 1u << r;
+      break;
+    }
+    case WASM_OP_DROP:
+      release(pop());
+      break;
+    case WASM_OP_SELECT: {
+      Val cond = pop();
+      Val b = pop();
+      Val a = pop();
+      Reg ra = own(a);
+      Reg rb = own(b);
+      Reg rc = own(cond);
+      as_.test32(rc, rc);
+      as_.cmov64(CC_E, ra, rb);
+      free_ |= (1u << rb) | (1u << rc);
+      push_reg(ra);
+      break;
+    }
+    case WASM_OP_I32_EQZ: {
+      Reg r = own(pop());
+      as_.test32(r, r);
+      as_.setcc(CC_E, r);
+      as_.movzx8(r, r);
+      push_reg(r);
+      break;
+    }
+    case WASM_OP_I32_EQ:
+      compare(CC_E);
+      break;
+    case WASM_OP_I32_LT_S:
+      compare(CC_L);
+      break;
+    case WASM_OP_I32_ADD:
+    case WASM_OP_I32_SUB:
+    case VM_OP_LOCAL_GET2_I32_ADD:
+    case VM_OP_LOCAL_GET_I32_CONST_ADD: {
+      // Superinstructions are taken apart again; the value stack already
+      // keeps their operands out of memory
+      if (ins.op == VM_OP_LOCAL_GET2_I32_ADD) {
+        push(Val{Val::Local, RAX, ins.a, 0, 0});
+        push(Val{Val::Local, RAX, ins.imm.b, 0, 0});
+      } else if (ins.op == VM_OP_LOCAL_GET_I32_CONST_ADD) {
+        push(Val{Val::Local, RAX, ins.a, 0, 0});
+        push_const(ins.imm.i32);
+      }
+      Val rhs = pop();
+      Val lhs = pop();
+      Reg r = own(lhs);
+      alu32(ins.op == WASM_OP_I32_SUB ? ALU_SUB : ALU_ADD, r, rhs);
+      release(rhs);
+      push_reg(r);
+      break;
+    }
+    case WASM_OP_F64_ADD: {
+      Val rhs = pop();
+      Val lhs = pop();
+      Reg ra = own(lhs);
+      Reg rb = own(rhs);
+      as_.movq_to_xmm(XMM0, ra);
+      as_.movq_to_xmm(XMM1, rb);
+      as_.addsd(XMM0, XMM1);
+      as_.movq_from_xmm(ra, XMM0);
+      free_ |= 1u << rb;
+      push_reg(ra);
+      break;
+    }
+    case WASM_OP_I32_LOAD:
+    case VM_OP_LOCAL_GET_I32_LOAD: {
+      uint32_t offset = ins.a;
+      if (ins.op == VM_OP_LOCAL_GET_I32_LOAD) {
+        push(Val{Val::Local, RAX, ins.a, 0, 0});
+        offset = ins.imm.b;
+      }
+      Reg r = own(pop());
+      check_address(r, offset);
+      as_.load32(r, Mem{R12, -4, r});
+      push_reg(r);
+      break;
+    }
+    case WASM_OP_I32_STORE: {
+      Val v = pop();
+      Reg r = own(pop());
+      check_address(r, ins.a);
+      if (v.kind == Val::Const) {
+        as_.store32_imm(Mem{R12, -4, r}, static_cast<int32_t>(v.imm));
+      } else {
+        Reg rv = own(v);
+        as_.store32(Mem{R12, -4, r}, rv);
+        free_ |= 1u << rv;
+      }
+      free_ |= 1u << r;
+      break;
+    }
+    case WASM_OP_IF: {
+      Reg r = own(pop());
+      flush();
+      as_.test32(r, r);
+      free_ |= 1u << r;
+      branch_to(ins.a, static_cast<uint32_t>(stack_.size()), as_.jcc(CC_E));
+      break;
+    }
+    case WASM_OP_ELSE:
+      flush();
+      branch_to(ins.a, static_cast<uint32_t>(stack_.size()), as_.jmp());
+      reachable_ = false;
+      break;
+    case WASM_OP_BR:
+      flush();
+      branch_to(ins.imm.br.target, ins.imm.br.height, as_.jmp());
+      reachable_ = false;
+      break;
+    case WASM_OP_BR_IF:
+    case VM_OP_I32_EQZ_BR_IF: {
+      Reg r = own(pop());
+      flush();
+      as_.test32(r, r);
+      free_ |= 1u << r;
+      Cond cc = (ins.op == WASM_OP_BR_IF) ? CC_NE : CC_E;
+      branch_to(ins.imm.br.target, ins.imm.br.height, as_.jcc(cc));
+      break;
+    }
+    case VM_OP_I32_LT_S_BR_IF: {
+      Val rhs = pop();
+      Reg r = own(pop());
+      flush();
+      alu32(ALU_CMP, r, rhs);
+      release(rhs);
+      free_ |= 1u << r;
+      branch_to(ins.imm.br.target, ins.imm.br.height, as_.jcc(CC_L));
+      break;
+    }
+    case WASM_OP_RETURN:
+    case WASM_OP_END:
+      flush();
+      emit_return();
+      reachable_ = false;
+      break;
+    case VM_OP_RETURN_IF: {
+      Reg r = own(pop());
+      flush();
+      as_.test32(r, r);
+      free_ |= 1u << r;
+      size_t skip = as_.jcc(CC_E);
+      emit_return();
+      as_.bind(skip, as_.pos());
+      break;
+    }
+    case WASM_OP_CALL: {
+      FuncInst& callee = funcs_[ins.a];
+      flush();
+      const uint32_t base = static_cast<uint32_t>(stack_.size()) - callee.nparams;
+      as_.mov64(RDI, R14);
+      as_.lea(RSI, slot(base));
+      as_.mov_imm(RDX, fn_addr(&callee));
+      as_.mov_imm(RAX, fn_addr(&callee.entry));
+      as_.call(Mem{RAX, 0});
+      as_.test32(RAX, RAX);
+      epilogue_.jump_here(as_, as_.jcc(CC_NE));
+      stack_.resize(base);
+      stack_.resize(base + callee.nresults, Val{Val::Stack, RAX, 0, 0, 0});
+      break;
+    }
+    case WASM_OP_CALL_INDIRECT: {
+      // The runtime resolves the target through the site's inline cache;
+      // the call itself is made from here so that indirect recursion costs
+      // no helper frames
+      const SigDecl* sig = module_.getSig(ins.a);
+      flush();
+      const uint32_t index_pos = static_cast<uint32_t>(stack_.size()) - 1;
+      const uint32_t base = index_pos - static_cast<uint32_t>(sig->params.size());
+      as_.mov64(RDI, R14);
+      as_.mov_imm(RSI, fn_addr(&fi_.icaches[ins.imm.call.site]));
+      as_.load32(RDX, slot(index_pos));
+      as_.mov_imm(RAX, fn_addr(&WasmVM::jit_resolve_indirect));
+      as_.call(RAX);
+      as_.alu64(ALU_CMP, RAX, 0);
+      trap_if(CC_E, trap_pending_);
+      as_.mov64(RDX, RAX);
+      as_.mov64(RDI, R14);
+      as_.lea(RSI, slot(base));
+      as_.call(Mem{RAX, entry_offset_});
+      as_.test32(RAX, RAX);
+      epilogue_.jump_here(as_, as_.jcc(CC_NE));
+      stack_.resize(base);
+      stack_.resize(base + sig->results.size(), Val{Val::Stack, RAX, 0, 0, 0});
+      break;
+    }
+    case WASM_OP_RETURN_CALL: {
+      FuncInst& callee = funcs_[ins.a];
+      flush();
+      as_.mov_imm(RDX, fn_addr(&callee));
+      as_.mov_imm(RAX, fn_addr(&callee.entry));
+      tail_call(static_cast<uint32_t>(stack_.size()) - callee.nparams, callee.nparams, Mem{RAX, 0});
+      reachable_ = false;
+      break;
+    }
+    case WASM_OP_RETURN_CALL_INDIRECT: {
+      const SigDecl* sig = module_.getSig(ins.a);
+      const uint32_t nparams = static_cast<uint32_t>(sig->params.size());
+      flush();
+      const uint32_t index_pos = static_cast<uint32_t>(stack_.size()) - 1;
+      as_.mov64(RDI, R14);
+      as_.mov_imm(RSI, fn_addr(&fi_.icaches[ins.imm.call.site]));
+      as_.load32(RDX, slot(index_pos));
+      as_.mov_imm(RAX, fn_addr(&WasmVM::jit_resolve_indirect));
+      as_.call(RAX);
+      as_.alu64(ALU_CMP, RAX, 0);
+      trap_if(CC_E, trap_pending_);
+      as_.mov64(RDX, RAX);
+      tail_call(index_pos - nparams, nparams, Mem{RAX, entry_offset_});
+      reachable_ = false;
+      break;
+    }
+    default: {
+      Opcode_t opcode = (ins.op == VM_OP_UNSUPPORTED) ? ins.a : ins.op;
+      trap(Trap::UnsupportedOpcode, opcode_table[opcode].mnemonic);
+      reachable_ = false;
+      break;
+    }
+  }
+}
+
+} // namespace
+
+/* Compile {funcs} into one executable region. A function that cannot be
+ * compiled keeps its interpreter entry, which traps for it just as the
+ * interpreter would if the body failed to prepare. */
+void WasmVM::compile_jit(const std::vector<FuncInst*>& funcs) {
+  struct Compiled {
+    FuncInst* fi;
+    size_t start;
+    std::vector<std::pair<uint32_t, size_t>> osr;
+  };
+  Assembler as;
+  std::vector<Compiled> compiled;
+  for (FuncInst* fi : funcs) {
+    if (fi->error != nullptr || fi->body->code.empty()) {
+      continue;
+    }
+    Compiled c{fi, as.pos(), {}};
+    try {
+      FunctionCompiler(as, *fi, function_instances_, module_, memory_.strategy(), c.osr).compile();
+      compiled.push_back(std::move(c));
+    } catch (const std::exception& e) {
+      as.code.resize(c.start);
+      TRACE("Function %td left to the interpreter: %s\n", fi - function_instances_.data(), e.what());
+    }
+  }
+  if (compiled.empty()) {
+    return;
+  }
+  byte* base = jit_memory_.install(as.code.data(), as.code.size());
+  for (auto& c : compiled) {
+    c.fi->entry = reinterpret_cast<JitFn>(base + c.start);
+    for (auto& [pc, offset] : c.osr) {
+      c.fi->osr_entries.push_back(OsrEntry{pc, reinterpret_cast<JitFn>(base + offset)});
+    }
+  }
+  TRACE("Compiled %zu functions into %zu bytes of native code\n", compiled.size(), as.code.size());
+}
+
+JitFn WasmVM::osr_entry(FuncInst* f, const Instr* header) {
+  const uint32_t pc = static_cast<uint32_t>(header - f->code);
+  for (const auto& entry : f->osr_entries) {
+    if (entry.pc == pc) {
+      return entry.fn;
+    }
+  }
+  return nullptr;
+}
+
+FuncInst* WasmVM::jit_resolve_indirect(JitContext* ctx, IndirectCache* cache, int32_t elem_index) {
+  return ctx->vm->resolve_cached(*cache, elem_index);
+}
+
+uint32_t WasmVM::jit_pending_trap(JitContext* ctx) {
+  return static_cast<uint32_t>(ctx->vm->trap_);
+}
+
+#endif // VM_JIT
+
+#if VM_NATIVE
+/* Called when an interpreted function reaches the tier-up threshold. Only
+ * --jit sets one; builds and modes without the compiler just restart the
+ * count. */
+bool WasmVM::tier_up(FuncInst* f) {
+#if VM_JIT
+  if (tier_threshold_ != UINT32_MAX) {
+    TRACE("Function %td is hot (%u calls and back-edges), compiling\n",
+          f - function_instances_.data(), f->hotness);
+    compile_jit({f});
+    if (f->entry != &WasmVM::jit_interp_entry) {
+      return true;
+    }
+  }
+#endif
+  // Not compilable; count again rather than retrying on every call
+  f->hotness = 0;
+  return false;
+}
+#endif
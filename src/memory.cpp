@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "wasmdefs.h"
+
+namespace {
+
+/* An i32 address plus an u32 offset plus the access size stays below this,
+ * so with guard pages no access can leave the reservation */
+const uint64_t kGuardReservation = (uint64_t{1} << 33) + WASM_PAGE_SIZE;
+
+/* Alternate signal stack of a thread that runs guarded code, at least */
+const size_t kAltStackSize = 64 * 1024;
+
+/* Where a fault in a guarded memory resumes; see run_guarded */
+struct FaultLanding {
+  sigjmp_buf env;
+  const LinearMemory* memory;
+  FaultLanding* outer;
+};
+
+thread_local FaultLanding* fault_landing = nullptr;
+
+struct sigaction previous_segv;
+struct sigaction previous_bus;
+
+void on_fault(int sig, siginfo_t* info, void* context) {
+  FaultLanding* landing = fault_landing;
+  if (landing != nullptr && landing->memory->reserves(info->si_addr)) {
+    siglongjmp(landing->env, 1);
+  }
+  // Not an access to a guarded memory: hand it to whoever had it before,
+  // or let it fault again with the default action
+  const struct sigaction& previous = (sig == SIGSEGV) ? previous_segv : previous_bus;
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(sig, info, context);
+  } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(sig);
+  } else {
+    sigaction(sig, &previous, nullptr);
+  }
+}
+
+void install_fault_handler() {
+  static std::once_flag installed;
+  std::call_once(installed, [] {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_fault;
+    // On the alternate stack: a fault that is a stack overflow still finds
+    // room for this handler and the ones it hands faults to
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv);
+    sigaction(SIGBUS, &action, &previous_bus);
+  });
+}
+
+/* Anonymous private mapping of {size} bytes, or null */
+byte* map(uint64_t size, int prot) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | (prot == PROT_NONE ? MAP_NORESERVE : 0);
+  void* p = mmap(nullptr, size, prot, flags, -1, 0);
+  return p == MAP_FAILED ? nullptr : static_cast<byte*>(p);
+}
+
+/* The calling thread's alternate signal stack, unless it already has one;
+ * made on the first guarded run of each thread and freed with the thread */
+class AltStack {
+public:
+  AltStack() {
+    stack_t current;
+    if (sigaltstack(nullptr, &current) == 0 && !(current.ss_flags & SS_DISABLE)) {
+      return;
+    }
+    size_ = std::max<size_t>(SIGSTKSZ, kAltStackSize);
+    base_ = map(size_, PROT_READ | PROT_WRITE);
+    if (base_ == nullptr) {
+      return;
+    }
+    stack_t stack;
+    memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = base_;
+    stack.ss_size = size_;
+    if (sigaltstack(&stack, nullptr) != 0) {
+      munmap(base_, size_);
+      base_ = nullptr;
+    }
+  }
+  ~AltStack() {
+    if (base_ == nullptr) {
+      return;
+    }
+    stack_t disable;
+    memset(&disable, 0, sizeof(disable));
+    disable.ss_flags = SS_DISABLE;
+    sigaltstack(&disable, nullptr);
+    munmap(base_, size_);
+  }
+  AltStack(const AltStack&) = delete;
+  AltStack& operator=(const AltStack&) = delete;
+
+private:
+  byte* base_ = nullptr;
+  size_t size_ = 0;
+};
+
+void install_alt_stack() {
+  thread_local AltStack stack;
+}
+
+} // namespace
+
+const char* bounds_check_name(BoundsCheck bounds) {
+  switch (bounds) {
+    case BoundsCheck::Explicit: return "explicit";
+    case BoundsCheck::GuardPages: return "guard";
+    case BoundsCheck::Mask: return "mask";
+  }
+  return "unknown";
+}
+
+bool parse_bounds_check(const char* name, BoundsCheck& bounds) {
+  for (auto b : {BoundsCheck::Explicit, BoundsCheck::GuardPages, BoundsCheck::Mask}) {
+    if (strcmp(name, bounds_check_name(b)) == 0) {
+      bounds = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+LinearMemory::LinearMemory(BoundsCheck bounds) : strategy_(bounds) {
+  if (strategy_ != BoundsCheck::GuardPages) {
+    return;
+  }
+  // The reservation is made once; reset() only changes what is accessible
+  base_ = map(kGuardReservation, PROT_NONE);
+  if (base_ == nullptr) {
+    TRACE("cannot reserve %llu bytes for guard pages; checking bounds explicitly\n",
+          static_cast<unsigned long long>(kGuardReservation));
+    strategy_ = BoundsCheck::Explicit;
+    return;
+  }
+  mapped_ = kGuardReservation;
+  install_fault_handler();
+}
+
+LinearMemory::~LinearMemory() {
+  unmap();
+}
+
+void LinearMemory::unmap() {
+  if (base_ != nullptr) {
+    munmap(base_, mapped_);
+  }
+  base_ = nullptr;
+  mapped_ = 0;
+}
+
+void LinearMemory::reset(uint32_t pages) {
+  const uint64_t size = static_cast<uint64_t>(pages) * WASM_PAGE_SIZE;
+  switch (strategy_) {
+    case BoundsCheck::Explicit: {
+      unmap();
+      if (size > 0) {
+        base_ = map(size, PROT_READ | PROT_WRITE);
+        mapped_ = size;
+      }
+      break;
+    }
+    case BoundsCheck::GuardPages: {
+      // Dropping the pages zeroes them; the rest of the reservation stays
+      // inaccessible
+      if (size_ > 0) {
+        madvise(base_, size_, MADV_DONTNEED);
+        mprotect(base_, size_, PROT_NONE);
+      }
+      if (size > 0 && mprotect(base_, size, PROT_READ | PROT_WRITE) != 0) {
+        throw std::runtime_error("cannot commit linear memory");
+      }
+      break;
+    }
+    case BoundsCheck::Mask: {
+      // The smallest power of two covering the memory, and room past it
+      // for an access at the last masked address
+      uint64_t capacity = WASM_PAGE_SIZE;
+      while (capacity < size) {
+        capacity <<= 1;
+      }
+      unmap();
+      base_ = map(capacity + WASM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+      if (base_ == nullptr) {
+        throw std::runtime_error("cannot map linear memory");
+      }
+      mapped_ = capacity + WASM_PAGE_SIZE;
+      mask_ = capacity - 1;
+      break;
+    }
+  }
+  if (size > 0 && base_ == nullptr) {
+    throw std::runtime_error("cannot map linear memory");
+  }
+  size_ = size;
+}
+
+bool run_guarded(const LinearMemory& memory, const std::function<void()>& body) {
+  if (memory.strategy() != BoundsCheck::GuardPages) {
+    body();
+    return true;
+  }
+  install_alt_stack();
+  FaultLanding landing;
+  landing.memory = &memory;
+  landing.outer = fault_landing;
+  // Saving the signal mask restores it on the way out of the handler,
+  // which would otherwise leave the fault signal blocked
+  if (sigsetjmp(landing.env, 1) != 0) {
+    fault_landing = landing.outer;
+    return false;
+  }
+  fault_landing = &landing;
+  body();
+  fault_landing = landing.outer;
+  return true;
+}
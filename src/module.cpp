@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vm.h"
+#include "validate.h"
+
+std::shared_ptr<const CompiledModule> CompiledModule::compile(WasmModule module,
+                                                              CompileOptions options) {
+  return std::shared_ptr<const CompiledModule>(new CompiledModule(std::move(module), options));
+}
+
+CompiledModule::CompiledModule(WasmModule&& module, const CompileOptions& options)
+    : module_(std::move(module)), options_(options) {
+  cache_layout();
+  prepare_functions();
+}
+
+void CompiledModule::cache_layout() {
+  if (module_.get_num_mems() > module_.get_num_imported_mems()) {
+    auto idx = module_.get_num_imported_mems();
+    initial_memory_pages_ = module_.getMemory(idx)->limits.initial;
+  }
+
+  const uint32_t total_tables = module_.get_num_tables();
+  const uint32_t imported_tables = module_.get_num_imported_tables();
+  if (total_tables > imported_tables) {
+    local_table_sizes_.reserve(total_tables - imported_tables);
+    for (auto idx = imported_tables; idx < total_tables; idx++) {
+      local_table_sizes_.push_back(module_.getTable(idx)->limits.initial);
+    }
+  }
+
+  const auto& exports = module_.Exports();
+  auto it = std::find_if(exports.begin(), exports.end(),
+      [](auto const& exp) { return exp.name == "main" && exp.kind == KIND_FUNC; });
+  main_ = (it != exports.end()) ? it->desc.func : nullptr;
+}
+
+void CompiledModule::prepare_functions() {
+  auto& decls = module_.Funcs();
+  funcs_.resize(decls.size());
+  for (size_t i = 0; i < decls.size(); ++i) {
+    auto& fc = funcs_[i];
+    fc.decl = &decls[i];
+    fc.nparams = static_cast<uint32_t>(fc.decl->sig->params.size());
+    fc.nlocals = fc.nparams + fc.decl->num_pure_locals;
+    fc.nresults = static_cast<uint32_t>(fc.decl->sig->results.size());
+  }
+
+  // Under --module-cache, a module seen before skips straight to its
+  // translated bodies
+  std::string cached;
+  uint64_t hash = 0;
+  if (options_.module_cache && module_.get_source() != nullptr) {
+    hash = hash_bytes(module_.get_source()->start(), module_.get_source()->size());
+    cached = cache_path(hash);
+  }
+  if (!cached.empty() && load_cache(cached, hash)) {
+    TRACE("module cache: using %s\n", cached.c_str());
+    return;
+  }
+
+  // Under --lazy, bodies wait for their first call; see prepare()
+  if (options_.lazy) {
+    lazy_ = true;
+    prepared_.reset(new std::once_flag[decls.size()]);
+    return;
+  }
+
+  // Validate and translate once every index is known so calls can be
+  // resolved up front. Bodies only read the module and each other's shapes,
+  // so they are spread over the --threads workers; each writes nothing but
+  // its own FuncCode, which keeps the result the same for any number of
+  // them. An invalid body rejects the whole module, reported for the first
+  // one; anything else that fails is deferred to the first call, which is
+  // where it used to trap.
+  std::vector<std::string> rejected(decls.size());
+  parallel_for(decls.size(), [&](size_t i) {
+    rejected[i] = prepare_function(funcs_[i]);
+  });
+  auto first = std::find_if(rejected.begin(), rejected.end(),
+      [](const std::string& why) { return !why.empty(); });
+  if (first != rejected.end()) {
+    invalid_ = *first;
+  }
+  if (!cached.empty()) {
+    store_cache(cached, hash);
+  }
+}
+
+std::string CompiledModule::prepare_function(FuncCode& fc) const {
+  if (module_.isImport(fc.decl)) {
+    fc.error = "calling an imported function is not supported";
+    return "";
+  }
+  try {
+    fc.max_stack = validate_function(module_, fc.decl);
+    translate_function(fc);
+    // The register tier is lowered from the unfused stream
+    if (options_.regvm) {
+      translate_function_reg(fc);
+    } else {
+      lower_structured_control(fc);
+      fuse_superinstructions(fc);
+    }
+  } catch (const ValidationError& e) {
+    return e.what();
+  } catch (const std::exception& e) {
+    fc.code.clear();
+    fc.rcode.clear();
+    fc.error = e.what();
+  }
+  return "";
+}
+
+const FuncCode& CompiledModule::prepare(uint32_t index) const {
+  if (lazy_) {
+    // Whichever caller gets here first prepares the body, and nobody reads
+    // it before then
+    std::call_once(prepared_[index], [this, index] {
+      auto& fc = funcs_[index];
+      std::string invalid = prepare_function(fc);
+      if (!invalid.empty()) {
+        fc.code.clear();
+        fc.rcode.clear();
+        fc.error = "invalid function: " + invalid;
+      }
+    });
+  }
+  return funcs_[index];
+}
+
+void CompiledModule::skip_immediate(Opcode_t opcode, buffer_t &buf) {
+  switch (opcode) {
+    case WASM_OP_BLOCK:
+    case WASM_OP_LOOP:
+    case WASM_OP_IF: {
+      RD_BYTE();
+      break;
+    }
+    case WASM_OP_BR:
+    case WASM_OP_BR_IF:
+    case WASM_OP_CALL:
+    case WASM_OP_RETURN_CALL:
+    case WASM_OP_LOCAL_GET:
+    case WASM_OP_LOCAL_SET:
+    case WASM_OP_LOCAL_TEE:
+    case WASM_OP_GLOBAL_GET:
+    case WASM_OP_GLOBAL_SET:
+    case WASM_OP_MEMORY_SIZE:
+    case WASM_OP_MEMORY_GROW: {
+      RD_U32();
+      break;
+    }
+    case WASM_OP_CALL_INDIRECT:
+    case WASM_OP_RETURN_CALL_INDIRECT: {
+      RD_U32();
+      RD_U32();
+      break;
+    }
+    case WASM_OP_BR_TABLE: {
+      uint32_t target_count = RD_U32();
+      for (uint32_t i = 0; i < target_count; ++i) {
+        RD_U32();
+      }
+      RD_U32();
+      break;
+    }
+    case WASM_OP_I32_LOAD:
+    case WASM_OP_I64_LOAD:
+    case WASM_OP_F32_LOAD:
+    case WASM_OP_F64_LOAD:
+    case WASM_OP_I32_LOAD8_S:
+    case WASM_OP_I32_LOAD8_U:
+    case WASM_OP_I32_LOAD16_S:
+    case WASM_OP_I32_LOAD16_U:
+    case WASM_OP_I32_STORE:
+    case WASM_OP_I64_STORE:
+    case WASM_OP_F32_STORE:
+    case WASM_OP_F64_STORE:
+    case WASM_OP_I32_STORE8:
+    case WASM_OP_I32_STORE16: {
+      RD_U32();
+      RD_U32();
+      break;
+    }
+    case WASM_OP_I32_CONST: {
+      RD_I32();
+      break;
+    }
+    case WASM_OP_I64_CONST: {
+      RD_I64();
+      break;
+    }
+    case WASM_OP_F32_CONST: {
+      RD_U32_RAW();
+      break;
+    }
+    case WASM_OP_F64_CONST: {
+      RD_U64_RAW();
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+CtrlTable CompiledModule::pre_indexing(const FuncDecl* f) const {
+  CtrlTable table;
+  // Indices into {table} of the constructs that are still open
+  std::vector<uint32_t> ctrl_stack;
+  bool function_open = true;
+  const auto& bytes = f->code_bytes;
+  auto buf = buffer_t{bytes.data(), bytes.data(), bytes.data() + bytes.size()};
+  while (buf.ptr < buf.end) {
+    const byte* opcode_ptr = buf.ptr;
+    if (!function_open) {
+      throw std::runtime_error("end without matching block/loop/if");
+    }
+    Opcode_t opcode = RD_OPCODE();
+    TRACE_INSTR("Pre-indexing opcode: %s at offset %ld\n", opcode_table[opcode].mnemonic, opcode_ptr - bytes.data());
+    switch (opcode) {
+      case WASM_OP_LOOP:
+      case WASM_OP_IF:
+      case WASM_OP_BLOCK: {
+        // MVP only supports the empty blocktype (0x40). Consume it and push a label.
+        uint8_t block_type = RD_BYTE();
+        if (block_type != 0x40) {
+          throw std::runtime_error("non-empty blocktype is not supported");
+        }
+        CtrlMeta meta{};
+        meta.header = static_cast<uint32_t>(opcode_ptr - bytes.data());
+        meta.else_pc = 0;
+        meta.end = 0; // to be filled when matching END is seen
+        switch (opcode) {
+          case WASM_OP_LOOP:
+            meta.kind = Label::Kind::Loop;
+            break;
+          case WASM_OP_IF:
+            meta.kind = Label::Kind::If;
+            break;
+          case WASM_OP_BLOCK:
+            meta.kind = Label::Kind::Block;
+            break;
+          default:
+            throw std::runtime_error("unreachable");
+        }
+        ctrl_stack.push_back(static_cast<uint32_t>(table.size()));
+        table.push_back(meta);
+        break;
+      }
+      case WASM_OP_ELSE: {
+        if (ctrl_stack.empty() || table[ctrl_stack.back()].kind != Label::Kind::If) {
+          throw std::runtime_error("else without matching if");
+        }
+        table[ctrl_stack.back()].else_pc = static_cast<uint32_t>(buf.ptr - bytes.data());
+        break;
+      }
+      case WASM_OP_END: {
+        if (ctrl_stack.empty()) {
+          // Closes the function body itself
+          function_open = false;
+          break;
+        }
+        table[ctrl_stack.back()].end = static_cast<uint32_t>(opcode_ptr - bytes.data());
+        ctrl_stack.pop_back();
+        break;
+      }
+      default:
+        skip_immediate(opcode, buf);
+        break;
+    }
+  }
+  if (!ctrl_stack.empty() || function_open) {
+    throw std::runtime_error("unmatched block/loop/if");
+  }
+  return table;
+}
@@ -17,6 +17,8 @@ opcode_entry_t opcode_table[] = {
   [WASM_OP_RETURN]		= {"return" },
   [WASM_OP_CALL]		= {"call", IMM_FUNC },
   [WASM_OP_CALL_INDIRECT]	= {"call_indirect", IMM_SIG_TABLE },
+  [WASM_OP_RETURN_CALL]		= {"return_call", IMM_FUNC },
+  [WASM_OP_RETURN_CALL_INDIRECT]= {"return_call_indirect", IMM_SIG_TABLE },
   [WASM_OP_DROP]		= {"drop" },
   [WASM_OP_SELECT]		= {"select" },
   [WASM_OP_LOCAL_GET]		= {"local.get", IMM_LOCAL },
@@ -187,8 +189,6 @@ opcode_entry_t opcode_table[] = {
   [WASM_OP_CATCH]		= {"catch", IMM_TAG, -1},
   [WASM_OP_THROW]		= {"throw", IMM_TAG, -1},
   [WASM_OP_RETHROW]		= {"rethrow", IMM_NONE, -1},
-  [WASM_OP_RETURN_CALL]		= {"return_call", IMM_FUNC, -1},
-  [WASM_OP_RETURN_CALL_INDIRECT]= {"return_call_indirect", IMM_SIG_TABLE, -1},
   [WASM_OP_CALL_REF]		= {"call_ref", IMM_NONE, -1},
   [WASM_OP_RETURN_CALL_REF]	= {"return_call_ref", IMM_NONE, -1},
   [WASM_OP_DELEGATE]		= {"delegate", IMM_NONE, -1},
@@ -590,6 +590,8 @@ bool legal_opcodes_table[] = {
   [WASM_OP_RETURN]		= 1,
   [WASM_OP_CALL]		= 1,
   [WASM_OP_CALL_INDIRECT]	= 1,
+  [WASM_OP_RETURN_CALL]		= 1,
+  [WASM_OP_RETURN_CALL_INDIRECT]= 1,
   [WASM_OP_DROP]		= 1,
   [WASM_OP_SELECT]		= 1,
   [WASM_OP_LOCAL_GET]		= 1,
@@ -666,3 +668,5 @@ bool legal_opcodes_table[] = {
   [WASM_OP_I32_EXTEND8_S]	= 1,
   [WASM_OP_I32_EXTEND16_S]	= 1
 };
+
+const uint32_t opcode_table_size = sizeof(opcode_table) / sizeof(opcode_table[0]);
@@ -1,5 +1,7 @@
 #include <stdexcept>
 #include <iostream>
+#include <map>
+#include <utility>
 
 #include "ir.h"
 #include "common.h"
@@ -126,6 +128,8 @@ static Value decode_init_expr(buffer_t &buf) {
 
 void WasmModule::decode_type_section(buffer_t &buf, uint32_t len) {
   uint32_t num_sigs = RD_U32();
+  /* Interns signatures into dense IDs, in order of first appearance */
+  std::map<std::pair<typelist, typelist>, uint32_t> canonical;
   for (uint32_t i = 0; i < num_sigs; i++) {
     SigDecl sig;
     /* Read type */
@@ -140,8 +144,11 @@ void WasmModule::decode_type_section(buffer_t &buf, uint32_t len) {
     /* For results */
     uint32_t num_results = RD_U32();
     sig.results = read_type_list(num_results, buf);
-    
-    this->sigs.push_back(sig);
+
+    auto key = std::make_pair(sig.params, sig.results);
+    auto ins = canonical.emplace(std::move(key), static_cast<uint32_t>(canonical.size()));
+    this->sig_ids.push_back(ins.first->second);
+    append(this->sigs, std::move(sig));
   }
 }
 
@@ -166,30 +173,23 @@ void WasmModule::decode_import_section (buffer_t &buf, uint32_t len) {
       case KIND_FUNC: {
         info.num_funcs++;
         uint32_t idx = RD_U32();
-        FuncDecl func = { .sig = this->getSig(idx) };
-        funcs.push_back(func);
-        import.desc.func = &funcs.back();
+        FuncDecl func = { .sig = this->getSig(idx), .sig_id = this->getSigId(idx) };
+        import.desc.func = append(funcs, std::move(func));
         break;
       }
       case KIND_TABLE: {
         info.num_tables++;
-        TableDecl table = read_tabletype(buf);
-        tables.push_back(table);
-        import.desc.table = &tables.back();
+        import.desc.table = append(tables, read_tabletype(buf));
         break;
       }
       case KIND_MEMORY: {
         info.num_mems++;
-        MemoryDecl mem = read_memtype(buf);
-        mems.push_back(mem);
-        import.desc.mem = &mems.back();
+        import.desc.mem = append(mems, read_memtype(buf));
         break;
       }
       case KIND_GLOBAL: {
         info.num_globals++;
-        GlobalDecl global = read_globaltype(buf);
-        globals.push_back(global);
-        import.desc.global= &globals.back();
+        import.desc.global = append(globals, read_globaltype(buf));
         break;
       }
       default: {
@@ -198,7 +198,7 @@ void WasmModule::decode_import_section (buffer_t &buf, uint32_t len) {
       }
     }
 
-    info.list.push_back(import);
+    append(info.list, std::move(import));
   }
 
 }
@@ -214,9 +214,10 @@ void WasmModule::decode_function_section (buffer_t &buf, uint32_t len) {
     /* Get signature idx */
     uint32_t idx = RD_U32();
     FuncDecl func = {
-      .sig = this->getSig(idx)
+      .sig = this->getSig(idx),
+      .sig_id = this->getSigId(idx)
     };
-    this->funcs.push_back(func);
+    append(this->funcs, std::move(func));
   }
 }
 
@@ -229,8 +230,7 @@ void WasmModule::decode_table_section (buffer_t &buf, uint32_t len) {
 
   uint32_t num_tables = RD_U32();
   for (uint32_t i = 0; i < num_tables; i++) {
-    TableDecl table = read_tabletype(buf);
-    this->tables.push_back(table);
+    append(this->tables, read_tabletype(buf));
   }
 }
 
@@ -238,8 +238,7 @@ void WasmModule::decode_table_section (buffer_t &buf, uint32_t len) {
 void WasmModule::decode_memory_section (buffer_t &buf, uint32_t len) {
   uint32_t num_mems = RD_U32();
   if ((num_mems == 1) && this->mems.empty()) {
-    MemoryDecl mem = read_memtype(buf);
-    this->mems.push_back(mem);
+    append(this->mems, read_memtype(buf));
   } else {
     throw std::runtime_error("Memory component has to be 1!");
   }
@@ -345,17 +344,27 @@ void WasmModule::decode_code_section (buffer_t &buf, uint32_t len) {
   for (auto func_itr = std::next(funcs.begin(), num_imports);
           func_itr != funcs.end(); ++func_itr) {
     FuncDecl &func = *func_itr;
-    /* Fn size (locals + body) */
+    /* Fn size (locals + body); split by decode_body */
     uint32_t size = RD_U32();
-    const byte* end_insts = buf.ptr + size;
-
-    /* Local section */
-    func.pure_locals = decode_locals(buf, func.num_pure_locals);
-    
-    const byte* start_insts = buf.ptr;
-    /* Fn body bytes and expr */
-    func.code_bytes = RD_BYTESTR(end_insts - start_insts);
+    func.code_bytes = RD_BYTESPAN(size);
   }
+
+  /* Bodies are independent once their extents are known */
+  parallel_for(funcs.size() - num_imports, [&](size_t i) {
+    decode_body(funcs[num_imports + i]);
+  });
+}
+
+
+void WasmModule::decode_body (FuncDecl &func) {
+  buffer_t buf = {func.code_bytes.data(), func.code_bytes.data(),
+                  func.code_bytes.data() + func.code_bytes.size()};
+
+  /* Local section */
+  func.pure_locals = decode_locals(buf, func.num_pure_locals);
+
+  /* Fn body bytes and expr */
+  func.code_bytes = bytespan(buf.ptr, buf.end);
 }
 
 
@@ -369,7 +378,7 @@ void WasmModule::decode_global_section(buffer_t &buf, uint32_t len) {
   for (uint32_t i = 0; i < num_globs; i++) {
     GlobalDecl global = read_globaltype(buf);
     global.init_value = decode_init_expr(buf);
-    this->globals.push_back(global);
+    append(this->globals, std::move(global));
   }
 }
 
@@ -386,7 +395,7 @@ void WasmModule::decode_data_section(buffer_t &buf, uint32_t len) {
   /* Create datas if datacount wasn't present to do so */
   else {
     for (int i = 0; i < num_datas; i++)
-      this->datas.push_back(DataDecl());
+      append(this->datas, DataDecl());
   }
 
 
@@ -420,7 +429,7 @@ void WasmModule::decode_data_section(buffer_t &buf, uint32_t len) {
     data.mem = mem;
     /* Size val */
     uint32_t num_bytes = RD_U32();
-    data.bytes = RD_BYTESTR(num_bytes);
+    data.bytes = RD_BYTESPAN(num_bytes);
   }
 }
 
@@ -430,58 +439,68 @@ void WasmModule::decode_datacount_section(buffer_t &buf, uint32_t len) {
   this->num_datas_datacount = num_datas;
   /* Create data list so instructions in code can decode accessors correctly */
   for (int i = 0; i < num_datas; i++) {
-    this->datas.push_back(DataDecl());
+    append(this->datas, DataDecl());
   }
 }
 
+/* Custom sections are only recorded here; nothing the VM runs depends on
+ * them, so the 'name' section is decoded on request by {decode_names} */
 void WasmModule::decode_custom_section(buffer_t &buf, uint32_t len) {
   const byte* end_sec = buf.ptr + len;
 
   CustomDecl custom;
   custom.name = RD_NAME();
   uint32_t num_bytes = end_sec - buf.ptr;
+  custom.bytes = RD_BYTESPAN(num_bytes);
 
-  if (custom.name == "name") {
-    DebugNameDecl &debug = custom.debug;
-    while (buf.ptr != end_sec) {
-      byte id = RD_BYTE();
-      uint32_t len = RD_U32();
-      /* Non-function subsections in name: Just record section info */
-      if (id != 1) {
-        SubsecBytes subsec = { .id = id, .bytes = RD_BYTESTR(len) };
-        debug.subsections.push_back(subsec);
-      }
-      /* Function subsection */
-      else {
-        const byte* start_subsec = buf.ptr;
-        const byte* end_subsec = buf.ptr + len;
-
-        uint32_t num_names = RD_U32();
-        for (uint32_t i = 0; i < num_names; i++) {
-          uint32_t idx = RD_U32();
-          DebugNameAssoc d = { .func = this->getFunc(idx), .name = RD_NAME() };
-          debug.func_assoc.push_back(d);
-        }
-
-        if (buf.ptr != end_subsec) {
-          ERR("Custom name section not aligned after parsing -- start:%lu, ptr:%lu, end:%lu\n",
-              buf.ptr - start_subsec,
-              buf.ptr - start_subsec,
-              buf.end - start_subsec);
-          throw std::runtime_error("Subsection parsing error");
-        }
-      }
-    }
+  this->customs.push_back(std::move(custom));
+}
+
+
+std::list <DebugNameAssoc>* WasmModule::decode_names() {
+  if (this->fn_names_debug) {
+    return this->fn_names_debug;
   }
-  /* Non-name sections: Just get bytes */
-  else {
-    custom.bytes = RD_BYTESTR(num_bytes);
+  auto custom = std::find_if(this->customs.begin(), this->customs.end(),
+      [](auto const& c) { return c.name == "name"; });
+  if (custom == this->customs.end()) {
+    return NULL;
   }
 
-  this->customs.push_back(custom);
-  if (custom.name == "name") {
-    this->fn_names_debug = &this->customs.back().debug.func_assoc;
+  DebugNameDecl &debug = custom->debug;
+  const byte* end_sec = custom->bytes.data() + custom->bytes.size();
+  buffer_t buf = {custom->bytes.data(), custom->bytes.data(), end_sec};
+  while (buf.ptr != end_sec) {
+    byte id = RD_BYTE();
+    uint32_t len = RD_U32();
+    /* Non-function subsections in name: Just record section info */
+    if (id != 1) {
+      SubsecBytes subsec = { .id = id, .bytes = RD_BYTESPAN(len) };
+      debug.subsections.push_back(subsec);
+    }
+    /* Function subsection */
+    else {
+      const byte* start_subsec = buf.ptr;
+      const byte* end_subsec = buf.ptr + len;
+
+      uint32_t num_names = RD_U32();
+      for (uint32_t i = 0; i < num_names; i++) {
+        uint32_t idx = RD_U32();
+        DebugNameAssoc d = { .func = this->getFunc(idx), .name = RD_NAME() };
+        debug.func_assoc.push_back(d);
+      }
+
+      if (buf.ptr != end_subsec) {
+        ERR("Custom name section not aligned after parsing -- start:%lu, ptr:%lu, end:%lu\n",
+            buf.ptr - start_subsec,
+            buf.ptr - start_subsec,
+            buf.end - start_subsec);
+        throw std::runtime_error("Subsection parsing error");
+      }
+    }
   }
+  this->fn_names_debug = &debug.func_assoc;
+  return this->fn_names_debug;
 }
 
 
@@ -567,3 +586,10 @@ WasmModule parse_bytecode(const byte* start, const byte* end) {
   }
   return module;
 }
+
+
+WasmModule parse_file(std::shared_ptr<const MappedFile> file) {
+  WasmModule module = parse_bytecode(file->start(), file->end());
+  module.retain_source(std::move(file));
+  return module;
+}
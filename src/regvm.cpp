@@ -0,0 +1,734 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+#include "dispatch.h"
+
+/* Register tier.
+ *
+ * translate_function_reg() rewrites the stack-machine Instr stream of a
+ * function into three-address RegInstrs. Operand stack height h is pinned to
+ * register nlocals + h (its "home"), so every stack slot has a fixed place in
+ * the frame and a call's arguments already sit where the callee expects its
+ * first locals. While translating, the stack holds lazy operands: a local.get
+ * or a constant is not copied anywhere until a consumer needs it, so
+ * `local.get a; local.get b; i32.add; local.set c` becomes one `add c, a, b`.
+ * At every control instruction the lazy entries are written to their homes,
+ * which is the only state a branch target relies on. */
+
+namespace {
+
+constexpr uint32_t kNoFixup = UINT32_MAX;
+
+struct Operand {
+  enum Kind { Reg, Const } kind;
+  uint32_t reg;
+  Slot value;
+};
+
+struct RegCtrl {
+  Label::Kind kind;
+  size_t height;                    // operand stack height at entry
+  bool live;                        // reachable at entry
+  uint32_t loop_start;              // only for loops
+  uint32_t else_fixup;              // only for if: the branch to the else arm
+  std::vector<uint32_t> end_fixups; // forward branches to the end
+};
+
+class RegTranslator {
+public:
+  RegTranslator(const WasmModule& module, FuncCode& fc, uint32_t nlocals)
+    : module_(module), fc_(fc), out_(fc.rcode), nlocals_(nlocals) {}
+
+  void run(const std::vector<FuncCode>& funcs);
+  uint32_t max_height() const { return max_height_; }
+
+private:
+  uint32_t home(size_t h) const { return nlocals_ + static_cast<uint32_t>(h); }
+
+  uint32_t emit(Opcode_t op, uint32_t d = 0, uint32_t a = 0, uint32_t b = 0) {
+    RegInstr ins{};
+    ins.op = op;
+    ins.d = d;
+    ins.a = a;
+    ins.b = b;
+    out_.push_back(ins);
+    return static_cast<uint32_t>(out_.size() - 1);
+  }
+
+  void push(Operand v) {
+    stack_.push_back(v);
+    if (stack_.size() > max_height_) {
+      max_height_ = static_cast<uint32_t>(stack_.size());
+    }
+  }
+
+  Operand pop(const char* what) {
+    if (stack_.empty()) {
+      throw std::runtime_error(std::string("Not enough values on the operand stack for ") + what);
+    }
+    Operand v = stack_.back();
+    stack_.pop_back();
+    return v;
+  }
+
+  /* Write operand {v}, which lives at height {h}, into register {dst} */
+  void store(const Operand& v, uint32_t dst) {
+    if (v.kind == Operand::Const) {
+      out_[emit(R_CONST, dst)].imm.raw = v.value.raw;
+    } else if (v.reg != dst) {
+      emit(R_MOV, dst, v.reg);
+    }
+  }
+
+  /* Register holding {v}; constants are materialised into their home */
+  uint32_t reg_of(const Operand& v, size_t h) {
+    if (v.kind == Operand::Reg) {
+      return v.reg;
+    }
+    store(v, home(h));
+    return home(h);
+  }
+
+  /* Bring every lazy entry into its home register */
+  void flush() {
+    for (size_t h = 0; h < stack_.size(); ++h) {
+      Operand& v = stack_[h];
+      if (v.kind == Operand::Reg && v.reg == home(h)) {
+        continue;
+      }
+      store(v, home(h));
+      v = Operand{Operand::Reg, home(h), {}};
+    }
+    last_def_ = kNoFixup;
+  }
+
+  /* Local {idx} is about to change: copy out entries that still read it */
+  void spill_local(uint32_t idx) {
+    for (size_t h = 0; h < stack_.size(); ++h) {
+      Operand& v = stack_[h];
+      if (v.kind == Operand::Reg && v.reg == idx) {
+        emit(R_MOV, home(h), idx);
+        v = Operand{Operand::Reg, home(h), {}};
+      }
+    }
+  }
+
+  /* Push the result of the instruction just emitted into home({h}) */
+  void def(size_t h) {
+    push(Operand{Operand::Reg, home(h), {}});
+    last_def_ = static_cast<uint32_t>(out_.size() - 1);
+  }
+
+  void set_local(uint32_t idx, const Operand& v, size_t h);
+  void binary(Opcode_t op, Opcode_t op_imm, const char* what);
+  void emit_return();
+  void emit_call(uint32_t arg_count, uint32_t result_count, uint32_t instr);
+
+  const WasmModule& module_;
+  FuncCode& fc_;
+  std::vector<RegInstr>& out_;
+  const uint32_t nlocals_;
+  std::vector<Operand> stack_;
+  std::vector<RegCtrl> ctrl_;
+  uint32_t max_height_ = 0;
+  /* Last emitted instruction if all it did was compute a fresh temporary */
+  uint32_t last_def_ = kNoFixup;
+  bool reachable_ = true;
+};
+
+void RegTranslator::set_local(uint32_t idx, const Operand& v, size_t h) {
+  spill_local(idx);
+  // The value was computed by the previous instruction into its temporary:
+  // compute it straight into the local instead
+  if (v.kind == Operand::Reg && v.reg == home(h) &&
+      last_def_ == out_.size() - 1 && out_[last_def_].d == v.reg) {
+    out_[last_def_].d = idx;
+    last_def_ = kNoFixup;
+    return;
+  }
+  store(v, idx);
+  last_def_ = kNoFixup;
+}
+
+void RegTranslator::binary(Opcode_t op, Opcode_t op_imm, const char* what) {
+  Operand rhs = pop(what);
+  Operand lhs = pop(what);
+  const size_t h = stack_.size();
+  if (op_imm != op && rhs.kind == Operand::Const) {
+    uint32_t ra = reg_of(lhs, h);
+    out_[emit(op_imm, home(h), ra)].imm.i32 = rhs.value.i32;
+  } else {
+    uint32_t ra = reg_of(lhs, h);
+    uint32_t rb = reg_of(rhs, h + 1);
+    emit(op, home(h), ra, rb);
+  }
+  def(h);
+}
+
+void RegTranslator::emit_return() {
+  const size_t retc = fc_.decl->sig->results.size();
+  if (stack_.size() < retc) {
+    throw std::runtime_error("Not enough values on the operand stack for function return");
+  }
+  const size_t first = stack_.size() - retc;
+  for (size_t h = first; h < stack_.size(); ++h) {
+    store(stack_[h], home(h));
+  }
+  emit(R_RET, 0, home(first), static_cast<uint32_t>(retc));
+  last_def_ = kNoFixup;
+}
+
+void RegTranslator::emit_call(uint32_t arg_count, uint32_t result_count, uint32_t instr) {
+  const size_t base = stack_.size() - arg_count;
+  out_[instr].d = home(base);
+  stack_.resize(base);
+  for (uint32_t i = 0; i < result_count; ++i) {
+    push(Operand{Operand::Reg, home(base + i), {}});
+  }
+  last_def_ = kNoFixup;
+}
+
+void RegTranslator::run(const std::vector<FuncCode>& funcs) {
+  out_.clear();
+  out_.reserve(fc_.code.size());
+  ctrl_.push_back(RegCtrl{Label::Kind::Implicit, 0, true, 0, kNoFixup, {}});
+
+  for (const Instr& ins : fc_.code) {
+    if (!reachable_) {
+      // Dead code: only track nesting until the enclosing construct ends
+      switch (ins.op) {
+        case WASM_OP_BLOCK:
+        case WASM_OP_LOOP:
+        case WASM_OP_IF:
+          ctrl_.push_back(RegCtrl{Label::Kind::Block, stack_.size(), false, 0, kNoFixup, {}});
+          continue;
+        case WASM_OP_ELSE:
+        case WASM_OP_END:
+          break;
+        default:
+          continue;
+      }
+    }
+
+    switch (ins.op) {
+      case WASM_OP_NOP:
+        break;
+      case WASM_OP_UNREACHABLE:
+        emit(R_UNREACHABLE);
+        reachable_ = false;
+        break;
+      case WASM_OP_I32_CONST: {
+        Slot v{};
+        v.i32 = ins.imm.i32;
+        push(Operand{Operand::Const, 0, v});
+        break;
+      }
+      case WASM_OP_I64_CONST:
+      case WASM_OP_F64_CONST: {
+        Slot v{};
+        v.i64 = ins.imm.i64;
+        push(Operand{Operand::Const, 0, v});
+        break;
+      }
+      case WASM_OP_F32_CONST: {
+        Slot v{};
+        v.f32 = ins.imm.f32;
+        push(Operand{Operand::Const, 0, v});
+        break;
+      }
+      case WASM_OP_LOCAL_GET:
+        push(Operand{Operand::Reg, ins.a, {}});
+        break;
+      case WASM_OP_LOCAL_SET: {
+        Operand v = pop("local.set");
+        set_local(ins.a, v, stack_.size());
+        break;
+      }
+      case WASM_OP_LOCAL_TEE: {
+        Operand v = pop("local.tee");
+        set_local(ins.a, v, stack_.size());
+        push(Operand{Operand::Reg, ins.a, {}});
+        break;
+      }
+      case WASM_OP_GLOBAL_GET:
+        emit(R_GLOBAL_GET, home(stack_.size()), ins.a);
+        def(stack_.size());
+        break;
+      case WASM_OP_GLOBAL_SET: {
+        Operand v = pop("global.set");
+        emit(R_GLOBAL_SET, 0, reg_of(v, stack_.size()), ins.a);
+        last_def_ = kNoFixup;
+        break;
+      }
+      case WASM_OP_DROP:
+        pop("drop");
+        break;
+      case WASM_OP_SELECT: {
+        Operand c = pop("select");
+        Operand v2 = pop("select");
+        Operand v1 = pop("select");
+        const size_t h = stack_.size();
+        uint32_t r1 = reg_of(v1, h);
+        uint32_t r2 = reg_of(v2, h + 1);
+        uint32_t rc = reg_of(c, h + 2);
+        out_[emit(R_SELECT, home(h), r1, r2)].imm.reg = rc;
+        def(h);
+        break;
+      }
+      case WASM_OP_I32_EQZ: {
+        Operand v = pop("i32.eqz");
+        const size_t h = stack_.size();
+        emit(R_I32_EQZ, home(h), reg_of(v, h));
+        def(h);
+        break;
+      }
+      case WASM_OP_I32_EQ:
+        binary(R_I32_EQ, R_I32_EQ_I, "i32.eq");
+        break;
+      case WASM_OP_I32_LT_S:
+        binary(R_I32_LT_S, R_I32_LT_S_I, "i32.lt_s");
+        break;
+      case WASM_OP_I32_ADD:
+        binary(R_I32_ADD, R_I32_ADD_I, "i32.add");
+        break;
+      case WASM_OP_I32_SUB:
+        binary(R_I32_SUB, R_I32_SUB_I, "i32.sub");
+        break;
+      case WASM_OP_F64_ADD:
+        binary(R_F64_ADD, R_F64_ADD, "f64.add");
+        break;
+      case WASM_OP_I32_LOAD: {
+        Operand addr = pop("i32.load");
+        const size_t h = stack_.size();
+        out_[emit(R_I32_LOAD, home(h), reg_of(addr, h))].imm.u32 = ins.a;
+        def(h);
+        break;
+      }
+      case WASM_OP_I32_STORE: {
+        Operand val = pop("i32.store");
+        Operand addr = pop("i32.store");
+        const size_t h = stack_.size();
+        uint32_t ra = reg_of(addr, h);
+        uint32_t rv = reg_of(val, h + 1);
+        out_[emit(R_I32_STORE, 0, ra, rv)].imm.u32 = ins.a;
+        last_def_ = kNoFixup;
+        break;
+      }
+      case WASM_OP_BLOCK:
+        flush();
+        ctrl_.push_back(RegCtrl{Label::Kind::Block, stack_.size(), true, 0, kNoFixup, {}});
+        break;
+      case WASM_OP_LOOP:
+        flush();
+        ctrl_.push_back(RegCtrl{Label::Kind::Loop, stack_.size(), true,
+                                static_cast<uint32_t>(out_.size()), kNoFixup, {}});
+        break;
+      case WASM_OP_IF: {
+        Operand c = pop("if condition");
+        uint32_t rc = reg_of(c, stack_.size());
+        flush();
+        uint32_t br = emit(R_BR_UNLESS, 0, rc);
+        ctrl_.push_back(RegCtrl{Label::Kind::If, stack_.size(), true, 0, br, {}});
+        break;
+      }
+      case WASM_OP_ELSE: {
+        RegCtrl& c = ctrl_.back();
+        if (!c.live) {
+          break;
+        }
+        if (reachable_) {
+          flush();
+          c.end_fixups.push_back(emit(R_JMP));
+        }
+        out_[c.else_fixup].imm.target = static_cast<uint32_t>(out_.size());
+        c.else_fixup = kNoFixup;
+        stack_.resize(c.height);
+        reachable_ = true;
+        break;
+      }
+      case WASM_OP_END: {
+        if (ctrl_.size() == 1) {
+          // End of the function body
+          if (reachable_) {
+            emit_return();
+          }
+          ctrl_.pop_back();
+          reachable_ = false;
+          break;
+        }
+        if (reachable_) {
+          flush();
+        }
+        RegCtrl c = std::move(ctrl_.back());
+        ctrl_.pop_back();
+        if (!c.live) {
+          break;
+        }
+        const uint32_t here = static_cast<uint32_t>(out_.size());
+        for (uint32_t fix : c.end_fixups) {
+          out_[fix].imm.target = here;
+        }
+        if (c.else_fixup != kNoFixup) {
+          out_[c.else_fixup].imm.target = here;
+        }
+        // Blocks carry no values, so the stack is back at its entry height
+        stack_.resize(c.height);
+        last_def_ = kNoFixup;
+        reachable_ = true;
+        break;
+      }
+      case WASM_OP_BR:
+      case WASM_OP_BR_IF: {
+        uint32_t rc = 0;
+        if (ins.op == WASM_OP_BR_IF) {
+          Operand c = pop("br_if");
+          rc = reg_of(c, stack_.size());
+        }
+        RegCtrl& target = ctrl_[ctrl_.size() - 1 - ins.a];
+        if (target.kind == Label::Kind::Implicit) {
+          // Branch to the function label is a return
+          if (ins.op == WASM_OP_BR) {
+            emit_return();
+            reachable_ = false;
+          } else {
+            uint32_t skip = emit(R_BR_UNLESS, 0, rc);
+            emit_return();
+            out_[skip].imm.target = static_cast<uint32_t>(out_.size());
+          }
+          break;
+        }
+        flush();
+        uint32_t br = (ins.op == WASM_OP_BR) ? emit(R_JMP) : emit(R_BR_IF, 0, rc);
+        if (target.kind == Label::Kind::Loop) {
+          out_[br].imm.target = target.loop_start;
+        } else {
+          target.end_fixups.push_back(br);
+        }
+        if (ins.op == WASM_OP_BR) {
+          reachable_ = false;
+        }
+        break;
+      }
+      case WASM_OP_RETURN:
+        emit_return();
+        reachable_ = false;
+        break;
+      case WASM_OP_CALL: {
+        const SigDecl* sig = funcs[ins.a].decl->sig;
+        const uint32_t argc = static_cast<uint32_t>(sig->params.size());
+        if (stack_.size() < argc) {
+          throw std::runtime_error("Not enough values on the operand stack for function parameters");
+        }
+        flush();
+        uint32_t call = emit(R_CALL, 0, ins.a);
+        emit_call(argc, static_cast<uint32_t>(sig->results.size()), call);
+        break;
+      }
+      case WASM_OP_CALL_INDIRECT: {
+        // Checked against the callee's signature again at run time
+        const SigDecl* sig = module_.getSig(ins.a);
+        if (sig == nullptr) {
+          throw std::runtime_error("call_indirect bad type index");
+        }
+        Operand idx = pop("call_indirect");
+        const uint32_t argc = static_cast<uint32_t>(sig->params.size());
+        if (stack_.size() < argc) {
+          throw std::runtime_error("Not enough values on the operand stack for function parameters");
+        }
+        uint32_t ri = reg_of(idx, stack_.size());
+        flush();
+        uint32_t call = emit(R_CALL_INDIRECT, 0, ins.imm.call.site);
+        out_[call].imm.reg = ri;
+        emit_call(argc, static_cast<uint32_t>(sig->results.size()), call);
+        break;
+      }
+      case WASM_OP_RETURN_CALL: {
+        const SigDecl* sig = funcs[ins.a].decl->sig;
+        const uint32_t argc = static_cast<uint32_t>(sig->params.size());
+        if (stack_.size() < argc) {
+          throw std::runtime_error("Not enough values on the operand stack for function parameters");
+        }
+        flush();
+        emit(R_RETURN_CALL, home(stack_.size() - argc), ins.a);
+        last_def_ = kNoFixup;
+        reachable_ = false;
+        break;
+      }
+      case WASM_OP_RETURN_CALL_INDIRECT: {
+        const SigDecl* sig = module_.getSig(ins.a);
+        if (sig == nullptr) {
+          throw std::runtime_error("return_call_indirect bad type index");
+        }
+        Operand idx = pop("return_call_indirect");
+        const uint32_t argc = static_cast<uint32_t>(sig->params.size());
+        if (stack_.size() < argc) {
+          throw std::runtime_error("Not enough values on the operand stack for function parameters");
+        }
+        uint32_t ri = reg_of(idx, stack_.size());
+        flush();
+        uint32_t call = emit(R_RETURN_CALL_INDIRECT, home(stack_.size() - argc), ins.imm.call.site);
+        out_[call].imm.reg = ri;
+        last_def_ = kNoFixup;
+        reachable_ = false;
+        break;
+      }
+      default: {
+        // Not implemented by the interpreter: traps when reached, just like
+        // in the stack tier
+        Opcode_t opcode = (ins.op == VM_OP_UNSUPPORTED) ? ins.a : ins.op;
+        emit(R_UNSUPPORTED, 0, opcode);
+        reachable_ = false;
+        break;
+      }
+    }
+  }
+}
+
+} // namespace
+
+void CompiledModule::translate_function_reg(FuncCode& fc) const {
+  const uint32_t nlocals = static_cast<uint32_t>(fc.decl->sig->params.size() + fc.decl->num_pure_locals);
+  RegTranslator translator(module_, fc, nlocals);
+  translator.run(funcs_);
+  fc.nregs = nlocals + translator.max_height();
+  TRACE("Register-translated function %u: %zu instructions -> %zu, %u registers\n",
+        module_.getFuncIdx(fc.decl), fc.code.size(), fc.rcode.size(), fc.nregs);
+}
+
+/* Returns false, with the trap recorded, if the call traps */
+bool WasmVM::enter_reg_frame(FuncInst* f, Slot* regs) {
+  if (f->error != nullptr && !prepare_on_call(f)) {
+    set_trap(Trap::FunctionError, f->error);
+    return false;
+  }
+  if (regs + f->nregs > stack_base() + stack_capacity()) {
+    set_trap(Trap::StackOverflow);
+    return false;
+  }
+  if (reg_call_stack_.size() >= VM_MAX_CALL_DEPTH) {
+    set_trap(Trap::CallStackExhausted);
+    return false;
+  }
+  // Parameters are already in place; declared locals start at zero
+  const size_t nparams = f->decl->sig->params.size();
+  std::fill(regs + nparams, regs + nparams + f->decl->num_pure_locals, Slot{});
+  reg_call_stack_.push_back(RegFrame{f, f->rcode, regs});
+  TRACE("Entering function %u (register tier)\n", module_.getFuncIdx(f->decl));
+  return true;
+}
+
+#define LOAD_STATE() do { \
+  frame = &reg_call_stack_.back(); \
+  pc = frame->pc; \
+  code = frame->func->rcode; \
+  regs = frame->regs; \
+} while (0)
+
+/* Run until the register-tier call stack is empty or something traps */
+template <BoundsCheck B>
+Trap WasmVM::execute_reg_bounded() {
+#if VM_THREADED_DISPATCH
+  static const void* dispatch_table[] = {
+    #define REG_TARGET(op) &&L_##op,
+    VM_REG_OPS(REG_TARGET)
+    #undef REG_TARGET
+  };
+  static_assert(sizeof(dispatch_table) / sizeof(*dispatch_table) == R_OP_COUNT,
+                "every RegOp needs a handler");
+#endif
+
+  Slot* const stack = stack_base();
+  Slot* const globals = global_values_.data();
+  byte* const mem = memory_.data();
+  const uint64_t mem_bound = memory_.bound();
+
+  RegFrame* frame;
+  const RegInstr* code;
+  const RegInstr* pc;
+  const RegInstr* ins;
+  Slot* regs;
+  LOAD_STATE();
+
+#if VM_THREADED_DISPATCH
+  DISPATCH();
+#else
+dispatch:
+  ins = pc++;
+  switch (ins->op) {
+#endif
+    TARGET(R_MOV): {
+      regs[ins->d] = regs[ins->a];
+      DISPATCH();
+    }
+    TARGET(R_CONST): {
+      regs[ins->d].raw = ins->imm.raw;
+      DISPATCH();
+    }
+    TARGET(R_JMP): {
+      pc = code + ins->imm.target;
+      DISPATCH();
+    }
+    TARGET(R_BR_IF): {
+      if (regs[ins->a].i32 != 0) {
+        pc = code + ins->imm.target;
+      }
+      DISPATCH();
+    }
+    TARGET(R_BR_UNLESS): {
+      if (regs[ins->a].i32 == 0) {
+        pc = code + ins->imm.target;
+      }
+      DISPATCH();
+    }
+    TARGET(R_SELECT): {
+      regs[ins->d] = regs[ins->imm.reg].i32 != 0 ? regs[ins->a] : regs[ins->b];
+      DISPATCH();
+    }
+    TARGET(R_GLOBAL_GET): {
+      regs[ins->d] = globals[ins->a];
+      DISPATCH();
+    }
+    TARGET(R_GLOBAL_SET): {
+      globals[ins->b] = regs[ins->a];
+      DISPATCH();
+    }
+    TARGET(R_I32_LOAD): {
+      uint64_t effective_addr = static_cast<uint64_t>(static_cast<uint32_t>(regs[ins->a].i32)) + ins->imm.u32;
+      byte* p = linear_address<B>(mem, mem_bound, effective_addr, 4);
+      if (B == BoundsCheck::Explicit && p == nullptr) [[unlikely]] {
+        return set_trap(Trap::MemoryOutOfBounds);
+      }
+      int32_t loaded;
+      std::memcpy(&loaded, p, sizeof(int32_t));
+      regs[ins->d].i32 = loaded;
+      DISPATCH();
+    }
+    TARGET(R_I32_STORE): {
+      uint64_t effective_addr = static_cast<uint64_t>(static_cast<uint32_t>(regs[ins->a].i32)) + ins->imm.u32;
+      byte* p = linear_address<B>(mem, mem_bound, effective_addr, 4);
+      if (B == BoundsCheck::Explicit && p == nullptr) [[unlikely]] {
+        return set_trap(Trap::MemoryOutOfBounds);
+      }
+      std::memcpy(p, &regs[ins->b].i32, sizeof(int32_t));
+      DISPATCH();
+    }
+    TARGET(R_I32_EQZ): {
+      regs[ins->d].i32 = regs[ins->a].i32 == 0 ? 1 : 0;
+      DISPATCH();
+    }
+    TARGET(R_I32_EQ): {
+      regs[ins->d].i32 = regs[ins->a].i32 == regs[ins->b].i32 ? 1 : 0;
+      DISPATCH();
+    }
+    TARGET(R_I32_EQ_I): {
+      regs[ins->d].i32 = regs[ins->a].i32 == ins->imm.i32 ? 1 : 0;
+      DISPATCH();
+    }
+    TARGET(R_I32_LT_S): {
+      regs[ins->d].i32 = regs[ins->a].i32 < regs[ins->b].i32 ? 1 : 0;
+      DISPATCH();
+    }
+    TARGET(R_I32_LT_S_I): {
+      regs[ins->d].i32 = regs[ins->a].i32 < ins->imm.i32 ? 1 : 0;
+      DISPATCH();
+    }
+    TARGET(R_I32_ADD): {
+      regs[ins->d].i32 = static_cast<int32_t>(static_cast<uint32_t>(regs[ins->a].i32) + static_cast<uint32_t>(regs[ins->b].i32));
+      DISPATCH();
+    }
+    TARGET(R_I32_ADD_I): {
+      regs[ins->d].i32 = static_cast<int32_t>(static_cast<uint32_t>(regs[ins->a].i32) + static_cast<uint32_t>(ins->imm.i32));
+      DISPATCH();
+    }
+    TARGET(R_I32_SUB): {
+      regs[ins->d].i32 = static_cast<int32_t>(static_cast<uint32_t>(regs[ins->a].i32) - static_cast<uint32_t>(regs[ins->b].i32));
+      DISPATCH();
+    }
+    TARGET(R_I32_SUB_I): {
+      regs[ins->d].i32 = static_cast<int32_t>(static_cast<uint32_t>(regs[ins->a].i32) - static_cast<uint32_t>(ins->imm.i32));
+      DISPATCH();
+    }
+    TARGET(R_F64_ADD): {
+      regs[ins->d].f64 = regs[ins->a].f64 + regs[ins->b].f64;
+      DISPATCH();
+    }
+    TARGET(R_CALL): {
+      frame->pc = pc;
+      if (!enter_reg_frame(&function_instances_[ins->a], regs + ins->d)) [[unlikely]] {
+        return trap_;
+      }
+      LOAD_STATE();
+      DISPATCH();
+    }
+    TARGET(R_CALL_INDIRECT): {
+      FuncInst* target = resolve_cached(frame->func->icaches[ins->a], regs[ins->imm.reg].i32);
+      if (target == nullptr) [[unlikely]] {
+        return trap_;
+      }
+      frame->pc = pc;
+      if (!enter_reg_frame(target, regs + ins->d)) [[unlikely]] {
+        return trap_;
+      }
+      LOAD_STATE();
+      DISPATCH();
+    }
+    TARGET(R_RETURN_CALL):
+    TARGET(R_RETURN_CALL_INDIRECT): {
+      // The callee's register file starts where this frame's did: the
+      // arguments move down, and the callee takes this frame's place on the
+      // call stack
+      FuncInst* callee;
+      if (ins->op == R_RETURN_CALL) {
+        callee = &function_instances_[ins->a];
+      } else {
+        callee = resolve_cached(frame->func->icaches[ins->a], regs[ins->imm.reg].i32);
+        if (callee == nullptr) [[unlikely]] {
+          return trap_;
+        }
+      }
+      std::memmove(regs, regs + ins->d, callee->nparams * sizeof(Slot));
+      reg_call_stack_.pop_back();
+      if (!enter_reg_frame(callee, regs)) [[unlikely]] {
+        return trap_;
+      }
+      LOAD_STATE();
+      DISPATCH();
+    }
+    TARGET(R_RET): {
+      // Results move down to the start of the register file, which is where
+      // the caller placed the arguments and expects the results
+      const uint32_t retc = ins->b;
+      std::copy(regs + ins->a, regs + ins->a + retc, regs);
+      reg_call_stack_.pop_back();
+      if (reg_call_stack_.empty()) {
+        stack_top_ = (regs - stack) + retc;
+        return Trap::None;
+      }
+      LOAD_STATE();
+      DISPATCH();
+    }
+    TARGET(R_UNREACHABLE): {
+      return set_trap(Trap::Unreachable);
+    }
+    TARGET(R_UNSUPPORTED): {
+      return set_trap(Trap::UnsupportedOpcode, opcode_table[ins->a].mnemonic);
+    }
+#if !VM_THREADED_DISPATCH
+    default:
+      return set_trap(Trap::UnsupportedOpcode);
+  }
+#endif
+}
+
+#undef LOAD_STATE
+
+Trap WasmVM::execute_reg() {
+  switch (memory_.strategy()) {
+    case BoundsCheck::GuardPages: return execute_reg_bounded<BoundsCheck::GuardPages>();
+    case BoundsCheck::Mask: return execute_reg_bounded<BoundsCheck::Mask>();
+    default: return execute_reg_bounded<BoundsCheck::Explicit>();
+  }
+}
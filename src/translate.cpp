@@ -0,0 +1,383 @@
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+namespace {
+
+constexpr uint32_t kNoInstr = UINT32_MAX;
+/* imm.br.height of a branch to the function label, which returns */
+constexpr uint32_t kReturnHeight = UINT32_MAX;
+
+struct CtrlEntry {
+  Label::Kind kind;
+  uint32_t end;           // offset of the END opcode of a block/if
+  uint32_t loop_start;    // first instruction of a loop body
+  uint32_t height;        // operand stack height at entry
+};
+
+/* A branch target that refers forward to a byte offset; patched once every
+ * opcode start has been assigned an instruction index */
+struct Fixup {
+  uint32_t instr;
+  bool in_imm;            // patch imm.br.target rather than a
+  uint32_t target;
+};
+
+/* Operand stack effect of the instructions without immediates that execute()
+ * implements. Returns false for the ones it does not, which trap */
+bool plain_stack_effect(Opcode_t op, int& delta) {
+  switch (op) {
+    case WASM_OP_NOP:
+    case WASM_OP_I32_EQZ:
+      delta = 0;
+      return true;
+    case WASM_OP_DROP:
+    case WASM_OP_I32_EQ:
+    case WASM_OP_I32_LT_S:
+    case WASM_OP_I32_ADD:
+    case WASM_OP_I32_SUB:
+    case WASM_OP_F64_ADD:
+      delta = -1;
+      return true;
+    case WASM_OP_SELECT:
+      delta = -2;
+      return true;
+    default:
+      return false;
+  }
+}
+
+} // namespace
+
+/* Lower {fc.decl->code_bytes} into the fixed-width instruction stream that
+ * execute() runs. Runs once per function before execution. Opcodes that the
+ * interpreter does not implement are kept as-is (with immediates consumed) so
+ * that they still trap only when reached.
+ *
+ * The body has been validated, so the operand stack height at every
+ * instruction is static; it is tracked here so that branches carry the
+ * height of their target label and need no label stack at run time. Code
+ * after an unconditional transfer (or a trapping instruction) is
+ * unreachable and its height is not tracked until the next else/end. */
+void CompiledModule::translate_function(FuncCode& fc) const {
+  const FuncDecl* f = fc.decl;
+  fc.ctrl = pre_indexing(f);
+  size_t next_ctrl = 0;
+
+  const auto& bytes = f->code_bytes;
+  const byte* base = bytes.data();
+  std::vector<uint32_t> pc_map(bytes.size() + 1, kNoInstr);
+  std::vector<CtrlEntry> ctrl;
+  std::vector<Fixup> fixups;
+  const size_t num_locals = f->sig->params.size() + f->num_pure_locals;
+  uint32_t height = 0;
+  bool reachable = true;
+  auto adjust = [&](int delta) {
+    if (reachable) {
+      height = static_cast<uint32_t>(height + delta);
+    }
+  };
+
+  ctrl.push_back({Label::Kind::Implicit, static_cast<uint32_t>(bytes.size() - 1), 0, 0});
+  auto& code = fc.code;
+  code.clear();
+  code.reserve(bytes.size());
+  fc.sites.clear();
+  auto add_indirect_site = [&](uint32_t type_index, uint32_t table_index) {
+    fc.sites.push_back(IndirectSite{type_index, table_index});
+    return static_cast<uint32_t>(fc.sites.size() - 1);
+  };
+
+  auto buf = buffer_t{base, base, base + bytes.size()};
+  while (buf.ptr < buf.end) {
+    const byte* header = buf.ptr;
+    Opcode_t opcode = RD_OPCODE();
+    pc_map[header - base] = static_cast<uint32_t>(code.size());
+
+    Instr ins{};
+    ins.op = opcode;
+    switch (opcode) {
+      case WASM_OP_BLOCK:
+      case WASM_OP_LOOP:
+      case WASM_OP_IF: {
+        RD_BYTE();  // blocktype, checked by pre_indexing
+        const CtrlMeta& meta = fc.ctrl[next_ctrl++];
+        if (opcode == WASM_OP_IF) {
+          adjust(-1);
+        }
+        if (opcode == WASM_OP_LOOP) {
+          ctrl.push_back({meta.kind, 0, static_cast<uint32_t>(code.size() + 1), height});
+        } else {
+          ctrl.push_back({meta.kind, meta.end, 0, height});
+        }
+        if (opcode == WASM_OP_IF) {
+          fixups.push_back({static_cast<uint32_t>(code.size()), false,
+                            meta.else_pc ? meta.else_pc : meta.end});
+        }
+        break;
+      }
+      case WASM_OP_ELSE: {
+        fixups.push_back({static_cast<uint32_t>(code.size()), false, ctrl.back().end});
+        height = ctrl.back().height;
+        reachable = true;
+        break;
+      }
+      case WASM_OP_END: {
+        // Blocks have no results, so every construct ends at its entry height
+        height = ctrl.back().height;
+        reachable = true;
+        ctrl.pop_back();
+        break;
+      }
+      case WASM_OP_BR:
+      case WASM_OP_BR_IF: {
+        uint32_t depth = RD_U32();
+        if (depth >= ctrl.size()) {
+          throw std::runtime_error("br label index out of bounds");
+        }
+        const CtrlEntry& target = ctrl[ctrl.size() - 1 - depth];
+        ins.a = depth;
+        if (opcode == WASM_OP_BR_IF) {
+          adjust(-1);
+        }
+        ins.imm.br.height = (target.kind == Label::Kind::Implicit) ? kReturnHeight : target.height;
+        if (target.kind == Label::Kind::Loop) {
+          ins.imm.br.target = target.loop_start;
+        } else {
+          fixups.push_back({static_cast<uint32_t>(code.size()), true, target.end});
+        }
+        if (opcode == WASM_OP_BR) {
+          reachable = false;
+        }
+        break;
+      }
+      case WASM_OP_RETURN:
+      case WASM_OP_UNREACHABLE: {
+        reachable = false;
+        break;
+      }
+      case WASM_OP_CALL: {
+        ins.a = RD_U32();
+        if (ins.a >= funcs_.size()) {
+          throw std::runtime_error("call function index out of bounds");
+        }
+        const SigDecl* sig = funcs_[ins.a].decl->sig;
+        adjust(static_cast<int>(sig->results.size()) - static_cast<int>(sig->params.size()));
+        break;
+      }
+      case WASM_OP_CALL_INDIRECT: {
+        ins.a = RD_U32();
+        ins.imm.call.table = RD_U32();
+        const SigDecl* sig = module_.getSig(ins.a);
+        if (sig == nullptr) {
+          throw std::runtime_error("call_indirect bad type index");
+        }
+        ins.imm.call.site = add_indirect_site(ins.a, ins.imm.call.table);
+        adjust(static_cast<int>(sig->results.size()) - static_cast<int>(sig->params.size()) - 1);
+        break;
+      }
+      case WASM_OP_RETURN_CALL: {
+        // The callee takes over the frame and returns for the function
+        ins.a = RD_U32();
+        if (ins.a >= funcs_.size()) {
+          throw std::runtime_error("return_call function index out of bounds");
+        }
+        reachable = false;
+        break;
+      }
+      case WASM_OP_RETURN_CALL_INDIRECT: {
+        ins.a = RD_U32();
+        ins.imm.call.table = RD_U32();
+        if (module_.getSig(ins.a) == nullptr) {
+          throw std::runtime_error("return_call_indirect bad type index");
+        }
+        ins.imm.call.site = add_indirect_site(ins.a, ins.imm.call.table);
+        reachable = false;
+        break;
+      }
+      case WASM_OP_LOCAL_GET:
+      case WASM_OP_LOCAL_SET:
+      case WASM_OP_LOCAL_TEE: {
+        ins.a = RD_U32();
+        if (ins.a >= num_locals) {
+          throw std::runtime_error("local index out of bounds");
+        }
+        adjust(opcode == WASM_OP_LOCAL_GET ? 1 : opcode == WASM_OP_LOCAL_SET ? -1 : 0);
+        break;
+      }
+      case WASM_OP_GLOBAL_GET:
+      case WASM_OP_GLOBAL_SET: {
+        ins.a = RD_U32();
+        adjust(opcode == WASM_OP_GLOBAL_GET ? 1 : -1);
+        break;
+      }
+      case WASM_OP_I32_LOAD:
+      case WASM_OP_I32_STORE: {
+        ins.imm.b = RD_U32();
+        ins.a = RD_U32();
+        adjust(opcode == WASM_OP_I32_LOAD ? 0 : -2);
+        break;
+      }
+      case WASM_OP_I32_CONST: {
+        ins.imm.i32 = RD_I32();
+        adjust(1);
+        break;
+      }
+      case WASM_OP_I64_CONST: {
+        ins.imm.i64 = RD_I64();
+        adjust(1);
+        break;
+      }
+      case WASM_OP_F32_CONST: {
+        ins.imm.f32 = raw_to_f32(RD_U32_RAW());
+        adjust(1);
+        break;
+      }
+      case WASM_OP_F64_CONST: {
+        ins.imm.f64 = raw_to_f64(RD_U64_RAW());
+        adjust(1);
+        break;
+      }
+      default: {
+        skip_immediate(opcode, buf);
+        if (opcode >= VM_OP_UNSUPPORTED) {
+          ins.op = VM_OP_UNSUPPORTED;
+          ins.a = opcode;
+        }
+        int delta = 0;
+        if (plain_stack_effect(opcode, delta)) {
+          adjust(delta);
+        } else {
+          reachable = false;
+        }
+        break;
+      }
+    }
+    code.push_back(ins);
+  }
+
+  for (const auto& fix : fixups) {
+    uint32_t target = pc_map[fix.target];
+    if (target == kNoInstr) {
+      throw std::runtime_error("branch target is not an instruction boundary");
+    }
+    if (fix.in_imm) {
+      code[fix.instr].imm.br.target = target;
+    } else {
+      code[fix.instr].a = target;
+    }
+  }
+  TRACE("Translated function %u: %zu bytes -> %zu instructions\n",
+        module_.getFuncIdx(f), bytes.size(), code.size());
+}
+
+namespace {
+
+bool is_branch(Opcode_t op) {
+  return op == WASM_OP_BR || op == WASM_OP_BR_IF ||
+         op == VM_OP_I32_LT_S_BR_IF || op == VM_OP_I32_EQZ_BR_IF;
+}
+
+/* Rewrite every branch target of {code} through {new_index} */
+void remap_targets(std::vector<Instr>& code, const std::vector<uint32_t>& new_index) {
+  for (auto& ins : code) {
+    if (ins.op == WASM_OP_IF || ins.op == WASM_OP_ELSE) {
+      ins.a = new_index[ins.a];
+    } else if (is_branch(ins.op)) {
+      ins.imm.br.target = new_index[ins.imm.br.target];
+    }
+  }
+}
+
+} // namespace
+
+/* Strip the structure the stack tier does not need at run time: block, loop
+ * and the end of a block only delimit labels, whose heights the branches
+ * already carry, so they are dropped; a branch to the function label becomes
+ * a return. Only the function's final end is kept. The register tier is
+ * built from the structured stream instead. */
+void CompiledModule::lower_structured_control(FuncCode& fc) const {
+  auto& code = fc.code;
+  const size_t n = code.size();
+  std::vector<Instr> lowered;
+  lowered.reserve(n);
+  // A target on a dropped instruction moves to the next one that is kept
+  std::vector<uint32_t> new_index(n, kNoInstr);
+  for (size_t i = 0; i < n; ++i) {
+    Instr ins = code[i];
+    new_index[i] = static_cast<uint32_t>(lowered.size());
+    if (ins.op == WASM_OP_BLOCK || ins.op == WASM_OP_LOOP ||
+        (ins.op == WASM_OP_END && i + 1 < n)) {
+      continue;
+    }
+    if ((ins.op == WASM_OP_BR || ins.op == WASM_OP_BR_IF) && ins.imm.br.height == kReturnHeight) {
+      ins.op = (ins.op == WASM_OP_BR) ? static_cast<Opcode_t>(WASM_OP_RETURN) : VM_OP_RETURN_IF;
+    }
+    lowered.push_back(ins);
+  }
+  remap_targets(lowered, new_index);
+  TRACE("Lowered function %u: %zu -> %zu instructions\n",
+        module_.getFuncIdx(fc.decl), n, lowered.size());
+  code = std::move(lowered);
+}
+
+/* Peephole pass over a translated body: replace frequent sequences with a
+ * single superinstruction and compact the stream. A sequence is only fused
+ * when no instruction after its first one is a branch target, so every
+ * target maps to the start of an instruction in the new stream. The fused
+ * handlers perform the same checks, in the same order, as the sequence. */
+void CompiledModule::fuse_superinstructions(FuncCode& fc) const {
+  auto& code = fc.code;
+  const size_t n = code.size();
+  std::vector<bool> is_target(n + 1, false);
+  for (const auto& ins : code) {
+    if (ins.op == WASM_OP_IF || ins.op == WASM_OP_ELSE) {
+      is_target[ins.a] = true;
+    } else if (is_branch(ins.op)) {
+      is_target[ins.imm.br.target] = true;
+    }
+  }
+  auto op_at = [&](size_t i) -> Opcode_t {
+    return (i < n && !is_target[i]) ? code[i].op : VM_OP_UNSUPPORTED;
+  };
+
+  std::vector<Instr> fused;
+  fused.reserve(n);
+  std::vector<uint32_t> new_index(n, kNoInstr);
+  size_t i = 0;
+  while (i < n) {
+    const Instr& first = code[i];
+    Instr ins = first;
+    size_t len = 1;
+    if (first.op == WASM_OP_LOCAL_GET && op_at(i + 2) == WASM_OP_I32_ADD &&
+        op_at(i + 1) == WASM_OP_LOCAL_GET) {
+      ins.op = VM_OP_LOCAL_GET2_I32_ADD;
+      ins.imm.b = code[i + 1].a;
+      len = 3;
+    } else if (first.op == WASM_OP_LOCAL_GET && op_at(i + 2) == WASM_OP_I32_ADD &&
+               op_at(i + 1) == WASM_OP_I32_CONST) {
+      ins.op = VM_OP_LOCAL_GET_I32_CONST_ADD;
+      ins.imm.i32 = code[i + 1].imm.i32;
+      len = 3;
+    } else if (first.op == WASM_OP_LOCAL_GET && op_at(i + 1) == WASM_OP_I32_LOAD) {
+      ins.op = VM_OP_LOCAL_GET_I32_LOAD;
+      ins.imm.b = code[i + 1].a;
+      len = 2;
+    } else if ((first.op == WASM_OP_I32_LT_S || first.op == WASM_OP_I32_EQZ) &&
+               op_at(i + 1) == WASM_OP_BR_IF) {
+      ins = code[i + 1];
+      ins.op = (first.op == WASM_OP_I32_LT_S) ? VM_OP_I32_LT_S_BR_IF : VM_OP_I32_EQZ_BR_IF;
+      len = 2;
+    }
+    new_index[i] = static_cast<uint32_t>(fused.size());
+    fused.push_back(ins);
+    i += len;
+  }
+
+  remap_targets(fused, new_index);
+  TRACE("Fused function %u: %zu -> %zu instructions\n",
+        module_.getFuncIdx(fc.decl), n, fused.size());
+  code = std::move(fused);
+}
@@ -0,0 +1,600 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "validate.h"
+
+/* Function body validation, following the algorithm in the appendix of the
+ * WebAssembly spec: an operand stack of value types, where an unknown type
+ * stands for any value in unreachable code, and a stack of control frames
+ * carrying the label types of every enclosing block. */
+
+namespace {
+
+constexpr wasm_type_t kUnknown = static_cast<wasm_type_t>(0);
+
+bool is_num(wasm_type_t t) {
+  return t == WASM_TYPE_I32 || t == WASM_TYPE_I64 || t == WASM_TYPE_F32 ||
+         t == WASM_TYPE_F64 || t == kUnknown;
+}
+
+bool is_ref(wasm_type_t t) {
+  return t == WASM_TYPE_FUNCREF || t == WASM_TYPE_EXTERNREF || t == kUnknown;
+}
+
+bool is_valtype(byte b) {
+  return b == WASM_TYPE_I32 || b == WASM_TYPE_I64 || b == WASM_TYPE_F32 ||
+         b == WASM_TYPE_F64 || b == WASM_TYPE_FUNCREF || b == WASM_TYPE_EXTERNREF;
+}
+
+typedef std::vector<wasm_type_t> TypeVec;
+
+struct CtrlFrame {
+  Opcode_t opcode;
+  TypeVec start_types;
+  TypeVec end_types;
+  size_t height;
+  bool unreachable;
+};
+
+class Validator {
+public:
+  Validator(const WasmModule& module, const FuncDecl* f) : module_(module), func_(f) {}
+  uint32_t run();
+
+private:
+  [[noreturn]] void fail(const std::string& msg) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "function %u at offset %u: ",
+             module_.getFuncIdx(func_), static_cast<uint32_t>(op_offset_));
+    throw ValidationError(prefix + msg);
+  }
+
+  void push_val(wasm_type_t t) {
+    vals_.push_back(t);
+    if (vals_.size() > max_height_) {
+      max_height_ = static_cast<uint32_t>(vals_.size());
+    }
+  }
+
+  wasm_type_t pop_val() {
+    const CtrlFrame& frame = ctrls_.back();
+    if (vals_.size() == frame.height) {
+      if (frame.unreachable) {
+        return kUnknown;
+      }
+      fail("operand stack underflow");
+    }
+    wasm_type_t t = vals_.back();
+    vals_.pop_back();
+    return t;
+  }
+
+  wasm_type_t pop_val(wasm_type_t expect) {
+    wasm_type_t actual = pop_val();
+    if (actual != expect && actual != kUnknown && expect != kUnknown) {
+      fail(std::string("type mismatch: expected ") + wasm_type_string(expect) +
+           ", got " + wasm_type_string(actual));
+    }
+    return actual == kUnknown ? expect : actual;
+  }
+
+  void push_vals(const TypeVec& types) {
+    for (auto t : types) {
+      push_val(t);
+    }
+  }
+
+  void pop_vals(const TypeVec& types) {
+    for (auto it = types.rbegin(); it != types.rend(); ++it) {
+      pop_val(*it);
+    }
+  }
+
+  void push_ctrl(Opcode_t opcode, TypeVec in, TypeVec out) {
+    ctrls_.push_back(CtrlFrame{opcode, std::move(in), std::move(out), vals_.size(), false});
+    push_vals(ctrls_.back().start_types);
+  }
+
+  CtrlFrame pop_ctrl() {
+    if (ctrls_.empty()) {
+      fail("unbalanced end");
+    }
+    pop_vals(ctrls_.back().end_types);
+    if (vals_.size() != ctrls_.back().height) {
+      fail("values left on the operand stack at the end of a block");
+    }
+    CtrlFrame frame = std::move(ctrls_.back());
+    ctrls_.pop_back();
+    return frame;
+  }
+
+  const TypeVec& label_types(const CtrlFrame& frame) {
+    return frame.opcode == WASM_OP_LOOP ? frame.start_types : frame.end_types;
+  }
+
+  const CtrlFrame& label(uint32_t depth) {
+    if (depth >= ctrls_.size()) {
+      fail("branch depth out of range");
+    }
+    return ctrls_[ctrls_.size() - 1 - depth];
+  }
+
+  void unreachable() {
+    vals_.resize(ctrls_.back().height);
+    ctrls_.back().unreachable = true;
+  }
+
+  /* The callee's results become the function's own, like a return */
+  void tail_call(const SigDecl* callee) {
+    if (TypeVec(callee->results.begin(), callee->results.end()) != ctrls_.front().end_types) {
+      fail("tail call to a function with different results");
+    }
+    unreachable();
+  }
+
+  void need(const buffer_t& buf, size_t bytes) {
+    if (static_cast<size_t>(buf.end - buf.ptr) < bytes) {
+      fail("truncated immediate");
+    }
+  }
+
+  Opcode_t read_opcode(buffer_t& buf);
+  void read_blocktype(buffer_t& buf, TypeVec& in, TypeVec& out);
+  void check_memory(uint32_t align, uint32_t natural_log2);
+  void unary(wasm_type_t in, wasm_type_t out) { pop_val(in); push_val(out); }
+  void binary(wasm_type_t in, wasm_type_t out) { pop_val(in); pop_val(in); push_val(out); }
+  void validate_op(Opcode_t opcode, buffer_t& buf);
+
+  const WasmModule& module_;
+  const FuncDecl* func_;
+  TypeVec locals_;
+  TypeVec vals_;
+  std::vector<CtrlFrame> ctrls_;
+  uint32_t max_height_ = 0;
+  size_t op_offset_ = 0;
+};
+
+/* The encoding RD_OPCODE reads, bounded by the body and the opcode table: a
+ * prefix byte is followed by the bytes of its LEB index */
+Opcode_t Validator::read_opcode(buffer_t& buf) {
+  byte by = RD_BYTE();
+  Opcode_t opcode = by;
+  if (by >= 0xFB && by <= 0xFE) {
+    while (by & 0x80) {
+      if (buf.ptr >= buf.end) {
+        fail("truncated opcode");
+      }
+      if (opcode >= opcode_table_size) {
+        break;
+      }
+      by = RD_BYTE();
+      opcode = (opcode << 8) + by;
+    }
+  }
+  if (opcode >= opcode_table_size || opcode_table[opcode].mnemonic == nullptr) {
+    char msg[32];
+    snprintf(msg, sizeof(msg), "unknown opcode 0x%x", opcode);
+    fail(msg);
+  }
+  if (opcode_table[opcode].invalid) {
+    // Valid, but not run by the interpreters: fails at the first call
+    throw std::runtime_error(std::string(opcode_table[opcode].mnemonic) + " is not supported");
+  }
+  return opcode;
+}
+
+void Validator::read_blocktype(buffer_t& buf, TypeVec& in, TypeVec& out) {
+  if (buf.ptr >= buf.end) {
+    fail("truncated blocktype");
+  }
+  byte b = *buf.ptr;
+  if (b == 0x40) {
+    RD_BYTE();
+    return;
+  }
+  if (is_valtype(b)) {
+    RD_BYTE();
+    out.push_back(static_cast<wasm_type_t>(b));
+    return;
+  }
+  // A type index, encoded as a positive s33
+  int64_t idx = RD_I64();
+  if (idx < 0 || static_cast<uint64_t>(idx) >= module_.get_num_sigs()) {
+    fail("invalid blocktype");
+  }
+  const SigDecl* sig = module_.getSig(static_cast<uint32_t>(idx));
+  in.assign(sig->params.begin(), sig->params.end());
+  out.assign(sig->results.begin(), sig->results.end());
+}
+
+void Validator::check_memory(uint32_t align, uint32_t natural_log2) {
+  if (module_.get_num_mems() == 0) {
+    fail("memory access without a memory");
+  }
+  if (align > natural_log2) {
+    fail("alignment must not be larger than natural");
+  }
+}
+
+void Validator::validate_op(Opcode_t opcode, buffer_t& buf) {
+  const wasm_type_t I32 = WASM_TYPE_I32, I64 = WASM_TYPE_I64;
+  const wasm_type_t F32 = WASM_TYPE_F32, F64 = WASM_TYPE_F64;
+
+  // Numeric instructions come in dense opcode ranges of one shape
+  if (opcode == 0x45) { unary(I32, I32); return; }                        // i32.eqz
+  if (opcode >= 0x46 && opcode <= 0x4F) { binary(I32, I32); return; }     // i32 compare
+  if (opcode == 0x50) { unary(I64, I32); return; }                        // i64.eqz
+  if (opcode >= 0x51 && opcode <= 0x5A) { binary(I64, I32); return; }     // i64 compare
+  if (opcode >= 0x5B && opcode <= 0x60) { binary(F32, I32); return; }     // f32 compare
+  if (opcode >= 0x61 && opcode <= 0x66) { binary(F64, I32); return; }     // f64 compare
+  if (opcode >= 0x67 && opcode <= 0x69) { unary(I32, I32); return; }     // i32 clz/ctz/popcnt
+  if (opcode >= 0x6A && opcode <= 0x78) { binary(I32, I32); return; }     // i32 arithmetic
+  if (opcode >= 0x79 && opcode <= 0x7B) { unary(I64, I64); return; }     // i64 clz/ctz/popcnt
+  if (opcode >= 0x7C && opcode <= 0x8A) { binary(I64, I64); return; }     // i64 arithmetic
+  if (opcode >= 0x8B && opcode <= 0x91) { unary(F32, F32); return; }     // f32 unary
+  if (opcode >= 0x92 && opcode <= 0x98) { binary(F32, F32); return; }     // f32 binary
+  if (opcode >= 0x99 && opcode <= 0x9F) { unary(F64, F64); return; }     // f64 unary
+  if (opcode >= 0xA0 && opcode <= 0xA6) { binary(F64, F64); return; }     // f64 binary
+  if (opcode >= 0xA7 && opcode <= 0xC4) {
+    // Conversions, reinterpretations and sign extensions: [from] -> [to]
+    static const wasm_type_t conv[][2] = {
+      {I64, I32},                                           // i32.wrap_i64
+      {F32, I32}, {F32, I32}, {F64, I32}, {F64, I32},       // i32.trunc_*
+      {I32, I64}, {I32, I64},                               // i64.extend_i32_*
+      {F32, I64}, {F32, I64}, {F64, I64}, {F64, I64},       // i64.trunc_*
+      {I32, F32}, {I32, F32}, {I64, F32}, {I64, F32},       // f32.convert_*
+      {F64, F32},                                           // f32.demote_f64
+      {I32, F64}, {I32, F64}, {I64, F64}, {I64, F64},       // f64.convert_*
+      {F32, F64},                                           // f64.promote_f32
+      {F32, I32}, {F64, I64}, {I32, F32}, {I64, F64},       // reinterpret
+      {I32, I32}, {I32, I32},                               // i32.extend{8,16}_s
+      {I64, I64}, {I64, I64}, {I64, I64},                   // i64.extend{8,16,32}_s
+    };
+    unary(conv[opcode - 0xA7][0], conv[opcode - 0xA7][1]);
+    return;
+  }
+  if (opcode >= 0x28 && opcode <= 0x35) {
+    // Loads: memarg, [i32] -> [t]
+    static const struct { wasm_type_t type; uint32_t natural_log2; } loads[] = {
+      {I32, 2}, {I64, 3}, {F32, 2}, {F64, 3},
+      {I32, 0}, {I32, 0}, {I32, 1}, {I32, 1},
+      {I64, 0}, {I64, 0}, {I64, 1}, {I64, 1}, {I64, 2}, {I64, 2},
+    };
+    uint32_t align = RD_U32();
+    RD_U32();
+    check_memory(align, loads[opcode - 0x28].natural_log2);
+    unary(I32, loads[opcode - 0x28].type);
+    return;
+  }
+  if (opcode >= 0x36 && opcode <= 0x3E) {
+    // Stores: memarg, [i32 t] -> []
+    static const struct { wasm_type_t type; uint32_t natural_log2; } stores[] = {
+      {I32, 2}, {I64, 3}, {F32, 2}, {F64, 3},
+      {I32, 0}, {I32, 1}, {I64, 0}, {I64, 1}, {I64, 2},
+    };
+    uint32_t align = RD_U32();
+    RD_U32();
+    check_memory(align, stores[opcode - 0x36].natural_log2);
+    pop_val(stores[opcode - 0x36].type);
+    pop_val(I32);
+    return;
+  }
+
+  switch (opcode) {
+    case WASM_OP_UNREACHABLE:
+      unreachable();
+      break;
+    case WASM_OP_NOP:
+      break;
+    case WASM_OP_BLOCK:
+    case WASM_OP_LOOP:
+    case WASM_OP_IF: {
+      TypeVec in, out;
+      read_blocktype(buf, in, out);
+      if (opcode == WASM_OP_IF) {
+        pop_val(I32);
+      }
+      pop_vals(in);
+      push_ctrl(opcode, std::move(in), std::move(out));
+      break;
+    }
+    case WASM_OP_ELSE: {
+      if (ctrls_.empty() || ctrls_.back().opcode != WASM_OP_IF) {
+        fail("else without a matching if");
+      }
+      CtrlFrame frame = pop_ctrl();
+      push_ctrl(WASM_OP_ELSE, std::move(frame.start_types), std::move(frame.end_types));
+      break;
+    }
+    case WASM_OP_END: {
+      CtrlFrame frame = pop_ctrl();
+      if (frame.opcode == WASM_OP_IF && frame.start_types != frame.end_types) {
+        fail("if without else must leave its inputs unchanged");
+      }
+      push_vals(frame.end_types);
+      break;
+    }
+    case WASM_OP_BR: {
+      pop_vals(label_types(label(RD_U32())));
+      unreachable();
+      break;
+    }
+    case WASM_OP_BR_IF: {
+      uint32_t depth = RD_U32();
+      pop_val(I32);
+      TypeVec types = label_types(label(depth));
+      pop_vals(types);
+      push_vals(types);
+      break;
+    }
+    case WASM_OP_BR_TABLE: {
+      uint32_t count = RD_U32();
+      std::vector<uint32_t> depths(count);
+      for (auto& d : depths) {
+        d = RD_U32();
+      }
+      uint32_t default_depth = RD_U32();
+      pop_val(I32);
+      const size_t arity = label_types(label(default_depth)).size();
+      for (auto d : depths) {
+        TypeVec types = label_types(label(d));
+        if (types.size() != arity) {
+          fail("br_table targets have different arities");
+        }
+        pop_vals(types);
+        push_vals(types);
+      }
+      pop_vals(label_types(label(default_depth)));
+      unreachable();
+      break;
+    }
+    case WASM_OP_RETURN:
+      pop_vals(ctrls_.front().end_types);
+      unreachable();
+      break;
+    case WASM_OP_CALL:
+    case WASM_OP_RETURN_CALL: {
+      uint32_t idx = RD_U32();
+      if (idx >= module_.Funcs().size()) {
+        fail("call to an unknown function");
+      }
+      const SigDecl* sig = module_.getFunc(idx)->sig;
+      pop_vals(TypeVec(sig->params.begin(), sig->params.end()));
+      if (opcode == WASM_OP_RETURN_CALL) {
+        tail_call(sig);
+      } else {
+        push_vals(TypeVec(sig->results.begin(), sig->results.end()));
+      }
+      break;
+    }
+    case WASM_OP_CALL_INDIRECT:
+    case WASM_OP_RETURN_CALL_INDIRECT: {
+      uint32_t type_idx = RD_U32();
+      uint32_t table_idx = RD_U32();
+      if (table_idx >= module_.get_num_tables()) {
+        fail("call_indirect without a table");
+      }
+      if (module_.getTable(table_idx)->reftype != WASM_TYPE_FUNCREF) {
+        fail("call_indirect through a table that is not funcref");
+      }
+      if (type_idx >= module_.get_num_sigs()) {
+        fail("call_indirect with an unknown type");
+      }
+      const SigDecl* sig = module_.getSig(type_idx);
+      pop_val(I32);
+      pop_vals(TypeVec(sig->params.begin(), sig->params.end()));
+      if (opcode == WASM_OP_RETURN_CALL_INDIRECT) {
+        tail_call(sig);
+      } else {
+        push_vals(TypeVec(sig->results.begin(), sig->results.end()));
+      }
+      break;
+    }
+    case WASM_OP_DROP:
+      pop_val();
+      break;
+    case WASM_OP_SELECT: {
+      pop_val(I32);
+      wasm_type_t t1 = pop_val();
+      wasm_type_t t2 = pop_val();
+      if (!is_num(t1) || !is_num(t2)) {
+        fail("untyped select on reference types");
+      }
+      if (t1 != t2 && t1 != kUnknown && t2 != kUnknown) {
+        fail("select operands have different types");
+      }
+      push_val(t1 == kUnknown ? t2 : t1);
+      break;
+    }
+    case WASM_OP_SELECT_T: {
+      if (RD_U32() != 1) {
+        fail("typed select must name exactly one type");
+      }
+      need(buf, 1);
+      byte t = RD_BYTE();
+      if (!is_valtype(t)) {
+        fail("invalid type for select");
+      }
+      pop_val(I32);
+      pop_val(static_cast<wasm_type_t>(t));
+      pop_val(static_cast<wasm_type_t>(t));
+      push_val(static_cast<wasm_type_t>(t));
+      break;
+    }
+    case WASM_OP_LOCAL_GET:
+    case WASM_OP_LOCAL_SET:
+    case WASM_OP_LOCAL_TEE: {
+      uint32_t idx = RD_U32();
+      if (idx >= locals_.size()) {
+        fail("local index out of range");
+      }
+      if (opcode == WASM_OP_LOCAL_GET) {
+        push_val(locals_[idx]);
+      } else {
+        pop_val(locals_[idx]);
+        if (opcode == WASM_OP_LOCAL_TEE) {
+          push_val(locals_[idx]);
+        }
+      }
+      break;
+    }
+    case WASM_OP_GLOBAL_GET:
+    case WASM_OP_GLOBAL_SET: {
+      uint32_t idx = RD_U32();
+      if (idx >= module_.get_num_globals()) {
+        fail("global index out of range");
+      }
+      const GlobalDecl* global = module_.getGlobal(idx);
+      if (opcode == WASM_OP_GLOBAL_GET) {
+        push_val(global->type);
+      } else {
+        if (!global->is_mutable) {
+          fail("global.set of an immutable global");
+        }
+        pop_val(global->type);
+      }
+      break;
+    }
+    case WASM_OP_TABLE_GET:
+    case WASM_OP_TABLE_SET: {
+      uint32_t idx = RD_U32();
+      if (idx >= module_.get_num_tables()) {
+        fail("table index out of range");
+      }
+      wasm_type_t t = module_.getTable(idx)->reftype;
+      if (opcode == WASM_OP_TABLE_GET) {
+        unary(I32, t);
+      } else {
+        pop_val(t);
+        pop_val(I32);
+      }
+      break;
+    }
+    case WASM_OP_MEMORY_SIZE:
+    case WASM_OP_MEMORY_GROW: {
+      need(buf, 1);
+      if (RD_BYTE() != 0) {
+        fail("memory index must be zero");
+      }
+      if (module_.get_num_mems() == 0) {
+        fail("memory instruction without a memory");
+      }
+      if (opcode == WASM_OP_MEMORY_GROW) {
+        pop_val(I32);
+      }
+      push_val(I32);
+      break;
+    }
+    case WASM_OP_I32_CONST:
+      RD_I32();
+      push_val(I32);
+      break;
+    case WASM_OP_I64_CONST:
+      RD_I64();
+      push_val(I64);
+      break;
+    case WASM_OP_F32_CONST:
+      need(buf, 4);
+      RD_U32_RAW();
+      push_val(F32);
+      break;
+    case WASM_OP_F64_CONST:
+      need(buf, 8);
+      RD_U64_RAW();
+      push_val(F64);
+      break;
+    case WASM_OP_REF_NULL: {
+      need(buf, 1);
+      byte t = RD_BYTE();
+      if (t != WASM_TYPE_FUNCREF && t != WASM_TYPE_EXTERNREF) {
+        fail("ref.null of a non-reference type");
+      }
+      push_val(static_cast<wasm_type_t>(t));
+      break;
+    }
+    case WASM_OP_REF_IS_NULL: {
+      if (!is_ref(pop_val())) {
+        fail("ref.is_null of a non-reference value");
+      }
+      push_val(I32);
+      break;
+    }
+    case WASM_OP_REF_FUNC: {
+      if (RD_U32() >= module_.Funcs().size()) {
+        fail("ref.func of an unknown function");
+      }
+      push_val(WASM_TYPE_FUNCREF);
+      break;
+    }
+    case WASM_OP_MEMORY_INIT:
+    case WASM_OP_MEMORY_COPY:
+    case WASM_OP_MEMORY_FILL: {
+      if (opcode == WASM_OP_MEMORY_INIT && RD_U32() >= module_.Datas().size()) {
+        fail("memory.init of an unknown data segment");
+      }
+      need(buf, opcode == WASM_OP_MEMORY_COPY ? 2 : 1);
+      RD_BYTE();
+      if (opcode == WASM_OP_MEMORY_COPY) {
+        RD_BYTE();
+      }
+      if (module_.get_num_mems() == 0) {
+        fail("memory instruction without a memory");
+      }
+      pop_val(I32);
+      pop_val(I32);
+      pop_val(I32);
+      break;
+    }
+    case WASM_OP_DATA_DROP: {
+      if (RD_U32() >= module_.Datas().size()) {
+        fail("data.drop of an unknown data segment");
+      }
+      break;
+    }
+    default:
+      // A valid instruction of a proposal the interpreters do not run
+      // either; it fails at the first call
+      throw std::runtime_error(std::string("validation of ") + opcode_table[opcode].mnemonic +
+                               " is not supported");
+  }
+}
+
+uint32_t Validator::run() {
+  const SigDecl* sig = func_->sig;
+  locals_.assign(sig->params.begin(), sig->params.end());
+  for (const auto& decl : func_->pure_locals) {
+    locals_.insert(locals_.end(), decl.count, decl.type);
+  }
+  ctrls_.push_back(CtrlFrame{WASM_OP_BLOCK, {}, TypeVec(sig->results.begin(), sig->results.end()), 0, false});
+
+  const auto& bytes = func_->code_bytes;
+  const byte* base = bytes.data();
+  auto buf = buffer_t{base, base, base + bytes.size()};
+  while (buf.ptr < buf.end) {
+    if (ctrls_.empty()) {
+      fail("instructions after the end of the function");
+    }
+    op_offset_ = buf.ptr - base;
+    Opcode_t opcode = read_opcode(buf);
+    validate_op(opcode, buf);
+    // A short immediate leaves the reader at the end; only the final end
+    // may be the last byte of the body
+    if (buf.ptr >= buf.end && !ctrls_.empty()) {
+      fail("truncated function body");
+    }
+  }
+  if (!ctrls_.empty()) {
+    fail("function body is not terminated by end");
+  }
+  return max_height_;
+}
+
+} // namespace
+
+uint32_t validate_function(const WasmModule& module, const FuncDecl* f) {
+  Validator validator(module, f);
+  uint32_t max_height = validator.run();
+  TRACE("Validated function %u: max stack height %u\n", module.getFuncIdx(f), max_height);
+  return max_height;
+}
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <array>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
@@ -8,40 +9,48 @@
 #include <vector>
 #include <unordered_map>
 
+#include <pthread.h>
+
 #include "vm.h"
+#include "dispatch.h"
+#include "validate.h"
 
 namespace {
 
-
-Value zero_value_for(wasm_type_t type) {
-  switch (type) {
-    case WASM_TYPE_I32:
-      return static_cast<std::int32_t>(0);
-    case WASM_TYPE_I64:
-      return static_cast<std::int64_t>(0);
-    case WASM_TYPE_F32:
-      return 0.0f;
-    case WASM_TYPE_F64:
-      return 0.0;
-    default:
-      throw std::runtime_error("unsupported local type for zero initialisation");
-  }
-}
-
-std::string value_to_string(const Value& value) {
-  return std::visit([](auto&& arg) { return std::to_string(arg); }, value);
+#if VM_TOS_CACHE
+inline Slot pop_cached(Slot& tos, Slot*& sp) {
+  Slot v = tos;
+  tos = *--sp;
+  return v;
 }
+#endif
 
 } // namespace
 
-WasmVM::WasmVM(const WasmModule& module) : module_(module) {
-  initialize_runtime_environment();
+WasmVM::WasmVM(std::shared_ptr<const CompiledModule> compiled, BoundsCheck bounds)
+    : compiled_(std::move(compiled)), module_(compiled_->module()), memory_(bounds),
+      main_(compiled_->main()) {
+  prepare_function_instances();
 }
 
 void WasmVM::run(std::vector<std::string> mainargs) {
+  if (call_main(mainargs)) {
+    print_final_results();
+  } else if (trap_ != Trap::None) {
+    printf("!trap\n");
+  }
+}
+
+bool WasmVM::call_main(const std::vector<std::string>& mainargs) {
+  results_.clear();
+  trap_ = Trap::None;
+  if (!compiled_->invalid().empty()) {
+    ERR("invalid module: %s\n", compiled_->invalid().c_str());
+    return false;
+  }
   if (main_ == nullptr) {
     ERR("no main function found\n");
-    return;
+    return false;
   }
 
   reset_runtime_state();
@@ -50,54 +59,48 @@ void WasmVM::run(std::vector<std::string> mainargs) {
   if (!validate_main_signature(mainargs.size())) {
     ERR("main function takes %lu arguments, but %lu were provided\n", 
         main_->sig->params.size(), mainargs.size());
-    return;
+    return false;
   }
 
   push_main_arguments(mainargs);
 
-  try
-  {
-    invoke(main_);
+  bool completed = invoke(instance_of(main_));
+  if (g_icache_stats) {
+    print_icache_stats();
   }
-  catch(const std::exception& e)
-  {
-    TRACE("Runtime error: %s\n", e.what());
-    printf("!trap\n");
-    return;
+  if (!completed) {
+    TRACE("Runtime error: %s\n", trap_message().c_str());
+    return false;
   }
 
-  print_final_results();
-
+  collect_results();
+  return true;
 }
 
-void WasmVM::print_final_results() {
-  /* * When printing f64 outputs, print them with precision of *6-digits after the decimal point*
-   * Print all expected outputs (including *!trap*) to `stdout` only, and make sure `stderr` is empty for grading
-  */
-  if (!main_) {
-    return;
-  }
-  std::vector<wasm_type_t> result_types(main_->sig->results.begin(), main_->sig->results.end());
-  size_t result_count = result_types.size();
-  if (result_count == 0) {
-    return;
-  }
+/* Move main's results off the operand stack into results_ */
+void WasmVM::collect_results() {
+  size_t result_count = main_->sig->results.size();
   if (sp() != result_count) {
     throw std::runtime_error("Operand stack size does not match expected result count");
   }
 
-  std::vector<Value> results;
-  results.reserve(result_count);
-  for (auto it = result_types.rbegin(); it != result_types.rend(); ++it) {
-    TRACE("Result type: %s\n", wasm_type_string(*it));
-    results.push_back(pop());
+  // Results are the top {result_count} slots, in order
+  const Slot* results = stack_base() + sp() - result_count;
+  for (wasm_type_t type : main_->sig->results) {
+    results_.push_back(from_slot(*results++, type));
   }
-  std::reverse(results.begin(), results.end());
+  pop_to(sp() - result_count);
+}
 
+void WasmVM::print_final_results() {
+  /* * When printing f64 outputs, print them with precision of *6-digits after the decimal point*
+   * Print all expected outputs (including *!trap*) to `stdout` only, and make sure `stderr` is empty for grading
+  */
   std::cout.precision(6);
-  for (size_t i = 0; i < result_count; ++i) {
-    const wasm_type_t type = result_types[i];
-    const Value& value = results[i];
+  auto type_it = main_->sig->results.begin();
+  for (const Value& value : results_) {
+    const wasm_type_t type = *type_it++;
+    TRACE("Result type: %s\n", wasm_type_string(type));
     if (type == WASM_TYPE_F64) {
       std::cout << std::fixed << std::get<double>(value) << std::endl;
     } else if (type == WASM_TYPE_F32) {
@@ -108,781 +111,970 @@ void WasmVM::print_final_results() {
   }
 }
 
-std::vector<Value> WasmVM::build_locals_for(const FuncDecl* f) {
-  const size_t param_count = f->sig->params.size();
-  if (sp() < param_count) {
-    throw std::runtime_error("Not enough values on the operand stack for function parameters");
-  }
+const char WasmVM::kUnprepared[] = "function is not prepared yet";
 
-  std::vector<Value> locals(param_count + f->num_pure_locals);
+FuncInst* WasmVM::instance_of(const FuncDecl* f) {
+  return &function_instances_[module_.getFuncIdx(f)];
+}
 
-  for (size_t i = 0; i < param_count; ++i) {
-    locals[param_count - 1 - i] = pop();
+/* Lay out a frame for {f} whose params start at {args}, the arguments on top
+ * of the caller's operands, and return its header. Nothing is allocated:
+ * the declared locals are zeroed in one go (zero bits are 0 for every type)
+ * and the header is written right after them. Returns null if the call
+ * traps. */
+inline FrameHeader* WasmVM::push_frame(FuncInst* f, Slot* args, FrameHeader* caller,
+                                       const Instr* ret_pc) {
+  if (f->error != nullptr && !prepare_on_call(f)) {
+    set_trap(Trap::FunctionError, f->error);
+    return nullptr;
   }
-
-  size_t next_local = param_count;
-  for (const auto& group : f->pure_locals) {
-    for (uint32_t i = 0; i < group.count; ++i) {
-      locals[next_local++] = zero_value_for(group.type);
+  Slot* declared = args + f->nparams;
+  Slot* header = args + f->nlocals;
+  // Validation computed how far this frame can grow the operand stack
+  if (header + VM_FRAME_SLOTS + f->max_stack > stack_base() + stack_capacity()) {
+    set_trap(Trap::StackOverflow);
+    return nullptr;
+  }
+  if (jit_ctx_.depth >= VM_MAX_CALL_DEPTH) {
+    set_trap(Trap::CallStackExhausted);
+    return nullptr;
+  }
+  ++jit_ctx_.depth;
+  std::memset(declared, 0, (f->nlocals - f->nparams) * sizeof(Slot));
+
+  FrameHeader* frame = reinterpret_cast<FrameHeader*>(header);
+  frame->func = f;
+  frame->ret_pc = ret_pc;
+  frame->caller = caller;
+
+  TRACE("Invoking function %u with %u locals\n", module_.getFuncIdx(f->decl), f->nlocals);
+  if (TRACE_ENABLED(VM_TRACE_CALLS)) {
+    for (uint32_t i = 0; i < f->nlocals; ++i) {
+      TRACE("  local[%u]: " SLOT_FMT "\n", i, SLOT_ARG(args[i]));
     }
   }
-  return locals;
+  return frame;
 }
 
-void WasmVM::skip_immediate(Opcode_t opcode, buffer_t &buf) {
-  switch (opcode) {
-    case WASM_OP_BLOCK:
-    case WASM_OP_LOOP:
-    case WASM_OP_IF: {
-      RD_BYTE();
-      break;
-    }
-    case WASM_OP_BR:
-    case WASM_OP_BR_IF:
-    case WASM_OP_CALL:
-    case WASM_OP_LOCAL_GET:
-    case WASM_OP_LOCAL_SET:
-    case WASM_OP_LOCAL_TEE:
-    case WASM_OP_GLOBAL_GET:
-    case WASM_OP_GLOBAL_SET:
-    case WASM_OP_MEMORY_SIZE:
-    case WASM_OP_MEMORY_GROW: {
-      RD_U32();
-      break;
-    }
-    case WASM_OP_CALL_INDIRECT: {
-      RD_U32();
-      RD_U32();
-      break;
-    }
-    case WASM_OP_BR_TABLE: {
-      uint32_t target_count = RD_U32();
-      for (uint32_t i = 0; i < target_count; ++i) {
-        RD_U32();
-      }
-      RD_U32();
-      break;
-    }
-    case WASM_OP_I32_LOAD:
-    case WASM_OP_I64_LOAD:
-    case WASM_OP_F32_LOAD:
-    case WASM_OP_F64_LOAD:
-    case WASM_OP_I32_LOAD8_S:
-    case WASM_OP_I32_LOAD8_U:
-    case WASM_OP_I32_LOAD16_S:
-    case WASM_OP_I32_LOAD16_U:
-    case WASM_OP_I32_STORE:
-    case WASM_OP_I64_STORE:
-    case WASM_OP_F32_STORE:
-    case WASM_OP_F64_STORE:
-    case WASM_OP_I32_STORE8:
-    case WASM_OP_I32_STORE16: {
-      RD_U32();
-      RD_U32();
-      break;
-    }
-    case WASM_OP_I32_CONST: {
-      RD_I32();
-      break;
-    }
-    case WASM_OP_I64_CONST: {
-      RD_I64();
-      break;
-    }
-    case WASM_OP_F32_CONST: {
-      RD_U32_RAW();
-      break;
-    }
-    case WASM_OP_F64_CONST: {
-      RD_U64_RAW();
-      break;
+bool WasmVM::invoke(FuncInst* f) {
+  trap_ = Trap::None;
+  // The arguments pushed by the caller become the callee's first locals
+  // (first registers under --regvm)
+  if (sp() < f->nparams) {
+    set_trap(Trap::CheckFailed, "Not enough values on the operand stack for function parameters");
+    return false;
+  }
+  Slot* args = stack_base() + sp() - f->nparams;
+#if VM_NATIVE
+  if ((g_jit || g_aot) && !compiled_->regvm()) {
+    return invoke_native(f, args);
+  }
+#endif
+  // With guard pages an out-of-bounds access faults out of the interpreter
+  // loop instead of returning a trap
+  bool completed = false;
+  bool in_bounds = run_guarded(memory_, [&] {
+    if (compiled_->regvm()) {
+      completed = enter_reg_frame(f, args) && execute_reg() == Trap::None;
+    } else {
+      FrameHeader* entry = push_frame(f, args, nullptr, nullptr);
+      completed = entry != nullptr && execute(entry) == Trap::None;
     }
-    default:
-      break;
+  });
+  if (!in_bounds) {
+    set_trap(Trap::MemoryOutOfBounds);
+    return false;
   }
+  return completed;
 }
 
-std::unordered_map<const byte*, CtrlMeta>  WasmVM::pre_indexing(FuncDecl* f) {
-  std::unordered_map<const byte*, CtrlMeta> ctrl_map;
-  auto ctrl_stack = std::vector<std::pair<const byte*, CtrlMeta>>{};
-  // push implicit ctrl_meta for function body
-  ctrl_stack.push_back({f->code_bytes.data(), CtrlMeta{Label::Kind::Block, nullptr, f->code_bytes.data() + f->code_bytes.size()}});
-  const auto& bytes = f->code_bytes;
-  auto buf = buffer_t{bytes.data(), bytes.data(), bytes.data() + bytes.size()};
-  while (buf.ptr < buf.end) {
-    const byte* opcode_ptr = buf.ptr;
-    Opcode_t opcode = RD_OPCODE();
-    TRACE("Pre-indexing opcode: %s at offset %ld\n", opcode_table[opcode].mnemonic, opcode_ptr - bytes.data());
-    switch (opcode) {
-      case WASM_OP_LOOP:
-      case WASM_OP_IF:
-      case WASM_OP_BLOCK: {
-        // MVP only supports the empty blocktype (0x40). Consume it and push a label.
-        uint8_t block_type = RD_BYTE();
-        if (block_type != 0x40) {
-          throw std::runtime_error("non-empty blocktype is not supported");
-        }
-        CtrlMeta meta{};
-        // meta.begin = buf.ptr;
-        meta.else_pc = nullptr;
-        meta.end = nullptr; // to be filled when matching END is seen
-        switch (opcode) {
-          case WASM_OP_LOOP:
-            meta.kind = Label::Kind::Loop;
-            break;
-          case WASM_OP_IF:
-            meta.kind = Label::Kind::If;
-            break;
-          case WASM_OP_BLOCK:
-            meta.kind = Label::Kind::Block;
-            break;
-          default:
-            throw std::runtime_error("unreachable");
-        }
-        ctrl_stack.push_back({opcode_ptr, meta});
-        break;
-      }
-      case WASM_OP_ELSE: {
-        if (ctrl_stack.empty() || ctrl_stack.back().second.kind != Label::Kind::If) {
-          throw std::runtime_error("else without matching if");
-        }
-        auto& [if_header, if_meta] = ctrl_stack.back();
-        if_meta.else_pc = buf.ptr;
-        break;
-      }
-      case WASM_OP_END: {
-        if (ctrl_stack.empty()) {
-          throw std::runtime_error("end without matching block/loop/if");
-        }
-        auto& [ctrl_header, meta] = ctrl_stack.back();
-        ctrl_stack.pop_back();
-        meta.end = opcode_ptr;
-        ctrl_map[ctrl_header] = meta;
-        break;
-      }
-      default:
-        skip_immediate(opcode, buf);
-        break;
-    }
+#if VM_NATIVE
+namespace {
+
+const NativeRuntime native_runtime = {
+  &WasmVM::jit_trap,
+  &WasmVM::native_call,
+  &WasmVM::native_call_indirect,
+};
+
+struct NativeCall {
+  JitContext* ctx;
+  const LinearMemory* memory;
+  Slot* args;
+  FuncInst* f;
+  uint32_t result;
+};
+
+/* Guard page faults land on the thread that takes them, so the landing is
+ * made here rather than in invoke_native */
+void* run_native_call(void* arg) {
+  auto* call = static_cast<NativeCall*>(arg);
+  bool in_bounds = run_guarded(*call->memory, [call] {
+    call->result = call->f->entry(call->ctx, call->args, call->f);
+  });
+  if (!in_bounds) {
+    call->result = WasmVM::jit_trap(call->ctx, static_cast<uint32_t>(Trap::MemoryOutOfBounds), nullptr);
   }
-  if (!ctrl_stack.empty()) {
-    throw std::runtime_error("unmatched block/loop/if");
+  return nullptr;
+}
+
+} // namespace
+
+/* Native code takes a machine stack frame per wasm call, so it runs on a
+ * thread whose stack has room for VM_MAX_CALL_DEPTH of them. Entering
+ * through the entry point lets main itself tier up. */
+bool WasmVM::invoke_native(FuncInst* f, Slot* args) {
+  jit_ctx_ = JitContext{this, memory_.data(), memory_.bound(), global_values_.data(),
+                        stack_base() + stack_capacity(), 0, &native_runtime};
+  NativeCall call{&jit_ctx_, &memory_, args, f, 0};
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, VM_NATIVE_STACK_SIZE);
+  if (pthread_create(&thread, &attr, run_native_call, &call) == 0) {
+    pthread_join(thread, nullptr);
+  } else {
+    run_native_call(&call);
+  }
+  pthread_attr_destroy(&attr);
+  if (call.result != 0) {
+    return false;
   }
-  return ctrl_map;
+  stack_top_ = (args - stack_base()) + f->nresults;
+  return true;
 }
 
-void WasmVM::add_frame(FuncDecl* f) {
-  auto ctrl_map = pre_indexing(f);
-  byte* start = f->code_bytes.data();
-  byte* end = start + f->code_bytes.size();
-  
-  Frame frame{};
-  frame.func = f;
-  frame.locals = build_locals_for(f);
-  frame.pc.start = start;
-  frame.pc.ptr = start;
-  frame.pc.end = end;
-  frame.stack_height_on_entry = sp();
-  frame.ctrl_map = std::move(ctrl_map);
-
-  Label function_body{};
-  function_body.kind = Label::Kind::Implicit;
-  // function_body.pc_begin = start;
-  // function_body.pc_end = end;
-  function_body.pc_else = nullptr;
-  function_body.stack_height = frame.stack_height_on_entry;
-  frame.labels.push_back(function_body);
-
-  TRACE("Invoking function with %zu locals\n", frame.locals.size());
-  for (size_t i = 0; i < frame.locals.size(); ++i) {
-    const std::string repr = value_to_string(frame.locals[i]);
-    TRACE("  local[%zu]: %s\n", i, repr.c_str());
-  }
-
-  call_stack_.push_back(std::move(frame));
-  TRACE("Pushed function frame onto call stack\n");
+uint32_t WasmVM::jit_trap(JitContext* ctx, uint32_t trap, const char* detail) {
+  return static_cast<uint32_t>(ctx->vm->set_trap(static_cast<Trap>(trap), detail));
+}
 
+uint32_t WasmVM::native_call(JitContext* ctx, Slot* args, uint32_t func_index) {
+  FuncInst* f = &ctx->vm->function_instances_[func_index];
+  return f->entry(ctx, args, f);
 }
 
-bool WasmVM::invoke(FuncDecl* f) {
-  add_frame(f);
-  
-  while (!call_stack_.empty()) {
-    run_op();
+uint32_t WasmVM::native_call_indirect(JitContext* ctx, Slot* args, uint32_t func_index,
+                                      uint32_t site, int32_t elem_index) {
+  IndirectCache& cache = ctx->vm->function_instances_[func_index].icaches[site];
+  FuncInst* target = ctx->vm->resolve_cached(cache, elem_index);
+  if (target == nullptr) {
+    return static_cast<uint32_t>(ctx->vm->trap_);
   }
-  return true;
+  return target->entry(ctx, args, target);
 }
 
-void WasmVM::run_op() {
-  if (call_stack_.empty()) {
-    throw std::runtime_error("Call stack underflow");
-  }
-  Frame& frame = call_stack_.back();
-  buffer_t &buf = frame.pc;
-  auto &ctrl_map = frame.ctrl_map;
-  // if reach end of buffer, pop the call stack and return
-  if (buf.ptr >= buf.end) {
-    throw std::runtime_error("Reached end of buffer");
-  }
-  auto header = buf.ptr;
-  // trace value of buf.ptr
-  // TRACE("Running to: %p\n", (void*)buf.ptr);
-  Opcode_t opcode = RD_OPCODE();
-  switch (opcode) {
-    case WASM_OP_I32_CONST: {
-      auto v = RD_I32();
-      TRACE("I32_CONST: %d\n", v);
-      push(v);
-      break;
-    }
-    case WASM_OP_I64_CONST: {
-      auto v = RD_I64();
-      TRACE("I64_CONST: %lld\n", v);
-      push(v);
-      break;
-    }
-    case WASM_OP_F32_CONST: {
-      uint32_t raw = RD_U32_RAW();
-      float v = raw_to_f32(raw);
-      TRACE("F32_CONST: %f\n", v);
-      push(v);
-      break;
-    }
-    case WASM_OP_F64_CONST: {
-      uint64_t raw = RD_U64_RAW();
-      double v = raw_to_f64(raw);
-      TRACE("F64_CONST: %f\n", v);
-      push(v);
-      break;
-    }
-    case WASM_OP_LOCAL_GET: {
-      uint32_t local_idx = RD_U32();
-      Frame& current_frame = call_stack_.back();
-      if (local_idx >= current_frame.locals.size()) {
-        throw std::runtime_error("local.get index out of bounds");
-      }
-      Value local_value = current_frame.locals[local_idx];
-      const std::string repr = value_to_string(local_value);
-      TRACE("LOCAL_GET: index %u value %s\n", local_idx, repr.c_str());
-      push(local_value);
-      break;
-    }
-    case WASM_OP_LOCAL_SET: {
-      auto local_idx = RD_U32();
-      auto& frame = call_stack_.back();
-      auto value = pop();
-      if (local_idx >= frame.locals.size()) {
-        throw std::runtime_error("local.set index out of bounds");
-      }
-      frame.locals[local_idx] = value;
-      TRACE("LOCAL_SET: index %u value %s\n", local_idx, value_to_string(value).c_str());
-      break;
-    }
-    case WASM_OP_LOCAL_TEE: {
-      auto local_idx = RD_U32();
-      auto& frame = call_stack_.back();
-      auto value = pop();
-      if (local_idx >= frame.locals.size()) {
-        throw std::runtime_error("local.tee index out of bounds");
-      }
-      frame.locals[local_idx] = value;
-      push(value);
-      TRACE("LOCAL_TEE: index %u value %s\n", local_idx, value_to_string(value).c_str());
-      break;
-    }
-    case WASM_OP_BLOCK: {
-      // MVP only supports the empty blocktype (0x40). Consume it and push a label.
-      uint8_t block_type = RD_BYTE();
-      if (block_type != 0x40) {
-        throw std::runtime_error("non-empty blocktype is not supported");
-      }
+/* Entry of functions that are interpreted: runs the callee as the bottom
+ * frame of a nested execute(), unless this call makes it hot enough to
+ * compile */
+uint32_t WasmVM::jit_interp_entry(JitContext* ctx, Slot* frame, FuncInst* f) {
+  WasmVM* vm = ctx->vm;
+  if (++f->hotness >= vm->tier_threshold_ && vm->tier_up(f)) {
+    return f->entry(ctx, frame, f);
+  }
+  FrameHeader* entry = vm->push_frame(f, frame, nullptr, nullptr);
+  if (entry == nullptr) {
+    return static_cast<uint32_t>(vm->trap_);
+  }
+  return static_cast<uint32_t>(vm->execute(entry));
+}
+#endif // VM_NATIVE
 
-      Frame& current_frame = call_stack_.back();
-      Label block{};
-      block.kind = Label::Kind::Block;
-      // block.pc_begin = buf.ptr;   // execution continues with the following instruction
-      block.pc_target = ctrl_map.at(header).end;
-      block.pc_else = nullptr;
-      block.stack_height = sp();
-      current_frame.labels.push_back(block);
-      TRACE("BLOCK: depth %zu\n", current_frame.labels.size());
-      break;
-    }
-    case WASM_OP_LOOP: {
-      uint8_t block_type = RD_BYTE();
-      if (block_type != 0x40) {
-        throw std::runtime_error("non-empty blocktype is not supported");
-      }
+std::string WasmVM::trap_message() const {
+  std::string message = trap_string(trap_);
+  if (trap_detail_ != nullptr) {
+    message += ": ";
+    message += trap_detail_;
+  }
+  return message;
+}
 
-      Frame& current_frame = call_stack_.back();
-      Label loop{};
-      loop.kind = Label::Kind::Loop;
-      loop.pc_target = buf.ptr;   // execution continues with the following instruction
-      loop.pc_else = nullptr;
-      loop.stack_height = sp();
-      current_frame.labels.push_back(loop);
-      TRACE("LOOP: depth %zu\n", current_frame.labels.size());
-      break;
-    }
-    case WASM_OP_IF: {
-      auto block_type = RD_BYTE();
-      if (block_type != 0x40) {
-        throw std::runtime_error("non-empty blocktype is not supported");
-      }
-      if (sp() < 1) {
-        throw std::runtime_error("Not enough values on the operand stack for if condition");
-      }
+/* The checks call_indirect makes before entering its target, shared by both
+ * tiers. Returns the target, or null with the trap recorded */
+FuncInst* WasmVM::resolve_indirect(uint32_t type_index, uint32_t table_index, int32_t elem_index) {
+  if (elem_index < 0) {
+    set_trap(Trap::TableOutOfBounds);
+    return nullptr;
+  }
+  const uint32_t imported_tables = module_.get_num_imported_tables();
+  if (table_index < imported_tables) {
+    set_trap(Trap::Unsupported, "call_indirect into an imported table");
+    return nullptr;
+  }
+  uint32_t local_table_index = table_index - imported_tables;
+  if (local_table_index >= table_instances_.size()) {
+    set_trap(Trap::TableOutOfBounds);
+    return nullptr;
+  }
+  auto& table = table_instances_[local_table_index];
+  if (static_cast<uint32_t>(elem_index) >= table.size()) {
+    set_trap(Trap::TableOutOfBounds);
+    return nullptr;
+  }
+  const TableEntry& entry = table[elem_index];
+  if (entry.func == nullptr) {
+    set_trap(Trap::NullTableEntry);
+    return nullptr;
+  }
+  // Validation checked {type_index}; equal signatures share a canonical ID
+  if (entry.sig_id != module_.getSigId(type_index)) {
+    set_trap(Trap::SignatureMismatch);
+    return nullptr;
+  }
+  return entry.func;
+}
 
-      Frame& current_frame = call_stack_.back();
-      Label if_label{};
-      if_label.kind = Label::Kind::If;
-      if_label.pc_target = ctrl_map.at(header).end;
-      if_label.pc_else = nullptr;
-      if_label.stack_height = sp();
-      current_frame.labels.push_back(if_label);
-      
-      Value condition = pop();
-      if (!std::holds_alternative<std::int32_t>(condition)) {
-        throw std::runtime_error("Condition for if is not i32");
+/* resolve_indirect() behind the inline cache of a call site. A hit skips
+ * every check: the slot held the same function when it was resolved, and
+ * no table has been written since */
+FuncInst* WasmVM::resolve_cached(IndirectCache& cache, int32_t elem_index) {
+  const uint32_t slot = static_cast<uint32_t>(elem_index);
+  if (cache.epoch == table_epoch_) [[likely]] {
+    for (uint32_t way = 0; way < cache.used; ++way) {
+      if (cache.slots[way] == slot) {
+        ++cache.hits;
+        return cache.targets[way];
       }
-      bool cond = std::get<std::int32_t>(condition) != 0;
-      if (!cond) {
-        if (ctrl_map.at(header).else_pc) {
-          buf.ptr = ctrl_map.at(header).else_pc; // enter the 'else' branch
-          TRACE("condition false, entering ELSE branch\n");
-        } else {
-          // No else branch, skip to the end of the if
-          buf.ptr = if_label.pc_target;
-          // current_frame.labels.pop_back(); // pop the if label
-          TRACE("condition false, skipping to END\n");
-        }
-      }
-      TRACE("IF: condition %d, depth %zu\n", std::get<std::int32_t>(condition), current_frame.labels.size());
-      break;
     }
-    case WASM_OP_ELSE: {
-      if (call_stack_.empty()) {
-        throw std::runtime_error("Empty call stack on else");
-      }
-      auto& current_frame = call_stack_.back();
-      if (current_frame.labels.empty() || current_frame.labels.back().kind != Label::Kind::If) {
-        throw std::runtime_error("else without matching if");
-      }
-      auto& if_label = current_frame.labels.back();
-      buf.ptr = if_label.pc_target; // skip to the end
-      current_frame.labels.pop_back(); // pop the if label
-      TRACE("ELSE\n");
-      break;
-    }
-    case WASM_OP_I32_LT_S: {
-      if (sp() < 2) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.lt_s");
-      }
-      Value val2 = pop();
-      Value val1 = pop();
-      auto result = std::get<std::int32_t>(val1) < std::get<std::int32_t>(val2) ? 1 : 0;
-      TRACE("I32_LT_S: %d < %d = %d\n", std::get<std::int32_t>(val1), std::get<std::int32_t>(val2), result);
-      push(static_cast<Value>(result));
-      break;
-    }
-    case WASM_OP_I32_EQZ: {
-      if (sp() < 1) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.eqz");
-      }
-      Value val = pop();
-      auto result = std::get<std::int32_t>(val) == 0 ? 1 : 0;
-      push(static_cast<Value>(result));
-      TRACE("I32_EQZ: %d == 0 = %d\n", std::get<std::int32_t>(val), result);
-      break;
-    }
-    case WASM_OP_I32_ADD: {
-      if (sp() < 2) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.add");
-      }
-      Value val2 = pop();
-      Value val1 = pop();
-      auto result = std::get<std::int32_t>(val1) + std::get<std::int32_t>(val2);
-      TRACE("I32_ADD: %d + %d = %d\n", std::get<std::int32_t>(val1), std::get<std::int32_t>(val2), result);
-      push(static_cast<Value>(result));
-      break;
-    }
-    case WASM_OP_I32_SUB: {
-      if (sp() < 2) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.sub");
-      }
-      Value val2 = pop();
-      Value val1 = pop();
-      auto result = std::get<std::int32_t>(val1) - std::get<std::int32_t>(val2);
-      TRACE("I32_SUB: %d - %d = %d\n", std::get<std::int32_t>(val1), std::get<std::int32_t>(val2), result);
-      push(static_cast<Value>(result));
-      break;
-    }
-    case WASM_OP_I32_LOAD: {
-      uint32_t align = RD_U32();
-      uint32_t offset = RD_U32();
-      if (sp() < 1) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.load");
-      }
-      Value addr_val = pop();
-      if (!std::holds_alternative<std::int32_t>(addr_val)) {
-        throw std::runtime_error("Address for i32.load is not i32");
-      }
-      if (std::get<std::int32_t>(addr_val) < 0) {
-        throw std::runtime_error("Address for i32.load is negative");
-      }
-      uint32_t addr = static_cast<uint32_t>(std::get<std::int32_t>(addr_val));
-      uint32_t effective_addr = addr + offset;
-      if (effective_addr + 4 > linear_memory_.size()) {
-        throw std::runtime_error("i32.load address out of bounds");
-      }
-      uint32_t loaded = 0;
-      std::memcpy(&loaded, &linear_memory_[effective_addr], sizeof(int32_t));
-      push(static_cast<Value>(static_cast<std::int32_t>(loaded)));
-      TRACE("I32_LOAD: align %u offset %u addr %u (eff %u) => %d\n", align, offset, addr, effective_addr, std::get<std::int32_t>(top()));
-      break;
-    }
-    case WASM_OP_I32_STORE: {
-      uint32_t align = RD_U32();
-      uint32_t offset = RD_U32();
-      if (sp() < 2) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.store");
-      }
-      Value val = pop();
-      Value addr_val = pop();
-      if (!std::holds_alternative<std::int32_t>(addr_val)) {
-        throw std::runtime_error("Address for i32.store is not i32");
-      }
-      if (std::get<std::int32_t>(addr_val) < 0) {
-        throw std::runtime_error("Address for i32.store is negative");
-      }
-      uint32_t addr = static_cast<uint32_t>(std::get<std::int32_t>(addr_val));
-      uint32_t effective_addr = addr + offset;
-      if (effective_addr + 4 > linear_memory_.size()) {
-        throw std::runtime_error("i32.store address out of bounds");
-      }
-      uint32_t to_store = static_cast<uint32_t>(std::get<std::int32_t>(val));
-      std::memcpy(&linear_memory_[effective_addr], &to_store, sizeof(int32_t));
-      TRACE("I32_STORE: align %u offset %u addr %u (eff %u) <= %d\n", align, offset, addr, effective_addr, std::get<std::int32_t>(val));
-      break;
-    }
-    case WASM_OP_I32_EQ: {
-      if (sp() < 2) {
-        throw std::runtime_error("Not enough values on the operand stack for i32.eq");
-      }
-      Value val2 = pop();
-      Value val1 = pop();
-      auto result = std::get<std::int32_t>(val1) == std::get<std::int32_t>(val2) ? 1 : 0;
-      TRACE("I32_EQ: %d == %d = %d\n", std::get<std::int32_t>(val1), std::get<std::int32_t>(val2), result);
-      push(static_cast<Value>(result));
-      break;
-    }
-    case WASM_OP_F64_ADD: {
-      if (sp() < 2) {
-        throw std::runtime_error("Not enough values on the operand stack for f64.add");
-      }
-      Value val2 = pop();
-      Value val1 = pop();
-      auto result = std::get<double>(val1) + std::get<double>(val2);
-      TRACE("F64_ADD: %f + %f = %f\n", std::get<double>(val1), std::get<double>(val2), result);
-      push(result);
-      break;
-    }
-    case WASM_OP_NOP: {
-      break;
-    }
-    case WASM_OP_UNREACHABLE: {
-      throw std::runtime_error("unreachable executed");
-      break;
-    }
-    case WASM_OP_END: {
-      // Close the nearest structured control construct (block/loop/if/function).
-      Frame& fr = call_stack_.back();
-      if (fr.labels.empty()) {
-        throw std::runtime_error("END encountered with no active label");
-      }
-      Label& closed = fr.labels.back();
-      fr.labels.pop_back();
-
-      // If we just closed the implicit function-body label, we must PRESERVE the function results
-      // BEFORE restoring the operand stack height; otherwise they'd be lost.
-      const bool is_function_end = fr.labels.empty();
-      if (is_function_end) {
-        const size_t retc = fr.func->sig->results.size();
-        if (sp() < retc) {
-          throw std::runtime_error("Not enough values on the operand stack for function return");
-        }
+  } else {
+    cache.epoch = table_epoch_;
+    cache.used = 0;
+    cache.next = 0;
+  }
+  ++cache.misses;
+  FuncInst* target = resolve_indirect(cache.type_index, cache.table_index, elem_index);
+  if (target == nullptr) {
+    return nullptr;
+  }
+  uint32_t way;
+  if (cache.used < VM_ICACHE_WAYS) {
+    way = cache.used++;
+  } else {
+    way = cache.next;
+    cache.next = (cache.next + 1) % VM_ICACHE_WAYS;
+  }
+  cache.slots[way] = slot;
+  cache.targets[way] = target;
+  return target;
+}
 
-        // Grab return values from the top of the stack first.
-        std::vector<Value> rets;
-        rets.reserve(retc);
-        for (size_t i = 0; i < retc; ++i) {
-          rets.push_back(pop());
-        }
-        std::reverse(rets.begin(), rets.end());
-
-        // Restore the caller's operand stack height, pop the frame, then push back returns.
-        pop_to(fr.stack_height_on_entry);
-        call_stack_.pop_back();
-        TRACE("Popping function frame, returning %lu values\n", rets.size());
-        for (auto& v : rets) {
-          push(v);
-        }
-        TRACE("Function return with %lu values\n", rets.size());
-      } else {
-        // Non-function structured end. In this project, blocks have 0 result arity,
-        // so we simply restore the operand stack height to what it was at block entry.
-        pop_to(closed.stack_height);
+/* Report the hit rate of every call_indirect site that ran (--icache-stats) */
+void WasmVM::print_icache_stats() const {
+  for (const auto& fi : function_instances_) {
+    for (size_t site = 0; site < fi.icaches.size(); ++site) {
+      const IndirectCache& cache = fi.icaches[site];
+      const uint64_t calls = cache.hits + cache.misses;
+      if (calls == 0) {
+        continue;
       }
-      break;
+      const char* kind = cache.misses <= 1 ? "monomorphic"
+                       : cache.misses <= VM_ICACHE_WAYS ? "polymorphic" : "megamorphic";
+      ERR("call_indirect site %td:%zu: %lu calls, %lu hits (%.1f%%), %s\n",
+          &fi - function_instances_.data(), site, calls, cache.hits,
+          100.0 * static_cast<double>(cache.hits) / static_cast<double>(calls), kind);
     }
-    case WASM_OP_RETURN: {
-      Frame& fr = call_stack_.back();
-      const size_t retc = fr.func->sig->results.size();
-      if (sp() < retc) {
-        throw std::runtime_error("Not enough values on the operand stack for function return");
-      }
+  }
+}
 
-      // Grab return values from the top of the stack first.
-      std::vector<Value> rets;
-      rets.reserve(retc);
-      for (size_t i = 0; i < retc; ++i) {
-        rets.push_back(pop());
-      }
-      std::reverse(rets.begin(), rets.end());
-
-      // Restore the caller's operand stack height, pop the frame, then push back returns.
-      pop_to(fr.stack_height_on_entry);
-      call_stack_.pop_back();
-      TRACE("RETURN: popping function frame, returning %lu values\n", rets.size());
-      for (auto& v : rets) {
-        push(v);
-      }
-      TRACE("Function return with %lu values\n", rets.size());
-      break;
+/* Opcodes with a handler in execute(); everything else traps */
+#define VM_HANDLED_OPS(X) \
+  X(WASM_OP_UNREACHABLE) X(WASM_OP_NOP) X(VM_OP_RETURN_IF) \
+  X(WASM_OP_IF) X(WASM_OP_ELSE) X(WASM_OP_END) X(WASM_OP_BR) X(WASM_OP_BR_IF) \
+  X(WASM_OP_RETURN) X(WASM_OP_CALL) X(WASM_OP_CALL_INDIRECT) \
+  X(WASM_OP_RETURN_CALL) X(WASM_OP_RETURN_CALL_INDIRECT) X(WASM_OP_DROP) \
+  X(WASM_OP_SELECT) X(WASM_OP_LOCAL_GET) X(WASM_OP_LOCAL_SET) X(WASM_OP_LOCAL_TEE) \
+  X(WASM_OP_GLOBAL_GET) X(WASM_OP_GLOBAL_SET) X(WASM_OP_I32_LOAD) X(WASM_OP_I32_STORE) \
+  X(WASM_OP_I32_CONST) X(WASM_OP_I64_CONST) X(WASM_OP_F32_CONST) X(WASM_OP_F64_CONST) \
+  X(WASM_OP_I32_EQZ) X(WASM_OP_I32_EQ) X(WASM_OP_I32_LT_S) X(WASM_OP_I32_ADD) \
+  X(WASM_OP_I32_SUB) X(WASM_OP_F64_ADD) \
+  X(VM_OP_LOCAL_GET2_I32_ADD) X(VM_OP_LOCAL_GET_I32_CONST_ADD) \
+  X(VM_OP_LOCAL_GET_I32_LOAD) X(VM_OP_I32_LT_S_BR_IF) X(VM_OP_I32_EQZ_BR_IF)
+
+#ifndef VM_TOS_CACHE
+#define VM_TOS_CACHE 0
+#endif
+
+#ifndef VM_CHECKED
+#define VM_CHECKED 0
+#endif
+
+/* The pc, stack pointer, locals and operand base of the running frame live
+ * in locals of execute(); the frame header only keeps what a return needs.
+ * DEPTH() is the height of the frame's own operand stack, which starts at
+ * {ops}, right after its header.
+ *
+ * With VM_TOS_CACHE the top operand is additionally kept in {tos} and {sp}
+ * points at the slot it would spill to, so a chain of pushes and pops never
+ * touches stack memory. {tos} is flushed at calls, returns and branches,
+ * which are the only places that address the stack by height. An empty
+ * operand stack spills into the header's spare slot. */
+#if VM_TOS_CACHE
+#define PUSH(v) (*sp++ = tos, tos = (v))
+#define POP() pop_cached(tos, sp)
+#define TOP() tos
+#define DEPTH() (sp - ops + 1)
+#define FLUSH_TOS() (*sp = tos)
+#define STACK_END() (sp + 1)
+#define SET_STACK_END(p) do { sp = (p) - 1; tos = *sp; } while (0)
+#else
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define TOP() (sp[-1])
+#define DEPTH() (sp - ops)
+#define FLUSH_TOS() ((void)0)
+#define STACK_END() (sp)
+#define SET_STACK_END(p) (sp = (p))
+#endif
+#define SET_DEPTH(h) do { FLUSH_TOS(); SET_STACK_END(ops + (h)); } while (0)
+
+/* Conditions that validation guarantees for every function that runs. They
+ * are only re-checked in VM_CHECKED builds, where a failure traps; the
+ * default fast path has none of them. */
+#if VM_CHECKED
+#define VALIDATED(cond, msg) if (!(cond)) [[unlikely]] { return set_trap(Trap::CheckFailed, msg); }
+#else
+#define VALIDATED(cond, msg) ((void)0)
+#endif
+
+#define NEED(n, what) \
+  VALIDATED(DEPTH() >= static_cast<ptrdiff_t>(n), "Not enough values on the operand stack for " what)
+
+/* In VM_JIT and VM_AOT builds calls made while tiering dispatch through
+ * the callee's entry: one that has been compiled runs natively on the same
+ * value stack and leaves its results where the arguments were. Interpreted
+ * callees count towards being compiled. */
+#if VM_NATIVE
+#define CALL_COMPILED(callee, args) \
+  if (Tiering && (callee->entry != &WasmVM::jit_interp_entry || \
+                  (++callee->hotness >= tier_threshold_ && tier_up(callee)))) [[unlikely]] { \
+    if (callee->entry(&jit_ctx_, args, callee) != 0) [[unlikely]] { \
+      return trap_; \
+    } \
+    SET_STACK_END(args + callee->nresults); \
+    break; \
+  }
+/* A compiled tail callee returns its results at {locals}, where the
+ * current frame's go */
+#define TAIL_CALL_COMPILED(callee) \
+  if (Tiering && (callee->entry != &WasmVM::jit_interp_entry || \
+                  (++callee->hotness >= tier_threshold_ && tier_up(callee)))) [[unlikely]] { \
+    SAVE_RETURN(); \
+    if (callee->entry(&jit_ctx_, locals, callee) != 0) [[unlikely]] { \
+      return trap_; \
+    } \
+    goto pop_frame; \
+  }
+#else
+#define CALL_COMPILED(callee, args)
+#define TAIL_CALL_COMPILED(callee)
+#endif
+
+/* Enter {f}, whose arguments are the top of the current operand stack, or
+ * stop with the trap push_frame() recorded */
+#define CALL_FUNC(f) do { \
+  FuncInst* callee = (f); \
+  FLUSH_TOS(); \
+  Slot* args = STACK_END() - callee->nparams; \
+  CALL_COMPILED(callee, args) \
+  FrameHeader* callee_frame = push_frame(callee, args, frame, pc); \
+  if (callee_frame == nullptr) [[unlikely]] { \
+    return trap_; \
+  } \
+  frame = callee_frame; \
+  ENTER_FRAME(args); \
+} while (0)
+
+/* Results are returned at {locals} and may overwrite the frame's header
+ * when there are more of them than locals, so what the return needs from
+ * the header is read first */
+#define SAVE_RETURN() do { \
+  retc = frame->func->nresults; \
+  ret_frame = frame->caller; \
+  ret_pc = frame->ret_pc; \
+} while (0)
+
+/* Replace the current frame with one for {f}, whose arguments are the top
+ * of the operand stack: they move down to the frame's locals, and the new
+ * frame returns to where the current one would have, so a chain of tail
+ * calls runs in constant space */
+#define TAIL_CALL_FUNC(f) do { \
+  FuncInst* callee = (f); \
+  FLUSH_TOS(); \
+  std::memmove(locals, STACK_END() - callee->nparams, callee->nparams * sizeof(Slot)); \
+  TAIL_CALL_COMPILED(callee) \
+  --jit_ctx_.depth; \
+  FrameHeader* callee_frame = push_frame(callee, locals, frame->caller, frame->ret_pc); \
+  if (callee_frame == nullptr) [[unlikely]] { \
+    return trap_; \
+  } \
+  frame = callee_frame; \
+  ENTER_FRAME(locals); \
+} while (0)
+
+#define ENTER_FRAME(args) do { \
+  code = frame->func->code; \
+  pc = code; \
+  locals = (args); \
+  ops = reinterpret_cast<Slot*>(frame + 1); \
+  SET_STACK_END(ops); \
+} while (0)
+
+/* Run until the entry frame returns or something traps */
+template <BoundsCheck B, bool Tiering>
+Trap WasmVM::execute_bounded(FrameHeader* entry) {
+#if VM_THREADED_DISPATCH
+  // Filled once under the guard of a local static, so instances entering
+  // on several threads never see it half-built. A statement expression
+  // rather than a lambda, as only this function can name its labels.
+  static const std::array<const void*, VM_OP_COUNT> dispatch_table = ({
+    std::array<const void*, VM_OP_COUNT> table;
+    table.fill(&&L_unhandled);
+    #define FILL_TARGET(op) table[op] = &&L_##op;
+    VM_HANDLED_OPS(FILL_TARGET)
+    #undef FILL_TARGET
+    table;
+  });
+#endif
+
+  // memory.grow is not supported, so the memory cannot move while running
+  byte* const mem = memory_.data();
+  const uint64_t mem_bound = memory_.bound();
+
+  FrameHeader* frame = entry;
+  const Instr* code;
+  const Instr* pc;
+  const Instr* ins;
+  Slot* locals;
+  Slot* ops;
+  Slot* sp;
+#if VM_TOS_CACHE
+  Slot tos;
+#endif
+  uint32_t retc;
+  FrameHeader* ret_frame;
+  const Instr* ret_pc;
+  ENTER_FRAME(reinterpret_cast<Slot*>(frame) - frame->func->nlocals);
+
+#if VM_THREADED_DISPATCH
+  DISPATCH();
+#else
+dispatch:
+  ins = pc++;
+  switch (ins->op) {
+#endif
+    TARGET(WASM_OP_I32_CONST): {
+      auto v = ins->imm.i32;
+      TRACE_INSTR("I32_CONST: %d\n", v);
+      PUSH(Slot{.i32 = v});
+      DISPATCH();
     }
-    case WASM_OP_CALL: {
-      auto func_idx = RD_U32();
-      if (func_idx >= function_instances_.size()) {
-        throw std::runtime_error("call function index out of bounds");
-      }
-      FuncDecl* f = function_instances_[func_idx];
-      add_frame(f);
-      TRACE("CALL: function index %u\n", func_idx);
-      break;
+    TARGET(WASM_OP_I64_CONST): {
+      auto v = ins->imm.i64;
+      TRACE_INSTR("I64_CONST: %ld\n", v);
+      PUSH(Slot{.i64 = v});
+      DISPATCH();
     }
-    case WASM_OP_CALL_INDIRECT: {
-      uint32_t type_index = RD_U32();
-      uint32_t table_index = RD_U32();
-
-      if (sp() < 1) {
-        throw std::runtime_error("Not enough values on the operand stack for call_indirect");
-      }
-
-      Value table_elem = pop();
-      if (!std::holds_alternative<std::int32_t>(table_elem)) {
-        throw std::runtime_error("call_indirect index is not i32");
+    TARGET(WASM_OP_F32_CONST): {
+      float v = ins->imm.f32;
+      TRACE_INSTR("F32_CONST: %f\n", v);
+      PUSH(Slot{.f32 = v});
+      DISPATCH();
+    }
+    TARGET(WASM_OP_F64_CONST): {
+      double v = ins->imm.f64;
+      TRACE_INSTR("F64_CONST: %f\n", v);
+      PUSH(Slot{.f64 = v});
+      DISPATCH();
+    }
+    TARGET(WASM_OP_LOCAL_GET): {
+      uint32_t local_idx = ins->a;
+      VALIDATED(local_idx < frame->func->nlocals, "local.get index out of bounds");
+      Slot local_value = locals[local_idx];
+      TRACE_INSTR("LOCAL_GET: index %u value " SLOT_FMT "\n", local_idx, SLOT_ARG(local_value));
+      PUSH(local_value);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_LOCAL_SET): {
+      auto local_idx = ins->a;
+      NEED(1, "local.set");
+      auto value = POP();
+      VALIDATED(local_idx < frame->func->nlocals, "local.set index out of bounds");
+      locals[local_idx] = value;
+      TRACE_INSTR("LOCAL_SET: index %u value " SLOT_FMT "\n", local_idx, SLOT_ARG(value));
+      DISPATCH();
+    }
+    TARGET(WASM_OP_LOCAL_TEE): {
+      auto local_idx = ins->a;
+      NEED(1, "local.tee");
+      auto value = TOP();
+      VALIDATED(local_idx < frame->func->nlocals, "local.tee index out of bounds");
+      locals[local_idx] = value;
+      TRACE_INSTR("LOCAL_TEE: index %u value " SLOT_FMT "\n", local_idx, SLOT_ARG(value));
+      DISPATCH();
+    }
+    TARGET(WASM_OP_IF): {
+      NEED(1, "if condition");
+      int32_t condition = POP().i32;
+      if (condition == 0) {
+        // Enter the 'else' arm, or continue after the if if there is none
+        pc = code + ins->a;
+        TRACE_INSTR("condition false, skipping to ELSE/END\n");
       }
-
-      int32_t signed_idx = std::get<std::int32_t>(table_elem);
-      if (signed_idx < 0) {
-        throw std::runtime_error("call_indirect index out of bounds");
+      TRACE_INSTR("IF: condition %d\n", condition);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_ELSE): {
+      // End of the 'then' arm: skip the else arm
+      pc = code + ins->a;
+      TRACE_INSTR("ELSE\n");
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_LT_S): {
+      NEED(2, "i32.lt_s");
+      int32_t val2 = POP().i32;
+      int32_t val1 = POP().i32;
+      int32_t result = val1 < val2 ? 1 : 0;
+      TRACE_INSTR("I32_LT_S: %d < %d = %d\n", val1, val2, result);
+      PUSH(Slot{.i32 = result});
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_EQZ): {
+      NEED(1, "i32.eqz");
+      int32_t val = POP().i32;
+      int32_t result = val == 0 ? 1 : 0;
+      PUSH(Slot{.i32 = result});
+      TRACE_INSTR("I32_EQZ: %d == 0 = %d\n", val, result);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_ADD): {
+      NEED(2, "i32.add");
+      int32_t val2 = POP().i32;
+      int32_t val1 = POP().i32;
+      int32_t result = static_cast<int32_t>(static_cast<uint32_t>(val1) + static_cast<uint32_t>(val2));
+      TRACE_INSTR("I32_ADD: %d + %d = %d\n", val1, val2, result);
+      PUSH(Slot{.i32 = result});
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_SUB): {
+      NEED(2, "i32.sub");
+      int32_t val2 = POP().i32;
+      int32_t val1 = POP().i32;
+      int32_t result = static_cast<int32_t>(static_cast<uint32_t>(val1) - static_cast<uint32_t>(val2));
+      TRACE_INSTR("I32_SUB: %d - %d = %d\n", val1, val2, result);
+      PUSH(Slot{.i32 = result});
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_LOAD): {
+      uint32_t align = ins->imm.b;
+      uint32_t offset = ins->a;
+      NEED(1, "i32.load");
+      uint32_t addr = POP().i32;
+      uint64_t effective_addr = static_cast<uint64_t>(addr) + offset;
+      byte* p = linear_address<B>(mem, mem_bound, effective_addr, 4);
+      if (B == BoundsCheck::Explicit && p == nullptr) [[unlikely]] {
+        return set_trap(Trap::MemoryOutOfBounds);
       }
-      uint32_t elem_index = static_cast<uint32_t>(signed_idx);
-
-      const uint32_t imported_tables = module_.get_num_imported_tables();
-      if (table_index < imported_tables) {
-        throw std::runtime_error("call_indirect into imported table not supported");
+      int32_t loaded = 0;
+      std::memcpy(&loaded, p, sizeof(int32_t));
+      PUSH(Slot{.i32 = loaded});
+      TRACE_INSTR("I32_LOAD: align %u offset %u addr %u (eff %lu) => %d\n", align, offset, addr, effective_addr, loaded);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_STORE): {
+      uint32_t align = ins->imm.b;
+      uint32_t offset = ins->a;
+      NEED(2, "i32.store");
+      int32_t val = POP().i32;
+      uint32_t addr = POP().i32;
+      uint64_t effective_addr = static_cast<uint64_t>(addr) + offset;
+      byte* p = linear_address<B>(mem, mem_bound, effective_addr, 4);
+      if (B == BoundsCheck::Explicit && p == nullptr) [[unlikely]] {
+        return set_trap(Trap::MemoryOutOfBounds);
       }
-
-      uint32_t local_table_index = table_index - imported_tables;
-      if (local_table_index >= table_instances_.size()) {
-        throw std::runtime_error("call_indirect table index out of bounds");
+      std::memcpy(p, &val, sizeof(int32_t));
+      TRACE_INSTR("I32_STORE: align %u offset %u addr %u (eff %lu) <= %d\n", align, offset, addr, effective_addr, val);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_I32_EQ): {
+      NEED(2, "i32.eq");
+      int32_t val2 = POP().i32;
+      int32_t val1 = POP().i32;
+      int32_t result = val1 == val2 ? 1 : 0;
+      TRACE_INSTR("I32_EQ: %d == %d = %d\n", val1, val2, result);
+      PUSH(Slot{.i32 = result});
+      DISPATCH();
+    }
+    TARGET(WASM_OP_F64_ADD): {
+      NEED(2, "f64.add");
+      double val2 = POP().f64;
+      double val1 = POP().f64;
+      double result = val1 + val2;
+      TRACE_INSTR("F64_ADD: %f + %f = %f\n", val1, val2, result);
+      PUSH(Slot{.f64 = result});
+      DISPATCH();
+    }
+    /* Superinstructions; local indices were checked at translation time */
+    TARGET(VM_OP_LOCAL_GET2_I32_ADD): {
+      int32_t val1 = locals[ins->a].i32;
+      int32_t val2 = locals[ins->imm.b].i32;
+      int32_t result = static_cast<int32_t>(static_cast<uint32_t>(val1) + static_cast<uint32_t>(val2));
+      TRACE_INSTR("LOCAL_GET2_I32_ADD: local %u + local %u = %d\n", ins->a, ins->imm.b, result);
+      PUSH(Slot{.i32 = result});
+      DISPATCH();
+    }
+    TARGET(VM_OP_LOCAL_GET_I32_CONST_ADD): {
+      int32_t val1 = locals[ins->a].i32;
+      int32_t result = static_cast<int32_t>(static_cast<uint32_t>(val1) + static_cast<uint32_t>(ins->imm.i32));
+      TRACE_INSTR("LOCAL_GET_I32_CONST_ADD: local %u + %d = %d\n", ins->a, ins->imm.i32, result);
+      PUSH(Slot{.i32 = result});
+      DISPATCH();
+    }
+    TARGET(VM_OP_LOCAL_GET_I32_LOAD): {
+      uint32_t offset = ins->imm.b;
+      uint32_t addr = locals[ins->a].i32;
+      uint64_t effective_addr = static_cast<uint64_t>(addr) + offset;
+      byte* p = linear_address<B>(mem, mem_bound, effective_addr, 4);
+      if (B == BoundsCheck::Explicit && p == nullptr) [[unlikely]] {
+        return set_trap(Trap::MemoryOutOfBounds);
       }
-
-      auto& table = table_instances_[local_table_index];
-      if (elem_index >= table.size()) {
-        throw std::runtime_error("call_indirect table element out of bounds");
+      int32_t loaded = 0;
+      std::memcpy(&loaded, p, sizeof(int32_t));
+      PUSH(Slot{.i32 = loaded});
+      TRACE_INSTR("LOCAL_GET_I32_LOAD: local %u offset %u addr %u (eff %lu) => %d\n", ins->a, offset, addr, effective_addr, loaded);
+      DISPATCH();
+    }
+    TARGET(VM_OP_I32_LT_S_BR_IF): {
+      NEED(2, "i32.lt_s");
+      int32_t val2 = POP().i32;
+      int32_t val1 = POP().i32;
+      TRACE_INSTR("I32_LT_S_BR_IF: %d < %d\n", val1, val2);
+      if (val1 < val2) {
+        goto do_branch;
       }
-
-      FuncDecl* target = table[elem_index];
-      if (target == nullptr) {
-        throw std::runtime_error("call_indirect null table entry");
+      DISPATCH();
+    }
+    TARGET(VM_OP_I32_EQZ_BR_IF): {
+      NEED(1, "i32.eqz");
+      int32_t val = POP().i32;
+      TRACE_INSTR("I32_EQZ_BR_IF: %d == 0\n", val);
+      if (val == 0) {
+        goto do_branch;
       }
-
-      SigDecl* expected_sig = module_.getSig(type_index);
-      if (expected_sig == nullptr) {
-        throw std::runtime_error("call_indirect bad type index");
+      DISPATCH();
+    }
+    TARGET(WASM_OP_NOP): {
+      DISPATCH();
+    }
+    TARGET(WASM_OP_UNREACHABLE): {
+      return set_trap(Trap::Unreachable);
+    }
+    TARGET(WASM_OP_END): {
+      // Only the end of the function body survives lowering
+      goto do_return;
+    }
+    TARGET(WASM_OP_RETURN): {
+      goto do_return;
+    }
+    TARGET(VM_OP_RETURN_IF): {
+      NEED(1, "br_if");
+      int32_t cond = POP().i32;
+      TRACE_INSTR("RETURN_IF condition %d\n", cond);
+      if (cond == 0) {
+        DISPATCH();
       }
-
-      if (*(target->sig) != *expected_sig) {
-        throw std::runtime_error("call_indirect signature mismatch");
+      goto do_return;
+    }
+    TARGET(WASM_OP_CALL): {
+      // Callee index was bounds-checked at translation time
+      TRACE("CALL: function index %u\n", ins->a);
+      CALL_FUNC(&function_instances_[ins->a]);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_CALL_INDIRECT): {
+      NEED(1, "call_indirect");
+      int32_t elem_index = POP().i32;
+      FuncInst* target = resolve_cached(frame->func->icaches[ins->imm.call.site], elem_index);
+      if (target == nullptr) [[unlikely]] {
+        return trap_;
       }
 
-      TRACE("CALL_INDIRECT: table %u index %u\n", table_index, elem_index);
-      add_frame(target);
-      break;
+      TRACE("CALL_INDIRECT: table %u index %d\n", ins->imm.call.table, elem_index);
+      CALL_FUNC(target);
+      DISPATCH();
     }
-    case WASM_OP_DROP: {
-      if (sp() < 1) {
-        throw std::runtime_error("Not enough values on the operand stack for drop");
-      }
-      Value dropped = pop();
-      const std::string repr = value_to_string(dropped);
-      TRACE("DROP: %s\n", repr.c_str());
-      break;
-    }
-    case WASM_OP_SELECT: {
-      if (sp() < 3) {
-        throw std::runtime_error("Not enough values on the operand stack for select");
-      }
-      Value condition = pop();
-      if (!std::holds_alternative<std::int32_t>(condition)) {
-        throw std::runtime_error("Condition for select is not i32");
-      }
-      Value val2 = pop();
-      Value val1 = pop();
-      bool cond = std::get<std::int32_t>(condition) != 0;
-      Value selected = cond ? val1 : val2;
-      const std::string repr = value_to_string(selected);
-      TRACE("SELECT: condition %d, selected %s\n", std::get<std::int32_t>(condition), repr.c_str());
-      push(selected);
-      break;
-    }
-    case WASM_OP_BR: {
-      auto label_idx = RD_U32();
-      Frame& fr = call_stack_.back();
-      // trace these indexes
-      if (label_idx >= fr.labels.size()) {
-        throw std::runtime_error("br label index out of bounds");
-      }
-      Label& target_label = fr.labels[fr.labels.size() - label_idx - 1];
-      // trace label kind
-      fr.labels.resize(fr.labels.size() - label_idx); // pop labels up to and including target
-      operand_stack_.resize(target_label.stack_height); // restore operand stack height
-      buf.ptr = target_label.pc_target;
-      TRACE("BR to label index %u of kind %d (total depth %zu)\n", label_idx, static_cast<int>(target_label.kind), fr.labels.size());
-      break;
-    }
-    case WASM_OP_BR_IF: {
-      auto label_idx = RD_U32();
-      if (sp() < 1) {
-        throw std::runtime_error("Not enough values on the operand stack for br_if");
-      }
-      auto cond = pop();
-      TRACE("BR_IF condition %d\n", std::get<std::int32_t>(cond));
-      if (!std::holds_alternative<std::int32_t>(cond)) {
-        throw std::runtime_error("Condition for br_if is not i32");
-      }
-      if (std::get<std::int32_t>(cond) != 0) {
-        Frame& fr = call_stack_.back();
-        if (label_idx >= fr.labels.size()) {
-          throw std::runtime_error("br_if label index out of bounds");
-        }
-        Label& target_label = fr.labels[fr.labels.size() - label_idx - 1];
-        // trace value of buf.ptr
-        TRACE("BR_IF to buf.ptr %p\n", (void*)buf.ptr);
-        buf.ptr = target_label.pc_target;
-        fr.labels.pop_back(); // pop labels up to and including target
-        TRACE("BR_IF to label index %u of kind %d (total depth %zu)\n", label_idx, static_cast<int>(target_label.kind), fr.labels.size());
-      } else {
-        TRACE("BR_IF not taken\n");
-      }
-      break;
+    TARGET(WASM_OP_RETURN_CALL): {
+      TRACE("RETURN_CALL: function index %u\n", ins->a);
+      TAIL_CALL_FUNC(&function_instances_[ins->a]);
+      DISPATCH();
     }
-    case WASM_OP_GLOBAL_GET: {
-      auto global_idx = RD_U32();
-      if (global_idx >= global_values_.size()) {
-        throw std::runtime_error("global.get index out of bounds");
+    TARGET(WASM_OP_RETURN_CALL_INDIRECT): {
+      NEED(1, "return_call_indirect");
+      int32_t elem_index = POP().i32;
+      FuncInst* target = resolve_cached(frame->func->icaches[ins->imm.call.site], elem_index);
+      if (target == nullptr) [[unlikely]] {
+        return trap_;
       }
-      Value global_value = global_values_[global_idx];
-      const std::string repr = value_to_string(global_value);
-      TRACE("GLOBAL_GET: index %u value %s\n", global_idx, repr.c_str());
-      push(global_value);
-      break;
-    }
-    case WASM_OP_GLOBAL_SET: {
-      auto global_idx = RD_U32();
-      auto value = pop();
-      if (global_idx >= global_values_.size()) {
-        throw std::runtime_error("global.set index out of bounds");
+      TRACE("RETURN_CALL_INDIRECT: table %u index %d\n", ins->imm.call.table, elem_index);
+      TAIL_CALL_FUNC(target);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_DROP): {
+      NEED(1, "drop");
+      Slot dropped = POP();
+      TRACE_INSTR("DROP: " SLOT_FMT "\n", SLOT_ARG(dropped));
+      DISPATCH();
+    }
+    TARGET(WASM_OP_SELECT): {
+      NEED(3, "select");
+      int32_t condition = POP().i32;
+      Slot val2 = POP();
+      Slot val1 = POP();
+      Slot selected = condition != 0 ? val1 : val2;
+      TRACE_INSTR("SELECT: condition %d, selected " SLOT_FMT "\n", condition, SLOT_ARG(selected));
+      PUSH(selected);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_BR_IF): {
+      NEED(1, "br_if");
+      int32_t cond = POP().i32;
+      TRACE_INSTR("BR_IF condition %d\n", cond);
+      if (cond == 0) {
+        TRACE_INSTR("BR_IF not taken\n");
+        DISPATCH();
       }
+      goto do_branch;
+    }
+    TARGET(WASM_OP_BR): {
+      goto do_branch;
+    }
+    TARGET(WASM_OP_GLOBAL_GET): {
+      auto global_idx = ins->a;
+      VALIDATED(global_idx < global_values_.size(), "global.get index out of bounds");
+      Slot global_value = global_values_[global_idx];
+      TRACE_INSTR("GLOBAL_GET: index %u value " SLOT_FMT "\n", global_idx, SLOT_ARG(global_value));
+      PUSH(global_value);
+      DISPATCH();
+    }
+    TARGET(WASM_OP_GLOBAL_SET): {
+      auto global_idx = ins->a;
+      NEED(1, "global.set");
+      auto value = POP();
+      VALIDATED(global_idx < global_values_.size(), "global.set index out of bounds");
       global_values_[global_idx] = value;
-      TRACE("GLOBAL_SET: index %u value %s\n", global_idx, value_to_string(value).c_str());
-      break;
+      TRACE_INSTR("GLOBAL_SET: index %u value " SLOT_FMT "\n", global_idx, SLOT_ARG(value));
+      DISPATCH();
     }
 
+#if VM_THREADED_DISPATCH
+  L_unhandled:
+#else
     default:
-      ERR("Unknown init expr opcode: %x(%s)\n", opcode, opcode_table[opcode].mnemonic);
-      throw std::runtime_error("Opcode error");
+#endif
+    {
+      Opcode_t opcode = (ins->op == VM_OP_UNSUPPORTED) ? ins->a : ins->op;
+      return set_trap(Trap::UnsupportedOpcode, opcode_table[opcode].mnemonic);
+    }
+#if !VM_THREADED_DISPATCH
+  }
+#endif
+
+do_branch: {
+    // Blocks have no results, so the target label's height is all that is
+    // left of the operand stack; branches to the function label were lowered
+    // to returns
+    SET_DEPTH(ins->imm.br.height);
+    pc = code + ins->imm.br.target;
+    TRACE_INSTR("BR to label index %u (height %u)\n", ins->a, ins->imm.br.height);
+#if VM_JIT
+    // A back-edge: a loop that gets hot moves the frame into compiled code
+    // at the loop header, which then runs the function to its end
+    if (Tiering && pc <= ins && ++frame->func->hotness >= tier_threshold_) [[unlikely]] {
+      FuncInst* f = frame->func;
+      JitFn osr = (f->entry != &WasmVM::jit_interp_entry || tier_up(f)) ? osr_entry(f, pc) : nullptr;
+      if (osr != nullptr) {
+        TRACE("OSR into function %td at %td\n", f - function_instances_.data(), pc - code);
+        FLUSH_TOS();
+        SAVE_RETURN();
+        // The compiled frame counts towards the call depth in place of this one
+        --jit_ctx_.depth;
+        if (osr(&jit_ctx_, locals, f) != 0) {
+          return trap_;
+        }
+        ++jit_ctx_.depth;
+        // The results are where this frame returns them
+        goto pop_frame;
+      }
+    }
+#endif
+    DISPATCH();
   }
 
-}
-
-
-void WasmVM::initialize_runtime_environment() {
-  cache_linear_memory_layout();
-  cache_table_layout();
-  resolve_main_entrypoint();
-}
+do_return: {
+    SAVE_RETURN();
+    NEED(retc, "function return");
 
-void WasmVM::cache_linear_memory_layout() {
-  initial_linear_memory_pages_ = 0;
-  if (module_.get_num_mems() > module_.get_num_imported_mems()) {
-    auto idx = module_.get_num_imported_mems();
-    initial_linear_memory_pages_ = module_.getMemory(idx)->limits.initial;
+    // Move the results down to where the params started, which is the top
+    // of the caller's operand stack once this frame is gone
+    FLUSH_TOS();
+    const Slot* top = STACK_END();
+    std::copy(top - retc, top, locals);
   }
-}
-
-void WasmVM::cache_table_layout() {
-  local_table_initial_sizes_.clear();
-  const uint32_t total_tables = module_.get_num_tables();
-  const uint32_t imported_tables = module_.get_num_imported_tables();
-  if (total_tables > imported_tables) {
-    local_table_initial_sizes_.reserve(total_tables - imported_tables);
-    for (auto idx = imported_tables; idx < total_tables; idx++) {
-      auto table_size = module_.getTable(idx)->limits.initial;
-      local_table_initial_sizes_.push_back(table_size);
+pop_frame: {
+    Slot* results_end = locals + retc;
+    --jit_ctx_.depth;
+    TRACE("Popping function frame, returning %u values\n", retc);
+    if (ret_frame == nullptr) {
+      stack_top_ = results_end - stack_base();
+      return Trap::None;
     }
+    pc = ret_pc;
+    frame = ret_frame;
+    code = frame->func->code;
+    locals = reinterpret_cast<Slot*>(frame) - frame->func->nlocals;
+    ops = reinterpret_cast<Slot*>(frame + 1);
+    SET_STACK_END(results_end);
+    DISPATCH();
   }
 }
 
-void WasmVM::resolve_main_entrypoint() {
-  auto exports = module_.Exports();
-  auto it = std::find_if(exports.begin(), exports.end(),
-      [](auto const& exp) { return exp.name == "main" && exp.kind == KIND_FUNC; });
-  main_ = (it != exports.end()) ? it->desc.func : nullptr;
+#undef PUSH
+#undef POP
+#undef TOP
+#undef DEPTH
+#undef FLUSH_TOS
+#undef STACK_END
+#undef SET_STACK_END
+#undef SET_DEPTH
+#undef NEED
+#undef VALIDATED
+#undef CALL_FUNC
+#undef CALL_COMPILED
+#undef TAIL_CALL_FUNC
+#undef TAIL_CALL_COMPILED
+#undef SAVE_RETURN
+#undef ENTER_FRAME
+
+
+Trap WasmVM::execute(FrameHeader* entry) {
+#if VM_NATIVE
+  if (tiering_) {
+    switch (memory_.strategy()) {
+      case BoundsCheck::GuardPages: return execute_bounded<BoundsCheck::GuardPages, true>(entry);
+      case BoundsCheck::Mask: return execute_bounded<BoundsCheck::Mask, true>(entry);
+      default: return execute_bounded<BoundsCheck::Explicit, true>(entry);
+    }
+  }
+#endif
+  switch (memory_.strategy()) {
+    case BoundsCheck::GuardPages: return execute_bounded<BoundsCheck::GuardPages, false>(entry);
+    case BoundsCheck::Mask: return execute_bounded<BoundsCheck::Mask, false>(entry);
+    default: return execute_bounded<BoundsCheck::Explicit, false>(entry);
+  }
 }
 
 void WasmVM::prepare_globals_storage() {
   global_values_.clear();
   global_values_.reserve(module_.Globals().size());
   for (const auto& glob : module_.Globals()) {
-    global_values_.push_back(glob.init_value);
+    global_values_.push_back(to_slot(glob.init_value));
   }
   // trace all values in global_values_
   TRACE("Number of globals: %zu\n", global_values_.size());
-  for (size_t i = 0; i < global_values_.size(); ++i) {
-    const std::string repr = value_to_string(global_values_[i]);
-    TRACE("  global[%zu]: %s\n", i, repr.c_str());
+  if (TRACE_ENABLED(VM_TRACE_CALLS)) {
+    for (size_t i = 0; i < global_values_.size(); ++i) {
+      TRACE("  global[%zu]: " SLOT_FMT "\n", i, SLOT_ARG(global_values_[i]));
+    }
   }
 }
 
 void WasmVM::prepare_data_segments() {
   for (const auto& seg : module_.Datas()) {
     uint32_t offset = seg.mem_offset;
-    if (offset + seg.bytes.size() > linear_memory_.size()) {
+    if (offset + seg.bytes.size() > memory_.size()) {
       throw std::runtime_error("Data segment does not fit in linear memory");
     }
-    std::memcpy(&linear_memory_[offset], seg.bytes.data(), seg.bytes.size());
+    std::memcpy(memory_.data() + offset, seg.bytes.data(), seg.bytes.size());
   }
 }
 
 void WasmVM::prepare_function_instances() {
+  const auto& funcs = compiled_->funcs();
   function_instances_.clear();
-  function_instances_.reserve(module_.Funcs().size());
-  for (auto& func : module_.Funcs()) {
-    function_instances_.push_back(&func);
+  function_instances_.reserve(funcs.size());
+  for (const auto& fc : funcs) {
+    FuncInst fi{&fc, fc.decl};
+    fi.nparams = fc.nparams;
+    fi.nlocals = fc.nlocals;
+    fi.nresults = fc.nresults;
+    if (compiled_->lazy()) {
+      fi.error = kUnprepared;
+    } else {
+      bind_body(fi);
+    }
+    function_instances_.push_back(std::move(fi));
+  }
+  // Only stack code is compiled to native code
+  if (!compiled_->invalid().empty() || compiled_->regvm()) {
+    return;
+  }
+  // Native tiers that compile the whole module need every body now
+  if (compiled_->lazy() && (g_aot || (g_jit && g_jit_threshold == 0))) {
+    for (auto& fi : function_instances_) {
+      compiled_->prepare(static_cast<uint32_t>(&fi - function_instances_.data()));
+      bind_body(fi);
+    }
+  }
+#if VM_NATIVE
+  // Everything starts in the interpreter; under --jit, functions are
+  // compiled once they get hot, or all at once with a threshold of 0
+  for (auto& fi : function_instances_) {
+    fi.entry = &WasmVM::jit_interp_entry;
+  }
+#endif
+#if VM_AOT
+  if (g_aot) {
+    tiering_ = load_aot();
+    if (!tiering_) {
+      ERR("--aot: cannot build native code for the module; interpreting\n");
+    }
+  }
+#endif
+#if VM_JIT
+  if (g_jit) {
+    tiering_ = true;
+    tier_threshold_ = static_cast<uint32_t>(g_jit_threshold);
+    if (tier_threshold_ == 0) {
+      std::vector<FuncInst*> all;
+      for (auto& fi : function_instances_) {
+        all.push_back(&fi);
+      }
+      compile_jit(all);
+    }
+  }
+#endif
+}
+
+void WasmVM::bind_body(FuncInst& fi) {
+  const FuncCode& fc = *fi.body;
+  fi.code = fc.code.data();
+  fi.rcode = fc.rcode.data();
+  fi.max_stack = fc.max_stack;
+  fi.nregs = fc.nregs;
+  fi.error = fc.error.empty() ? nullptr : fc.error.c_str();
+  fi.icaches.resize(fc.sites.size());
+  for (size_t site = 0; site < fc.sites.size(); ++site) {
+    fi.icaches[site].type_index = fc.sites[site].type_index;
+    fi.icaches[site].table_index = fc.sites[site].table_index;
+  }
+}
+
+bool WasmVM::prepare_on_call(FuncInst* f) {
+  if (f->error != kUnprepared) {
+    return false;
   }
+  compiled_->prepare(static_cast<uint32_t>(f - function_instances_.data()));
+  bind_body(*f);
+  TRACE("Prepared function %td on its first call\n", f - function_instances_.data());
+  return f->error == nullptr;
 }
 
 void WasmVM::prepare_element_segments() {
@@ -914,26 +1106,35 @@ void WasmVM::prepare_element_segments() {
       if (cursor >= table.size()) {
         throw std::runtime_error("Element segment exceeds table bounds");
       }
-      table[cursor++] = func_ptr;
+      table[cursor++] = TableEntry{instance_of(func_ptr), func_ptr->sig_id};
     }
   }
 }
 
 void WasmVM::reset_runtime_state() {
-  linear_memory_.assign(initial_linear_memory_pages_ * WASM_PAGE_SIZE, 0);
+  memory_.reset(compiled_->initial_memory_pages());
 
+  const auto& table_sizes = compiled_->local_table_sizes();
   table_instances_.clear();
-  table_instances_.reserve(local_table_initial_sizes_.size());
-  for (auto table_size : local_table_initial_sizes_) {
-    table_instances_.emplace_back(table_size, nullptr);
+  table_instances_.reserve(table_sizes.size());
+  for (auto table_size : table_sizes) {
+    table_instances_.emplace_back(table_size, TableEntry{nullptr, 0});
   }
 
-  operand_stack_.clear();
-  call_stack_.clear();
+  operand_stack_.resize(VM_STACK_SLOTS + 1);
+  stack_top_ = 0;
+  jit_ctx_.depth = 0;
+  reg_call_stack_.clear();
+  // The register tier's frame stack is sized for the deepest call allowed,
+  // so calls and returns never allocate
+  if (compiled_->regvm()) {
+    reg_call_stack_.reserve(VM_MAX_CALL_DEPTH);
+  }
   prepare_globals_storage();
   prepare_data_segments();
-  prepare_function_instances();
   prepare_element_segments();
+  // The tables were rebuilt: nothing a call site cached still holds
+  ++table_epoch_;
 }
 
 bool WasmVM::validate_main_signature(size_t argc) const {
@@ -944,6 +1145,6 @@ void WasmVM::push_main_arguments(const std::vector<std::string>& mainargs) {
   auto it = main_->sig->params.begin();
   for (size_t i = 0; i < mainargs.size(); i++) {
     auto type = *(it++);
-    operand_stack_.push_back(make_from(mainargs[i], type));
+    push(to_slot(make_from(mainargs[i], type)));
   }
 }
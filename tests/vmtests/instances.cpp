@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parse.h"
+#include "vm.h"
+#include "modules.h"
+
+/* Instances of one CompiledModule running main at the same time on their
+ * own threads, each with its own memory and bounds check. None may see
+ * another's memory or stacks, and the shared module must be safe to enter
+ * from all of them at once. The same module compiled for the register tier
+ * runs beside it: each instance runs the tier its module holds. */
+int main() {
+  CompileOptions stack_tier;
+  stack_tier.regvm = false;
+  CompileOptions register_tier;
+  register_tier.regvm = true;
+  auto stack_module = CompiledModule::compile(parse_bytecode(kSumModule, kSumModule + sizeof(kSumModule)),
+                                              stack_tier);
+  auto register_module = CompiledModule::compile(parse_bytecode(kSumModule, kSumModule + sizeof(kSumModule)),
+                                                 register_tier);
+
+  struct Instance {
+    const std::shared_ptr<const CompiledModule>& compiled;
+    BoundsCheck bounds;
+    int32_t n;
+    int failures;
+  };
+  std::vector<Instance> instances = {
+    {stack_module, BoundsCheck::Explicit, 20000, 0},
+    {stack_module, BoundsCheck::GuardPages, 30000, 0},
+    {stack_module, BoundsCheck::Mask, 25000, 0},
+    {stack_module, BoundsCheck::Explicit, 7, 0},
+    {register_module, BoundsCheck::Explicit, 15000, 0},
+    {register_module, BoundsCheck::GuardPages, 9, 0},
+  };
+  std::vector<std::thread> threads;
+  for (auto& instance : instances) {
+    threads.emplace_back([&instance] {
+      WasmVM vm(instance.compiled, instance.bounds);
+      for (int run = 0; run < 20; ++run) {
+        bool completed = vm.call_main({std::to_string(instance.n)});
+        const auto& results = vm.results();
+        if (!completed || results.size() != 1 || std::get<int32_t>(results[0]) != sum_below(instance.n)) {
+          ++instance.failures;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  int failed = 0;
+  for (const auto& instance : instances) {
+    if (instance.failures > 0) {
+      fprintf(stderr, "%s-tier instance with --bounds %s and n = %d: %d of 20 runs went wrong\n",
+              instance.compiled->regvm() ? "register" : "stack", bounds_check_name(instance.bounds),
+              instance.n, instance.failures);
+      failed = 1;
+    }
+  }
+  return failed;
+}
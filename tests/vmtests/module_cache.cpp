@@ -0,0 +1,205 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <csignal>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "parse.h"
+#include "vm.h"
+#include "modules.h"
+
+/* --module-cache: a warm start runs the module from its cache file, and a
+ * damaged one is either rejected and rewritten or still runs safely. Every
+ * word of the file is altered in turn; code that gets past the checks may
+ * compute a wrong result, trap or loop, but never crash. */
+
+namespace {
+
+const int32_t kArg = 10;
+
+std::string g_dir;
+CompileOptions g_options;
+
+std::string read_file(const std::string& path) {
+  std::string bytes;
+  if (FILE* f = fopen(path.c_str(), "rb")) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      bytes.append(buf, n);
+    }
+    fclose(f);
+  }
+  return bytes;
+}
+
+void write_file(const std::string& path, const std::string& bytes) {
+  FILE* f = fopen(path.c_str(), "wb");
+  if (f == nullptr || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size() || fclose(f) != 0) {
+    perror(path.c_str());
+    exit(1);
+  }
+}
+
+ino_t inode(const std::string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_ino : 0;
+}
+
+/* Paths of the files in the test's directory */
+std::vector<std::string> list_files() {
+  std::vector<std::string> files;
+  if (DIR* dir = opendir(g_dir.c_str())) {
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        files.push_back(g_dir + "/" + entry->d_name);
+      }
+    }
+    closedir(dir);
+  }
+  return files;
+}
+
+/* The one cache file of the tier, named by the module's hash */
+std::string cache_file() {
+  const std::string suffix = g_options.regvm ? ".reg.wmc" : ".stack.wmc";
+  for (const auto& path : list_files()) {
+    if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+      return path;
+    }
+  }
+  return "";
+}
+
+std::shared_ptr<const CompiledModule> compile(const std::string& wasm) {
+  return CompiledModule::compile(parse_file(MappedFile::open(wasm.c_str())), g_options);
+}
+
+/* Run main; true if it returned the right sum */
+bool run_main(const std::shared_ptr<const CompiledModule>& compiled) {
+  if (!compiled->invalid().empty()) {
+    return false;
+  }
+  WasmVM vm(compiled);
+  if (!vm.call_main({std::to_string(kArg)})) {
+    return false;
+  }
+  const auto& results = vm.results();
+  return results.size() == 1 && std::get<int32_t>(results[0]) == sum_below(kArg);
+}
+
+/* Compile with {bytes} in the cache file. A file that is rejected is
+ * rebuilt from the module; one that is used must run without crashing,
+ * which a child process finds out. */
+bool runs_safely(const std::string& wasm, const std::string& cache, const std::string& bytes) {
+  write_file(cache, bytes);
+  auto compiled = compile(wasm);
+  if (read_file(cache) != bytes) {
+    return true;
+  }
+  pid_t child = fork();
+  if (child == 0) {
+    // A damaged loop may never end
+    itimerval limit{};
+    limit.it_value.tv_usec = 200000;
+    setitimer(ITIMER_REAL, &limit, nullptr);
+    run_main(compiled);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) || (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM);
+}
+
+int check_tier(const std::string& wasm, const char* tier) {
+  int failed = 0;
+  auto fail = [&](const char* what) {
+    fprintf(stderr, "%s tier: %s\n", tier, what);
+    failed = 1;
+  };
+
+  if (!run_main(compile(wasm))) {
+    fail("cold start went wrong");
+  }
+  const std::string cache = cache_file();
+  const std::string good = read_file(cache);
+  if (good.empty()) {
+    fail("no cache file was written");
+    return failed;
+  }
+  // A warm start uses the file, and only a miss writes a new one
+  const ino_t written = inode(cache);
+  if (!run_main(compile(wasm)) || inode(cache) != written) {
+    fail("warm start did not run from the cache");
+  }
+
+  write_file(cache, good.substr(0, good.size() - 8));
+  if (!run_main(compile(wasm)) || read_file(cache) != good) {
+    fail("truncated file was not replaced");
+  }
+
+  // Every field of the file is a little-endian 32-bit word or a pair of
+  // them: each is made one larger and much larger
+  int crashes = 0;
+  for (size_t word = 0; word + 4 <= good.size(); word += 4) {
+    for (int change = 0; change < 3; ++change) {
+      std::string bad = good;
+      if (change == 0) {
+        bad[word] = static_cast<char>(bad[word] + 1);
+      } else if (change == 1) {
+        bad[word] = static_cast<char>(bad[word] ^ 0xff);
+      } else {
+        bad[word + 3] = static_cast<char>(bad[word + 3] ^ 0xff);
+      }
+      if (!runs_safely(wasm, cache, bad)) {
+        if (crashes++ == 0) {
+          fprintf(stderr, "%s tier: crashed with the word at %zu of %zu changed\n", tier, word, good.size());
+        }
+        failed = 1;
+      }
+    }
+  }
+  if (crashes > 1) {
+    fprintf(stderr, "%s tier: %d more crashes\n", tier, crashes - 1);
+  }
+  write_file(cache, good);
+  return failed;
+}
+
+} // namespace
+
+int main() {
+  char dir[] = "/tmp/module_cache_test.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  g_dir = dir;
+  setenv("WASM_VM_CACHE", dir, 1);
+  g_options.module_cache = true;
+  const std::string wasm = g_dir + "/sum.wasm";
+  write_file(wasm, std::string(reinterpret_cast<const char*>(kSumModule), sizeof(kSumModule)));
+
+  int failed = check_tier(wasm, "stack");
+#if VM_JIT
+  // Compiled code is built from the same stack code
+  g_jit = 1;
+  g_jit_threshold = 0;
+  failed |= check_tier(wasm, "jit");
+  g_jit = 0;
+#endif
+  g_options.regvm = true;
+  failed |= check_tier(wasm, "register");
+
+  for (const auto& path : list_files()) {
+    unlink(path.c_str());
+  }
+  rmdir(dir);
+  return failed;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "common.h"
+
+/* Modules the VM tests run, as binaries so the tests need no wat2wasm.
+ *
+ * kSumModule, with main(n) summing 0..n-1 through a word of its memory:
+ *
+ *   (module
+ *     (memory 1)
+ *     (func $main (export "main") (param i32) (result i32)
+ *       local.get 0
+ *       call $sum)
+ *     (func $sum (param $n i32) (result i32) (local $i i32)
+ *       (i32.store (i32.const 0) (i32.const 0))
+ *       block
+ *         loop
+ *           (br_if 1 (i32.eqz (i32.lt_s (local.get $i) (local.get $n))))
+ *           (i32.store (i32.const 0)
+ *             (i32.add (i32.load (i32.const 0)) (local.get $i)))
+ *           (local.set $i (i32.add (local.get $i) (i32.const 1)))
+ *           br 0
+ *         end
+ *       end
+ *       (i32.load (i32.const 0))))
+ */
+inline const byte kSumModule[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+  0x01, 0x7f, 0x01, 0x7f, 0x03, 0x03, 0x02, 0x00, 0x00, 0x05, 0x03, 0x01,
+  0x00, 0x01, 0x07, 0x08, 0x01, 0x04, 0x6d, 0x61, 0x69, 0x6e, 0x00, 0x00,
+  0x0a, 0x3d, 0x02, 0x06, 0x00, 0x20, 0x00, 0x10, 0x01, 0x0b, 0x34, 0x01,
+  0x01, 0x7f, 0x41, 0x00, 0x41, 0x00, 0x36, 0x02, 0x00, 0x02, 0x40, 0x03,
+  0x40, 0x20, 0x01, 0x20, 0x00, 0x48, 0x45, 0x0d, 0x01, 0x41, 0x00, 0x41,
+  0x00, 0x28, 0x02, 0x00, 0x20, 0x01, 0x6a, 0x36, 0x02, 0x00, 0x20, 0x01,
+  0x41, 0x01, 0x6a, 0x21, 0x01, 0x0c, 0x00, 0x0b, 0x0b, 0x41, 0x00, 0x28,
+  0x02, 0x00, 0x0b,
+};
+
+/* What kSumModule's main returns for {n} */
+inline int32_t sum_below(int32_t n) {
+  return static_cast<int32_t>(static_cast<uint32_t>(n) * static_cast<uint32_t>(n - 1) / 2);
+}
+
+/* kRegOpsModule, whose main(n) makes the register tier run every RegOp for
+ * n >= 2 and returns n * (n + 1) / 2 + 4 * n - 1 and 2.5; main(0) reaches
+ * unreachable and main(1) an instruction the tier does not implement:
+ *
+ *   (module
+ *     (type $ii (func (param i32) (result i32)))
+ *     (table 2 funcref)
+ *     (memory 1)
+ *     (global $g (mut i32) (i32.const 0))
+ *     (elem (i32.const 0) $inc $twice)
+ *     (func $inc (type $ii) (i32.add (local.get 0) (i32.const 1)))
+ *     (func $twice (type $ii) (i32.add (local.get 0) (local.get 0)))
+ *     (func $tail (type $ii) (return_call $inc (local.get 0)))
+ *     (func $tail_indirect (type $ii)
+ *       (return_call_indirect (type $ii) (local.get 0) (i32.const 1)))
+ *     (func $main (export "main") (param $n i32) (result i32 f64)
+ *       (local $i i32) (local $acc i32) (local $f f64)
+ *       (if (i32.eqz (local.get $n)) (then unreachable))
+ *       (if (i32.eq (local.get $n) (i32.const 1))
+ *         (then (drop (i32.mul (local.get $n) (local.get $n)))))
+ *       (local.set $i (local.get $n))
+ *       (local.set $acc (i32.const 0))
+ *       block
+ *         loop
+ *           (br_if 1 (i32.eqz (local.get $i)))
+ *           (local.set $acc (i32.add (local.get $acc) (call $inc (local.get $i))))
+ *           (local.set $i (i32.sub (local.get $i) (i32.const 1)))
+ *           br 0
+ *         end
+ *       end
+ *       (global.set $g (local.get $acc))
+ *       (i32.store (i32.const 8) (global.get $g))
+ *       (local.set $acc (i32.load (i32.const 8)))
+ *       (if (i32.lt_s (local.get $acc) (local.get $n)) (then unreachable))
+ *       (if (i32.lt_s (local.get $acc) (i32.const 0)) (then unreachable))
+ *       (if (i32.eq (local.get $acc) (local.get $n)) (then unreachable))
+ *       (local.set $acc (i32.add (local.get $acc)
+ *         (call_indirect (type $ii) (local.get $n) (i32.const 1))))
+ *       (local.set $acc (i32.sub (local.get $acc) (call $tail (local.get $n))))
+ *       (local.set $acc (i32.add (local.get $acc) (call $tail_indirect (local.get $n))))
+ *       (local.set $f (f64.add (local.get $f) (f64.const 2.5)))
+ *       (select (local.get $acc) (i32.const 0) (local.get $n))
+ *       (local.get $f)))
+ */
+inline const byte kRegOpsModule[] = {
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x0c, 0x02, 0x60,
+  0x01, 0x7f, 0x01, 0x7f, 0x60, 0x01, 0x7f, 0x02, 0x7f, 0x7c, 0x03, 0x06,
+  0x05, 0x00, 0x00, 0x00, 0x00, 0x01, 0x04, 0x04, 0x01, 0x70, 0x00, 0x02,
+  0x05, 0x03, 0x01, 0x00, 0x01, 0x06, 0x06, 0x01, 0x7f, 0x01, 0x41, 0x00,
+  0x0b, 0x07, 0x08, 0x01, 0x04, 0x6d, 0x61, 0x69, 0x6e, 0x00, 0x04, 0x09,
+  0x08, 0x01, 0x00, 0x41, 0x00, 0x0b, 0x02, 0x00, 0x01, 0x0a, 0xc6, 0x01,
+  0x05, 0x07, 0x00, 0x20, 0x00, 0x41, 0x01, 0x6a, 0x0b, 0x07, 0x00, 0x20,
+  0x00, 0x20, 0x00, 0x6a, 0x0b, 0x06, 0x00, 0x20, 0x00, 0x12, 0x00, 0x0b,
+  0x09, 0x00, 0x20, 0x00, 0x41, 0x01, 0x13, 0x00, 0x00, 0x0b, 0xa2, 0x01,
+  0x02, 0x02, 0x7f, 0x01, 0x7c, 0x20, 0x00, 0x45, 0x04, 0x40, 0x00, 0x0b,
+  0x20, 0x00, 0x41, 0x01, 0x46, 0x04, 0x40, 0x20, 0x00, 0x20, 0x00, 0x6c,
+  0x1a, 0x0b, 0x20, 0x00, 0x21, 0x01, 0x41, 0x00, 0x21, 0x02, 0x02, 0x40,
+  0x03, 0x40, 0x20, 0x01, 0x45, 0x0d, 0x01, 0x20, 0x02, 0x20, 0x01, 0x10,
+  0x00, 0x6a, 0x21, 0x02, 0x20, 0x01, 0x41, 0x01, 0x6b, 0x21, 0x01, 0x0c,
+  0x00, 0x0b, 0x0b, 0x20, 0x02, 0x24, 0x00, 0x41, 0x08, 0x23, 0x00, 0x36,
+  0x02, 0x00, 0x41, 0x08, 0x28, 0x02, 0x00, 0x21, 0x02, 0x20, 0x02, 0x20,
+  0x00, 0x48, 0x04, 0x40, 0x00, 0x0b, 0x20, 0x02, 0x41, 0x00, 0x48, 0x04,
+  0x40, 0x00, 0x0b, 0x20, 0x02, 0x20, 0x00, 0x46, 0x04, 0x40, 0x00, 0x0b,
+  0x20, 0x02, 0x20, 0x00, 0x41, 0x01, 0x11, 0x00, 0x00, 0x6a, 0x21, 0x02,
+  0x20, 0x02, 0x20, 0x00, 0x10, 0x02, 0x6b, 0x21, 0x02, 0x20, 0x02, 0x20,
+  0x00, 0x10, 0x03, 0x6a, 0x21, 0x02, 0x20, 0x03, 0x44, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x04, 0x40, 0xa0, 0x21, 0x03, 0x20, 0x02, 0x41, 0x00,
+  0x20, 0x00, 0x1b, 0x20, 0x03, 0x0b,
+};
+
+/* What kRegOpsModule's main returns first for {n} >= 2 */
+inline int32_t reg_ops_result(int32_t n) {
+  return n * (n + 1) / 2 + 4 * n - 1;
+}
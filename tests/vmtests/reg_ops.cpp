@@ -0,0 +1,67 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "parse.h"
+#include "vm.h"
+#include "modules.h"
+
+/* Every RegOp of the register tier: kRegOpsModule is translated to each of
+ * them, and running it takes every handler, under each bounds check. A
+ * handler missing from the dispatch table, or one the table sends the wrong
+ * opcode to, makes main return the wrong values or trap. */
+int main() {
+  CompileOptions register_tier;
+  register_tier.regvm = true;
+  auto compiled = CompiledModule::compile(parse_bytecode(kRegOpsModule, kRegOpsModule + sizeof(kRegOpsModule)),
+                                          register_tier);
+  if (!compiled->invalid().empty()) {
+    fprintf(stderr, "module rejected: %s\n", compiled->invalid().c_str());
+    return 1;
+  }
+
+  int failed = 0;
+  std::vector<bool> emitted(R_OP_COUNT);
+  for (const auto& fc : compiled->funcs()) {
+    for (const auto& ins : fc.rcode) {
+      if (ins.op < R_OP_COUNT) {
+        emitted[ins.op] = true;
+      }
+    }
+  }
+  for (Opcode_t op = 0; op < R_OP_COUNT; ++op) {
+    if (!emitted[op]) {
+      fprintf(stderr, "RegOp %u is not in the translated module\n", op);
+      failed = 1;
+    }
+  }
+
+  for (BoundsCheck bounds : {BoundsCheck::Explicit, BoundsCheck::GuardPages, BoundsCheck::Mask}) {
+    WasmVM vm(compiled, bounds);
+    auto fail = [&](int32_t n, const std::string& what) {
+      fprintf(stderr, "--bounds %s, main(%d): %s\n", bounds_check_name(bounds), n, what.c_str());
+      failed = 1;
+    };
+    for (int32_t n : {2, 10, 1000}) {
+      if (!vm.call_main({std::to_string(n)})) {
+        fail(n, vm.trap_message());
+        continue;
+      }
+      const auto& results = vm.results();
+      if (results.size() != 2 || std::get<int32_t>(results[0]) != reg_ops_result(n) ||
+          std::get<double>(results[1]) != 2.5) {
+        fail(n, "wrong results");
+      }
+    }
+    // The two handlers that trap
+    if (vm.call_main({"0"}) || vm.trap_message() != trap_string(Trap::Unreachable)) {
+      fail(0, "did not trap in unreachable");
+    }
+    if (vm.call_main({"1"}) ||
+        vm.trap_message().compare(0, std::string(trap_string(Trap::UnsupportedOpcode)).size(),
+                                  trap_string(Trap::UnsupportedOpcode)) != 0) {
+      fail(1, "did not trap as unsupported");
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,12 @@
+(module
+  (func (export "main") (param i32) (result i32)
+    (block
+      (block
+        (drop (br_if 2 (i32.const 7) (i32.eqz (local.get 0))))
+        (br 1)
+      )
+      (unreachable)
+    )
+    (i32.const 9)
+  )
+)
@@ -0,0 +1,15 @@
+(module
+  ;; $a and $b are distinct type indices of the same signature
+  (type $a (func (param i32) (result i32)))
+  (type $b (func (param i32) (result i32)))
+  (type $c (func (param i32 i32) (result i32)))
+  (table 3 funcref)
+  (elem (i32.const 0) $inc $double $add)
+  (func $inc (type $a) (i32.add (local.get 0) (i32.const 1)))
+  (func $double (type $b) (i32.add (local.get 0) (local.get 0)))
+  (func $add (type $c) (i32.add (local.get 0) (local.get 1)))
+  ;; Calls table[i] as $b: $inc matches too, $add does not
+  (func (export "main") (type $a)
+    (call_indirect (type $b) (i32.const 20) (local.get 0))
+  )
+)
@@ -0,0 +1,27 @@
+(module
+  (type $i (func (param i32) (result i32)))
+  (table 6 funcref)
+  (elem (i32.const 0) $f1 $f2 $f3 $f4 $f5 $f6)
+  (func $f1 (type $i) (i32.add (local.get 0) (i32.const 1)))
+  (func $f2 (type $i) (i32.add (local.get 0) (i32.const 2)))
+  (func $f3 (type $i) (i32.add (local.get 0) (i32.const 3)))
+  (func $f4 (type $i) (i32.add (local.get 0) (i32.const 4)))
+  (func $f5 (type $i) (i32.add (local.get 0) (i32.const 5)))
+  (func $f6 (type $i) (i32.add (local.get 0) (i32.const 6)))
+  ;; One call site cycling through the first n slots of the table 100
+  ;; times: monomorphic for n = 1, megamorphic for n = 6
+  (func (export "main") (param $n i32) (result i32)
+    (local $i i32) (local $k i32) (local $acc i32)
+    (block $done
+      (loop $next
+        (br_if $done (i32.eq (local.get $i) (i32.const 100)))
+        (local.set $acc (call_indirect (type $i) (local.get $acc) (local.get $k)))
+        (local.set $k (i32.add (local.get $k) (i32.const 1)))
+        (local.set $k (select (i32.const 0) (local.get $k) (i32.eq (local.get $k) (local.get $n))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)
+      )
+    )
+    (local.get $acc)
+  )
+)
@@ -0,0 +1,12 @@
+(module
+  (func $fib (param i32) (result i32)
+    (if (i32.lt_s (local.get 0) (i32.const 2))
+      (then (return (local.get 0))))
+    (i32.add
+      (call $fib (i32.sub (local.get 0) (i32.const 1)))
+      (call $fib (i32.sub (local.get 0) (i32.const 2))))
+  )
+  (func (export "main") (param i32) (result i32)
+    (call $fib (local.get 0))
+  )
+)
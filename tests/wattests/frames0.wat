@@ -0,0 +1,19 @@
+(module
+  ;; depth(n) = n + 1; $z must read as 0 on entry to every frame
+  (func $depth (param $n i32) (result i32) (local $z i32)
+    (local.set $z (i32.add (local.get $z) (i32.const 1)))
+    (drop (br_if 0 (local.get $z) (i32.eqz (local.get $n))))
+    (i32.add (local.get $z) (call $depth (i32.sub (local.get $n) (i32.const 1))))
+  )
+  (func (export "main") (param $n i32) (result i32)
+    (i32.const 1000)
+    ;; the branch discards the operands pushed inside the block
+    (block $out
+      (i32.const 5)
+      (i32.const 6)
+      (br $out)
+    )
+    (call $depth (local.get $n))
+    (i32.add)
+  )
+)
@@ -0,0 +1,25 @@
+(module
+  (memory 1)
+  (func (export "main") (param $n i32) (result i32)
+    (local $i i32) (local $p i32) (local $acc i32)
+    ;; mem[4 + 4*i] = i for i in [0, n)
+    (loop $fill
+      (i32.store offset=4 (local.get $p) (local.get $i))
+      (local.set $p (i32.add (local.get $p) (i32.const 4)))
+      (local.set $i (i32.add (local.get $i) (i32.const 1)))
+      (br_if $fill (i32.lt_s (local.get $i) (local.get $n)))
+    )
+    ;; sum them back
+    (local.set $p (i32.const 0))
+    (block $done
+      (loop $sum
+        (br_if $done (i32.eqz (local.get $i)))
+        (local.set $acc (i32.add (local.get $acc) (i32.load offset=4 (local.get $p))))
+        (local.set $p (i32.add (local.get $p) (i32.const 4)))
+        (local.set $i (i32.sub (local.get $i) (i32.const 1)))
+        (br $sum)
+      )
+    )
+    (local.get $acc)
+  )
+)
@@ -0,0 +1,9 @@
+(module
+  (func (export "main") (param i32) (result i32)
+    (local i32)
+    (if (local.get 0)
+      (then (local.set 1 (i32.const 10)))
+      (else (local.set 1 (i32.const 20))))
+    (local.get 1)
+  )
+)
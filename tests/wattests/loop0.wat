@@ -0,0 +1,14 @@
+(module
+  (func (export "main") (param i32) (result i32)
+    (local i32)
+    (block $done
+      (loop $next
+        (br_if $done (i32.eqz (local.get 0)))
+        (local.set 1 (i32.add (local.get 1) (local.get 0)))
+        (local.set 0 (i32.sub (local.get 0) (i32.const 1)))
+        (br $next)
+      )
+    )
+    (local.get 1)
+  )
+)
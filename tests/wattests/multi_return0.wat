@@ -0,0 +1,22 @@
+(module
+  ;; pair(n) = (fib(n), fib(n + 1)); both results come back through every
+  ;; frame of the recursion, in order
+  (func $pair (param $n i32) (result i32 i32) (local $a i32) (local $b i32)
+    (if (i32.eqz (local.get $n))
+      (then (return (i32.const 0) (i32.const 1))))
+    (call $pair (i32.sub (local.get $n) (i32.const 1)))
+    (local.set $b)
+    (local.set $a)
+    (local.get $b)
+    (i32.add (local.get $a) (local.get $b))
+  )
+  (func $swap (param i32 i32) (result i32 i32)
+    (local.get 1)
+    (local.get 0)
+  )
+  ;; fib(n + 1) - fib(n), which is fib(n - 1)
+  (func (export "main") (param $n i32) (result i32)
+    (call $swap (call $pair (local.get $n)))
+    (i32.sub)
+  )
+)
@@ -0,0 +1,32 @@
+(module
+  (type $pred (func (param i32) (result i32)))
+  (table 2 funcref)
+  (elem (i32.const 0) $is_even $is_odd)
+  ;; count(n, acc) = n + acc, one tail call per step, so n is not bounded by
+  ;; the call depth limit
+  (func $count (param $n i32) (param $acc i32) (result i32)
+    (if (i32.eqz (local.get $n))
+      (then (return (local.get $acc))))
+    (return_call $count
+      (i32.sub (local.get $n) (i32.const 1))
+      (i32.add (local.get $acc) (i32.const 1)))
+  )
+  ;; Mutual recursion through the table
+  (func $is_even (param $n i32) (result i32)
+    (if (i32.eqz (local.get $n))
+      (then (return (i32.const 1))))
+    (return_call_indirect (type $pred) (i32.sub (local.get $n) (i32.const 1)) (i32.const 1))
+  )
+  (func $is_odd (param $n i32) (result i32)
+    (if (i32.eqz (local.get $n))
+      (then (return (i32.const 0))))
+    (return_call_indirect (type $pred) (i32.sub (local.get $n) (i32.const 1)) (i32.const 0))
+  )
+  ;; The callee takes more params than this frame has locals
+  (func $start (param $n i32) (result i32)
+    (return_call $count (local.get $n) (i32.const 0))
+  )
+  (func (export "main") (param $n i32) (result i32)
+    (i32.add (call $start (local.get $n)) (call $is_even (local.get $n)))
+  )
+)
@@ -12,4 +12,74 @@ file (GLOB_RECURSE VM_LIB_SRCS
 add_library (vm ${VM_LIB_SRCS})
 target_include_directories (vm PRIVATE ${VM_DIR}/inc ${VM_DIR})
 
+# Interpreter dispatch: "threaded" (computed goto, GCC/Clang only) or "switch"
+if (CMAKE_CXX_COMPILER_ID MATCHES "GNU|Clang")
+  set (VM_DISPATCH "threaded" CACHE STRING "Interpreter dispatch strategy (threaded|switch)")
+else ()
+  set (VM_DISPATCH "switch" CACHE STRING "Interpreter dispatch strategy (threaded|switch)")
+endif ()
+set_property (CACHE VM_DISPATCH PROPERTY STRINGS threaded switch)
+if (VM_DISPATCH STREQUAL "threaded")
+  target_compile_definitions (vm PRIVATE VM_THREADED_DISPATCH=1)
+elseif (NOT VM_DISPATCH STREQUAL "switch")
+  message (FATAL_ERROR "VM_DISPATCH must be 'threaded' or 'switch', got '${VM_DISPATCH}'")
+endif ()
+
+# Keep the top operand of the stack interpreter in a register
+option (VM_TOS_CACHE "Cache the top of the operand stack in execute()" ON)
+if (VM_TOS_CACHE)
+  target_compile_definitions (vm PRIVATE VM_TOS_CACHE=1)
+endif ()
+
+# Re-check stack heights and indices that validation already guarantees
+option (VM_CHECKED "Keep validated runtime checks in the interpreter" OFF)
+if (VM_CHECKED)
+  target_compile_definitions (vm PRIVATE VM_CHECKED=1)
+endif ()
+
+# Trace output compiled in: "off", "calls" (loading, translation, calls and
+# returns) or "instructions" (also every executed instruction). --trace
+# selects it at run time; "off" leaves no trace code in the interpreter.
+if (CMAKE_BUILD_TYPE STREQUAL "Debug")
+  set (VM_TRACE "instructions" CACHE STRING "Compiled-in trace level (off|calls|instructions)")
+else ()
+  set (VM_TRACE "off" CACHE STRING "Compiled-in trace level (off|calls|instructions)")
+endif ()
+set_property (CACHE VM_TRACE PROPERTY STRINGS off calls instructions)
+if (VM_TRACE STREQUAL "off")
+  set (VM_TRACE_LEVEL 0)
+elseif (VM_TRACE STREQUAL "calls")
+  set (VM_TRACE_LEVEL 1)
+elseif (VM_TRACE STREQUAL "instructions")
+  set (VM_TRACE_LEVEL 2)
+else ()
+  message (FATAL_ERROR "VM_TRACE must be 'off', 'calls' or 'instructions', got '${VM_TRACE}'")
+endif ()
+# Public: the executable's own TRACE calls follow the same level
+target_compile_definitions (vm PUBLIC VM_TRACE_LEVEL=${VM_TRACE_LEVEL})
+
+# Baseline native compiler behind --jit; it emits x86-64 and maps code with
+# mmap, so it is only built there
+option (VM_JIT "Build the x86-64 baseline compiler (--jit)" ON)
+if (VM_JIT AND UNIX AND CMAKE_SYSTEM_PROCESSOR MATCHES "x86_64|AMD64|amd64")
+  # Public: main.cpp reports --jit in builds without it
+  target_compile_definitions (vm PUBLIC VM_JIT=1)
+else ()
+  target_compile_definitions (vm PUBLIC VM_JIT=0)
+endif ()
+
+# Ahead-of-time translation to C behind --aot; the result is built with the
+# system C compiler at run time and loaded with dlopen
+option (VM_AOT "Support running modules translated to C (--aot)" ON)
+if (VM_AOT AND UNIX)
+  target_compile_definitions (vm PUBLIC VM_AOT=1)
+  target_link_libraries (vm PUBLIC ${CMAKE_DL_LIBS})
+else ()
+  target_compile_definitions (vm PUBLIC VM_AOT=0)
+endif ()
+
+# Native code runs on a thread with a stack sized for deep recursion
+find_package (Threads REQUIRED)
+target_link_libraries (vm PUBLIC Threads::Threads)
+
 install (TARGETS vm DESTINATION .)